@@ -3,22 +3,57 @@
 #include "expr.hpp"
 #include "step.hpp"
 #include "parse.hpp"
+#include "vm.hpp"
+#include "resolve.hpp"
+#include "arena.hpp"
+#include "passes.hpp"
+#include "gc.hpp"
 
 //interp mode
 std::string interp(std::istream& input) {
-    std::string output = parse(input)->interp(Env::emptyenv)->to_string();
+    ParseSession session;
+    Heap heap;
+    CurrentHeap current(&heap);
+    std::string output = resolve(parse(input))->interp(Env::emptyenv).to_string();
     return output;
 }
 
 //step_interp mode
 std::string step_interp(std::istream &input) {
-    std::string output = Step::interp_by_steps(parse(input))->to_string();
+    return step_interp(input, 0, nullptr);
+}
+
+std::string step_interp(std::istream &input, size_t heap_limit, GCStats *stats) {
+    ParseSession session;
+    Heap heap;
+    CurrentHeap current(&heap);
+    StepMachine machine;
+    machine.heap.limit = heap_limit;
+    std::string output;
+    try {
+        output = machine.interp_by_steps(resolve(parse(input))).to_string();
+    } catch (...) {
+        if (stats != nullptr)
+            *stats = machine.heap.stats;
+        throw;
+    }
+    if (stats != nullptr)
+        *stats = machine.heap.stats;
     return output;
 }
 
 //optimizer mode
 std::string optimizer(std::istream& input) {
-    std::string output = parse(input)->optimizer()->to_string();
+    ParseSession session;
+    Heap heap;
+    CurrentHeap current(&heap);
+    std::string output = optimize(parse(input))->to_string();
     return output;
 }
 
+//vm mode
+std::string vm_interp(std::istream& input) {
+    ParseSession session;
+    std::string output = VM::interp(resolve(parse(input)));
+    return output;
+}
@@ -12,10 +12,23 @@
 #include <string>
 #include <sstream>
 
+// Each entry point parses `input` into its own arena, and
+// allocates values from its own heap; both are released
+// before returning.
+
 std::string interp(std::istream& input);
 
 std::string step_interp(std::istream &input);
 
+struct GCStats;
+
+/* Like `step_interp`, but evaluation fails once more than
+ `heap_limit` bytes survive a collection (0 for no limit),
+ and if `stats` isn't NULL it gets what the collector did. */
+std::string step_interp(std::istream &input, size_t heap_limit, GCStats *stats);
+
 std::string optimizer(std::istream& input);
 
+std::string vm_interp(std::istream& input);
+
 #endif /* API_hpp */
@@ -0,0 +1,197 @@
+//
+//  arena.cpp
+//  ArithemticParser2
+//
+//  Region allocation for expression trees.
+//
+
+#include <stdlib.h>
+#include <new>
+#include "arena.hpp"
+#include "expr.hpp"
+
+static const size_t block_size = 64 * 1024;
+static const size_t alignment = 16;
+
+thread_local Arena *Arena::current = nullptr;
+
+Arena::Arena() {
+    first_block_size = 0;
+    next = nullptr;
+    limit = nullptr;
+    allocated = 0;
+    interned_count = 0;
+}
+
+Arena::~Arena() {
+    destroy_nodes();
+    for (size_t i = 0; i < blocks.size(); i++)
+        free(blocks[i]);
+}
+
+void Arena::add_block(size_t size) {
+    char *block = (char *)malloc(size);
+    if (block == nullptr)
+        throw std::bad_alloc();
+    if (blocks.empty())
+        first_block_size = size;
+    blocks.push_back(block);
+    next = block;
+    limit = block + size;
+}
+
+void *Arena::allocate(size_t size) {
+    size = (size + alignment - 1) & ~(alignment - 1);
+    if (next == nullptr || (size_t)(limit - next) < size)
+        add_block(size > block_size / 4 ? size : block_size);
+    
+    void *p = next;
+    next += size;
+    allocated += size;
+    nodes.push_back((PTR(Expr))p);
+    return p;
+}
+
+void Arena::release(void *p) {
+    if (!nodes.empty() && nodes.back() == (PTR(Expr))p)
+        nodes.pop_back();
+}
+
+void Arena::destroy_nodes() {
+    interned.clear();
+    interned_count = 0;
+    for (size_t i = 0; i < nodes.size(); i++)
+        nodes[i]->~Expr();
+    nodes.clear();
+}
+
+void Arena::reset() {
+    destroy_nodes();
+    for (size_t i = 1; i < blocks.size(); i++)
+        free(blocks[i]);
+    if (blocks.size() > 1)
+        blocks.resize(1);
+    next = blocks.empty() ? nullptr : blocks[0];
+    limit = blocks.empty() ? nullptr : blocks[0] + first_block_size;
+    allocated = 0;
+}
+
+// The first slot to probe for `hash`. Node hashes are built
+// by mixing child hashes, so their low bits alone cluster
+// badly along long spines; multiplying spreads every bit.
+static size_t home_slot(size_t hash, size_t mask) {
+    return (size_t)((hash * 0x9e3779b97f4a7c15ULL) >> 32) & mask;
+}
+
+PTR(Expr) Arena::find_interned(PTR(Expr) e) {
+    if (interned.empty())
+        return nullptr;
+    size_t mask = interned.size() - 1;
+    for (size_t i = home_slot(e->hash, mask); interned[i] != nullptr; i = (i + 1) & mask) {
+        if (interned[i]->hash == e->hash && interned[i]->same_node(e))
+            return interned[i];
+    }
+    return nullptr;
+}
+
+void Arena::intern(PTR(Expr) e) {
+    if (2 * (interned_count + 1) > interned.size())
+        grow_interned();
+    size_t mask = interned.size() - 1;
+    size_t i = home_slot(e->hash, mask);
+    while (interned[i] != nullptr)
+        i = (i + 1) & mask;
+    interned[i] = e;
+    interned_count++;
+}
+
+void Arena::grow_interned() {
+    std::vector<PTR(Expr)> old;
+    old.swap(interned);
+    interned.assign(old.empty() ? 1024 : 2 * old.size(), nullptr);
+    interned_count = 0;
+    for (size_t i = 0; i < old.size(); i++) {
+        if (old[i] != nullptr)
+            intern(old[i]);
+    }
+}
+
+size_t Arena::bytes_allocated() {
+    return allocated;
+}
+
+ParseSession::ParseSession() {
+    saved = Arena::current;
+    Arena::current = &arena;
+}
+
+ParseSession::~ParseSession() {
+    Arena::current = saved;
+}
+
+/* for tests */
+#include <sstream>
+#include "parse.hpp"
+#include "catch.hpp"
+
+TEST_CASE( "arena" ) {
+    ParseSession outer;
+    CHECK( Arena::current == &outer.arena );
+    {
+        ParseSession inner;
+        CHECK( Arena::current == &inner.arena );
+        std::stringstream input("_let x = 1 _in x + 2");
+        PTR(Expr) e = parse(input);
+        CHECK( e->to_string() == "(_let x = 1 _in (x + 2))" );
+        CHECK( inner.arena.bytes_allocated() > 0 );
+        CHECK( outer.arena.bytes_allocated() == 0 );
+        
+        // Enough nodes for several blocks, all released at once
+        std::string sum = "0";
+        for (int i = 1; i < 10000; i++)
+            sum += " + " + std::to_string(i);
+        std::stringstream long_input(sum);
+        CHECK( parse(long_input)->node_count == 19999 );
+        CHECK( inner.arena.bytes_allocated() > 256 * 1024 );
+        inner.arena.reset();
+        CHECK( inner.arena.bytes_allocated() == 0 );
+        CHECK( MAKE(NumExpr)(1)->to_string() == "1" );
+    }
+    CHECK( Arena::current == &outer.arena );
+}
+
+TEST_CASE( "hash-consing" ) {
+    ParseSession session;
+    PTR(Expr) a = MAKE(AddExpr)(MAKE(VarExpr)("x"), MAKE(NumExpr)(1));
+    PTR(Expr) b = MAKE(AddExpr)(MAKE(VarExpr)("x"), MAKE(NumExpr)(1));
+    CHECK( a == b );
+    CHECK( MAKE(AddExpr)(MAKE(NumExpr)(1), MAKE(VarExpr)("x")) != a );
+    
+    // Repeated subtrees of a parse are shared
+    std::stringstream input("(x + 1) * (x + 1)");
+    PTR(MultExpr) m = CAST(MultExpr)(parse(input));
+    REQUIRE( m != nullptr );
+    CHECK( m->lhs == a );
+    CHECK( m->rhs == a );
+    
+    // Enough distinct nodes to grow the table many times,
+    // each still found again
+    std::vector<PTR(Expr)> made;
+    for (int i = 0; i < 50000; i++)
+        made.push_back(MAKE(AddExpr)(MAKE(NumExpr)(i), MAKE(VarExpr)("y")));
+    for (int i = 0; i < 50000; i += 997)
+        CHECK( MAKE(AddExpr)(MAKE(NumExpr)(i), MAKE(VarExpr)("y")) == made[i] );
+    
+    // Nodes from elsewhere are equal without being the same,
+    // and so are ones with different addresses resolved
+    {
+        ParseSession elsewhere;
+        PTR(Expr) other = MAKE(AddExpr)(MAKE(VarExpr)("x"), MAKE(NumExpr)(1));
+        CHECK( other != a );
+        CHECK( other->equals(a) );
+        CHECK( other->hash == a->hash );
+    }
+    PTR(Expr) resolved = MAKE(AddExpr)(MAKE(VarExpr)("x", 2, 3), MAKE(NumExpr)(1));
+    CHECK( resolved != a );
+    CHECK( resolved->equals(a) );
+}
@@ -0,0 +1,79 @@
+//
+//  arena.hpp
+//  ArithemticParser2
+//
+//  Region allocation for expression trees.
+//
+
+#ifndef arena_hpp
+#define arena_hpp
+
+#include <stddef.h>
+#include <vector>
+#include "pointer.hpp"
+
+class Expr;
+
+/* A bump allocator for `Expr` nodes. Nodes are never
+ freed one at a time; destroying (or resetting) the
+ arena runs their destructors and releases every block
+ at once. */
+class Arena {
+public:
+    Arena();
+    ~Arena();
+    
+    void *allocate(size_t size);
+    
+    // Called by `Expr::operator delete`, which only happens
+    // when a constructor throws
+    void release(void *p);
+    
+    // Destroy every node, but keep the first block so that
+    // a worker reusing the arena stays at a constant size.
+    void reset();
+    
+    size_t bytes_allocated();
+    
+    // The node made in this arena with the same fields and
+    // children as `e`, or NULL; see `Expr::make`
+    PTR(Expr) find_interned(PTR(Expr) e);
+    void intern(PTR(Expr) e);
+    
+    /* The arena that `NEW` allocates expressions from,
+     or NULL to use the global heap. */
+    static thread_local Arena *current;
+    
+private:
+    std::vector<char *> blocks;
+    size_t first_block_size;
+    char *next;
+    char *limit;
+    size_t allocated;
+    std::vector<PTR(Expr)> nodes;
+    // Open-addressed table of interned nodes: a power of
+    // two in size, at most half full, probed linearly
+    std::vector<PTR(Expr)> interned;
+    size_t interned_count;
+    
+    void add_block(size_t size);
+    void destroy_nodes();
+    void grow_interned();
+};
+
+/* Makes its arena current for as long as it lives, so that
+ everything `parse`, `resolve` and the optimizer build in
+ between is released together. Values returned by `interp`
+ can refer to the tree and must not outlive the session. */
+class ParseSession {
+public:
+    Arena arena;
+    
+    ParseSession();
+    ~ParseSession();
+    
+private:
+    Arena *saved;
+};
+
+#endif /* arena_hpp */
@@ -13,14 +13,28 @@
 #include "expr.hpp"
 
 
+void *Cont::operator new(size_t size) {
+    if (Heap::current != nullptr)
+        return Heap::current->allocate_pooled(size);
+    return Collectable::operator new(size);
+}
+
+// Only reached when a constructor throws; `Heap::release`
+// puts a pooled block back on its free list
+void Cont::operator delete(void *p) {
+    Collectable::operator delete(p);
+}
+
 PTR(Cont) Cont::done = NEW(DoneCont)();
 
 DoneCont::DoneCont() { }
 
-void DoneCont::step_continue() {
+void DoneCont::step_continue(StepMachine &step) {
     throw std::runtime_error("can't continue done");
 }
 
+void DoneCont::trace(Heap &heap) { }
+
 
 RightThenAddCont::RightThenAddCont(PTR(Expr) rhs, PTR(Env) env, PTR(Cont) rest) {
     this->rhs = rhs;
@@ -28,24 +42,44 @@ RightThenAddCont::RightThenAddCont(PTR(Expr) rhs, PTR(Env) env, PTR(Cont) rest)
     this->rest = rest;
 }
 
-void RightThenAddCont::step_continue() {
-    PTR(Val) lhs_val = Step::val;
-    Step::mode = Step::interp_mode;
-    Step::expr = rhs;
-    Step::env = env;
-    Step::cont = NEW(AddCont)(lhs_val, rest);
+void RightThenAddCont::step_continue(StepMachine &step) {
+    deliver(step, step.val, rhs, env, rest);
+}
+
+void RightThenAddCont::deliver(StepMachine &step, Val lhs_val, PTR(Expr) rhs, PTR(Env) env, PTR(Cont) rest) {
+    Val rhs_val;
+    if (rhs->step_atomic(env, rhs_val)) {
+        step.mode = StepMachine::continue_mode;
+        step.val = lhs_val.add_to(rhs_val);
+        step.cont = rest;
+        return;
+    }
+    step.mode = StepMachine::interp_mode;
+    step.expr = rhs;
+    step.env = env;
+    step.cont = NEW(AddCont)(lhs_val, rest);
+}
+
+void RightThenAddCont::trace(Heap &heap) {
+    heap.mark(env);
+    heap.mark(rest);
 }
 
-AddCont::AddCont(PTR(Val) lhs_val, PTR(Cont) rest) {
+AddCont::AddCont(Val lhs_val, PTR(Cont) rest) {
     this->lhs_val = lhs_val;
     this->rest = rest;
 }
 
-void AddCont::step_continue() {
-    PTR(Val) rhs_val = Step::val;
-    Step::mode = Step::continue_mode;
-    Step::val = lhs_val->add_to(rhs_val);
-    Step::cont = rest;
+void AddCont::step_continue(StepMachine &step) {
+    Val rhs_val = step.val;
+    step.mode = StepMachine::continue_mode;
+    step.val = lhs_val.add_to(rhs_val);
+    step.cont = rest;
+}
+
+void AddCont::trace(Heap &heap) {
+    lhs_val.trace(heap);
+    heap.mark(rest);
 }
 
 RightThenMultCont::RightThenMultCont(PTR(Expr) rhs, PTR(Env) env, PTR(Cont) rest) {
@@ -54,24 +88,44 @@ RightThenMultCont::RightThenMultCont(PTR(Expr) rhs, PTR(Env) env, PTR(Cont) rest
     this->rest = rest;
 }
 
-void RightThenMultCont::step_continue() {
-    PTR(Val) lhs_val = Step::val;
-    Step::mode = Step::interp_mode;
-    Step::expr = rhs;
-    Step::env = env;
-    Step::cont = NEW(MultCont)(lhs_val, rest);
+void RightThenMultCont::step_continue(StepMachine &step) {
+    deliver(step, step.val, rhs, env, rest);
 }
 
-MultCont::MultCont(PTR(Val) lhs_val, PTR(Cont) rest) {
+void RightThenMultCont::deliver(StepMachine &step, Val lhs_val, PTR(Expr) rhs, PTR(Env) env, PTR(Cont) rest) {
+    Val rhs_val;
+    if (rhs->step_atomic(env, rhs_val)) {
+        step.mode = StepMachine::continue_mode;
+        step.val = lhs_val.mult_with(rhs_val);
+        step.cont = rest;
+        return;
+    }
+    step.mode = StepMachine::interp_mode;
+    step.expr = rhs;
+    step.env = env;
+    step.cont = NEW(MultCont)(lhs_val, rest);
+}
+
+void RightThenMultCont::trace(Heap &heap) {
+    heap.mark(env);
+    heap.mark(rest);
+}
+
+MultCont::MultCont(Val lhs_val, PTR(Cont) rest) {
     this->lhs_val = lhs_val;
     this->rest = rest;
 }
 
-void MultCont::step_continue() {
-    PTR(Val) rhs_val = Step::val;
-    Step::mode = Step::continue_mode;
-    Step::val = lhs_val->mult_with(rhs_val);
-    Step::cont = rest;
+void MultCont::step_continue(StepMachine &step) {
+    Val rhs_val = step.val;
+    step.mode = StepMachine::continue_mode;
+    step.val = lhs_val.mult_with(rhs_val);
+    step.cont = rest;
+}
+
+void MultCont::trace(Heap &heap) {
+    lhs_val.trace(heap);
+    heap.mark(rest);
 }
 
 RightThenCompCont::RightThenCompCont(PTR(Expr) rhs, PTR(Env) env, PTR(Cont) rest) {
@@ -80,42 +134,71 @@ RightThenCompCont::RightThenCompCont(PTR(Expr) rhs, PTR(Env) env, PTR(Cont) rest
     this->rest = rest;
 }
 
-void RightThenCompCont::step_continue() {
-    PTR(Val) lhs_val = Step::val;
-    Step::mode = Step::interp_mode;
-    Step::expr = rhs;
-    Step::env = env;
-    Step::cont = NEW(CompCont)(lhs_val, rest);
+void RightThenCompCont::step_continue(StepMachine &step) {
+    deliver(step, step.val, rhs, env, rest);
+}
+
+void RightThenCompCont::deliver(StepMachine &step, Val lhs_val, PTR(Expr) rhs, PTR(Env) env, PTR(Cont) rest) {
+    Val rhs_val;
+    if (rhs->step_atomic(env, rhs_val)) {
+        step.mode = StepMachine::continue_mode;
+        step.val = Val::boolean(lhs_val.equals(rhs_val));
+        step.cont = rest;
+        return;
+    }
+    step.mode = StepMachine::interp_mode;
+    step.expr = rhs;
+    step.env = env;
+    step.cont = NEW(CompCont)(lhs_val, rest);
+}
+
+void RightThenCompCont::trace(Heap &heap) {
+    heap.mark(env);
+    heap.mark(rest);
 }
 
-CompCont::CompCont(PTR(Val) lhs_val, PTR(Cont) rest) {
+CompCont::CompCont(Val lhs_val, PTR(Cont) rest) {
     this->lhs_val = lhs_val;
     this->rest = rest;
 }
 
-void CompCont::step_continue() {
-    PTR(Val) rhs_val = Step::val;
-    Step::mode = Step::continue_mode;
-    if (lhs_val->equals(rhs_val))
-        Step::val = NEW(BoolVal)(true);
+void CompCont::step_continue(StepMachine &step) {
+    Val rhs_val = step.val;
+    step.mode = StepMachine::continue_mode;
+    if (lhs_val.equals(rhs_val))
+        step.val = Val::boolean(true);
     else
-        Step::val = NEW(BoolVal)(false);
-    Step::cont = rest;
+        step.val = Val::boolean(false);
+    step.cont = rest;
 }
 
-LetCont::LetCont(std::string var, PTR(Expr) body, PTR(Env) env, PTR(Cont) rest) {
-    this->var = var;
+void CompCont::trace(Heap &heap) {
+    lhs_val.trace(heap);
+    heap.mark(rest);
+}
+
+LetCont::LetCont(int slot, PTR(Expr) body, PTR(Env) env, PTR(Cont) rest) {
+    this->slot = slot;
     this->body = body;
     this->env = env;
     this->rest = rest;
 }
 
-void LetCont::step_continue() {
-    PTR(Val) rhs_val = Step::val;
-    Step::mode = Step::interp_mode;
-    Step::env = NEW(ExtendedEnv)(var, rhs_val, Step::env);
-    Step::expr = body;
-    Step::cont = rest;
+void LetCont::step_continue(StepMachine &step) {
+    deliver(step, step.val, slot, body, env, rest);
+}
+
+void LetCont::deliver(StepMachine &step, Val rhs_val, int slot, PTR(Expr) body, PTR(Env) env, PTR(Cont) rest) {
+    env->set(slot, rhs_val);
+    step.mode = StepMachine::interp_mode;
+    step.env = env;
+    step.expr = body;
+    step.cont = rest;
+}
+
+void LetCont::trace(Heap &heap) {
+    heap.mark(env);
+    heap.mark(rest);
 }
 
 IfCont::IfCont(PTR(Expr) then_part, PTR(Expr) else_part, PTR(Env) env, PTR(Cont) rest) {
@@ -125,19 +208,26 @@ IfCont::IfCont(PTR(Expr) then_part, PTR(Expr) else_part, PTR(Env) env, PTR(Cont)
     this->rest = rest;
 }
 
-void IfCont::step_continue() {
-    PTR(BoolVal) if_val = CAST(BoolVal)(Step::val);
-    
-    if (if_val == NULL){
+void IfCont::step_continue(StepMachine &step) {
+    deliver(step, step.val, then_part, else_part, env, rest);
+}
+
+void IfCont::deliver(StepMachine &step, Val if_val, PTR(Expr) then_part, PTR(Expr) else_part, PTR(Env) env, PTR(Cont) rest) {
+    if (!if_val.is_bool()){
         throw std::runtime_error("if part doesn't evaluate to a bool val!");
-    }else if (if_val->rep == true){
-        Step::expr = then_part;
+    }else if (if_val.bool_rep() == true){
+        step.expr = then_part;
     }else{
-        Step::expr = else_part;
+        step.expr = else_part;
     }
-    Step::env = env;
-    Step::mode = Step::interp_mode;
-    Step::cont = rest;
+    step.env = env;
+    step.mode = StepMachine::interp_mode;
+    step.cont = rest;
+}
+
+void IfCont::trace(Heap &heap) {
+    heap.mark(env);
+    heap.mark(rest);
 }
 
 ArgThenCallCont::ArgThenCallCont(PTR(Expr) actual_arg, PTR(Env) env, PTR(Cont) rest) {
@@ -146,19 +236,72 @@ ArgThenCallCont::ArgThenCallCont(PTR(Expr) actual_arg, PTR(Env) env, PTR(Cont) r
     this->rest = rest;
 }
 
-void ArgThenCallCont::step_continue() {
-    PTR(Val) to_be_called = Step::val;
-    Step::mode = Step::interp_mode;
-    Step::expr = actual_arg;
-    Step::env = env;
-    Step::cont = NEW(CallCont)(to_be_called, rest);
+void ArgThenCallCont::step_continue(StepMachine &step) {
+    deliver(step, step.val, actual_arg, env, rest);
 }
 
-CallCont::CallCont(PTR(Val) to_be_called, PTR(Cont) rest) {
+void ArgThenCallCont::deliver(StepMachine &step, Val to_be_called, PTR(Expr) actual_arg, PTR(Env) env, PTR(Cont) rest) {
+    Val arg_val;
+    if (actual_arg->step_atomic(env, arg_val)) {
+        to_be_called.call_step(step, arg_val, rest);
+        return;
+    }
+    step.mode = StepMachine::interp_mode;
+    step.expr = actual_arg;
+    step.env = env;
+    step.cont = NEW(CallCont)(to_be_called, rest);
+}
+
+void ArgThenCallCont::trace(Heap &heap) {
+    heap.mark(env);
+    heap.mark(rest);
+}
+
+CallCont::CallCont(Val to_be_called, PTR(Cont) rest) {
     this->to_be_called = to_be_called;
     this->rest = rest;
 }
 
-void CallCont::step_continue() {
-    to_be_called->call_step(Step::val, rest);
+void CallCont::step_continue(StepMachine &step) {
+    to_be_called.call_step(step, step.val, rest);
+}
+
+void CallCont::trace(Heap &heap) {
+    to_be_called.trace(heap);
+    heap.mark(rest);
+}
+
+/* for tests */
+#include <sstream>
+#include "parse.hpp"
+#include "resolve.hpp"
+#include "arena.hpp"
+#include "catch.hpp"
+
+TEST_CASE( "pooled continuations" ) {
+    StepMachine machine;
+    Heap &heap = machine.heap;
+    {
+        CurrentHeap current(&heap);
+        PTR(Cont) first = NEW(AddCont)(Val::num(1), Cont::done);
+        CHECK( heap.stats.live_objects == 1 );
+        // Recycled, its block is the next one of that size
+        heap.recycle(first);
+        CHECK( heap.stats.live_objects == 0 );
+        CHECK( NEW(AddCont)(Val::num(2), Cont::done) == first );
+        // Delete, as after a throwing constructor, returns it too
+        delete first;
+        CHECK( heap.stats.live_objects == 0 );
+        CHECK( NEW(AddCont)(Val::num(3), Cont::done) == first );
+        heap.recycle(first);
+    }
+    
+    // A loop of calls needs no more continuations at once
+    // than one iteration does, so each is recycled
+    ParseSession session;
+    std::stringstream input("_let loop = _fun (f) _fun (n) _if n == 0 _then 0 _else f(f)(n + -1) "
+                            "_in loop(loop)(100000)");
+    CHECK( machine.interp_by_steps(resolve(parse(input))).to_string() == "0" );
+    CHECK( heap.stats.objects_recycled >= 300000 );
+    CHECK( heap.stats.peak_bytes < 2 * 1024 * 1024 );
 }
@@ -12,23 +12,41 @@
 #include <stdio.h>
 #include <iostream>
 #include "pointer.hpp"
+#include "gc.hpp"
+#include "value.hpp"
 
 class Expr;
-class Val;
 class Env;
-
-class Cont ENABLE_THIS(Cont) {
+class StepMachine;
+
+/* Each continuation that waits for a first value before
+ evaluating more has a static `deliver`, doing what
+ delivering that value to it would do. Expressions call it
+ directly when the first value needs no steps (see
+ `Expr::step_atomic`), so the continuation is never made;
+ `deliver` in turn skips the next continuation when the
+ expression it would wait on is atomic too. */
+class Cont : public Collectable {
 public:
     /* To take one step in the computation starting
      with this continuation, reading from the registers
-     in `Step` and updating them to indicate the next
-     step. The `Step::cont` register will contain
+     in `step` and updating them to indicate the next
+     step. The `step.cont` register will contain
      this continuation (so it's uninteresting), and
-     the `Step::val` register will contain the value
+     the `step.val` register will contain the value
      that this continuaion was waiting form.
-     The `Step::expr` register is unspecified
+     The `step.expr` register is unspecified
      (i.e., must not be used by this method). */
-    virtual void step_continue() = 0;
+    virtual void step_continue(StepMachine &step) = 0;
+    
+    /* Each continuation receives its value once, and then
+     nothing refers to it, so they come from the current
+     heap's pool and the machine recycles each one as soon
+     as it has been delivered to (see `Heap::recycle`). */
+    static void *operator new(size_t size);
+    // Matches `operator new`, returning pooled blocks to
+    // their free list
+    static void operator delete(void *p);
     
     static PTR(Cont) done;
 };
@@ -36,7 +54,8 @@ public:
 class DoneCont : public Cont {
 public:
     DoneCont();
-    void step_continue();
+    void step_continue(StepMachine &step);
+    void trace(Heap &heap);
 };
 
 class RightThenAddCont : public Cont {
@@ -46,16 +65,19 @@ public:
     PTR(Cont) rest;
     
     RightThenAddCont(PTR(Expr) rhs, PTR(Env) env, PTR(Cont) rest);
-    void step_continue();
+    void step_continue(StepMachine &step);
+    static void deliver(StepMachine &step, Val lhs_val, PTR(Expr) rhs, PTR(Env) env, PTR(Cont) rest);
+    void trace(Heap &heap);
 };
 
 class AddCont : public Cont {
 public:
-    PTR(Val) lhs_val;
+    Val lhs_val;
     PTR(Cont) rest;
     
-    AddCont(PTR(Val) lhs_val, PTR(Cont) rest);
-    void step_continue();
+    AddCont(Val lhs_val, PTR(Cont) rest);
+    void step_continue(StepMachine &step);
+    void trace(Heap &heap);
 };
 
 class RightThenMultCont : public Cont {
@@ -65,16 +87,19 @@ public:
     PTR(Cont) rest;
     
     RightThenMultCont(PTR(Expr) rhs, PTR(Env) env, PTR(Cont) rest);
-    void step_continue();
+    void step_continue(StepMachine &step);
+    static void deliver(StepMachine &step, Val lhs_val, PTR(Expr) rhs, PTR(Env) env, PTR(Cont) rest);
+    void trace(Heap &heap);
 };
 
 class MultCont : public Cont {
 public:
-    PTR(Val) lhs_val;
+    Val lhs_val;
     PTR(Cont) rest;
     
-    MultCont(PTR(Val) lhs_val, PTR(Cont) rest);
-    void step_continue();
+    MultCont(Val lhs_val, PTR(Cont) rest);
+    void step_continue(StepMachine &step);
+    void trace(Heap &heap);
 };
 
 class RightThenCompCont : public Cont {
@@ -84,27 +109,32 @@ public:
     PTR(Cont) rest;
     
     RightThenCompCont(PTR(Expr) rhs, PTR(Env) env, PTR(Cont) rest);
-    void step_continue();
+    void step_continue(StepMachine &step);
+    static void deliver(StepMachine &step, Val lhs_val, PTR(Expr) rhs, PTR(Env) env, PTR(Cont) rest);
+    void trace(Heap &heap);
 };
 
 class CompCont : public Cont {
 public:
-    PTR(Val) lhs_val;
+    Val lhs_val;
     PTR(Cont) rest;
     
-    CompCont(PTR(Val) lhs_val, PTR(Cont) rest);
-    void step_continue();
+    CompCont(Val lhs_val, PTR(Cont) rest);
+    void step_continue(StepMachine &step);
+    void trace(Heap &heap);
 };
 
 class LetCont : public Cont {
 public:
-    std::string var;
+    int slot;
     PTR(Expr) body;
     PTR(Env) env;
     PTR(Cont) rest;
     
-    LetCont(std::string var, PTR(Expr) body, PTR(Env) env, PTR(Cont) rest);
-    void step_continue();
+    LetCont(int slot, PTR(Expr) body, PTR(Env) env, PTR(Cont) rest);
+    void step_continue(StepMachine &step);
+    static void deliver(StepMachine &step, Val rhs_val, int slot, PTR(Expr) body, PTR(Env) env, PTR(Cont) rest);
+    void trace(Heap &heap);
 };
 
 class IfCont : public Cont {
@@ -115,7 +145,9 @@ public:
     PTR(Cont) rest;
     
     IfCont(PTR(Expr) then_part, PTR(Expr) else_part, PTR(Env) env, PTR(Cont) rest);
-    void step_continue();
+    void step_continue(StepMachine &step);
+    static void deliver(StepMachine &step, Val if_val, PTR(Expr) then_part, PTR(Expr) else_part, PTR(Env) env, PTR(Cont) rest);
+    void trace(Heap &heap);
 };
 
 class ArgThenCallCont : public Cont {
@@ -125,16 +157,19 @@ public:
     PTR(Cont) rest;
     
     ArgThenCallCont(PTR(Expr) actual_arg, PTR(Env) env, PTR(Cont) rest);
-    void step_continue();
+    void step_continue(StepMachine &step);
+    static void deliver(StepMachine &step, Val to_be_called, PTR(Expr) actual_arg, PTR(Env) env, PTR(Cont) rest);
+    void trace(Heap &heap);
 };
 
 class CallCont : public Cont {
 public:
-    PTR(Val) to_be_called;
+    Val to_be_called;
     PTR(Cont) rest;
     
-    CallCont(PTR(Val) to_be_called, PTR(Cont) rest);
-    void step_continue();
+    CallCont(Val to_be_called, PTR(Cont) rest);
+    void step_continue(StepMachine &step);
+    void trace(Heap &heap);
 };
 
 #endif /* cont_hpp */
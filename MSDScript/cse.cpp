@@ -0,0 +1,455 @@
+//
+//  cse.cpp
+//  ArithemticParser2
+//
+//  Common subexpression elimination.
+//
+
+#include "cse.hpp"
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "expr.hpp"
+
+// Subexpressions smaller than this are as cheap to evaluate
+// again as to look up
+static const size_t min_node_count = 3;
+
+// Finding the binders of a candidate's free variables costs
+// a lookup each, so candidates with more are left alone
+static const size_t max_context_vars = 16;
+
+// Passes stop early once nothing more is shared
+static const int max_rounds = 8;
+
+/* One place in the tree, numbered in evaluation order, so
+ a subtree is the range [id, end). The same node can have
+ many occurrences. */
+struct Occurrence {
+    PTR(Expr) e;
+    int parent;
+    int depth;
+    int end;
+    // The deepest ancestor-or-self that is not evaluated
+    // whenever its parent is: a branch or a `_fun` body
+    int guard;
+    int children[3];
+    int child_count;
+};
+
+// Copies of one subexpression whose free variables refer
+// to the same binders
+struct Group {
+    PTR(Expr) e;
+    std::vector<int> occurrences;
+};
+
+struct GroupKey {
+    PTR(Expr) e;
+    size_t context;
+};
+
+struct GroupKeyHash {
+    size_t operator()(const GroupKey &key) const {
+        return key.e->hash ^ (key.context * 0x9e3779b97f4a7c15ULL);
+    }
+};
+
+struct GroupKeyEqual {
+    bool operator()(const GroupKey &a, const GroupKey &b) const {
+        return a.context == b.context && a.e->equals(b.e);
+    }
+};
+
+/* One round of numbering the tree, choosing what to share
+ and rebuilding it with the new `_let`s. */
+class CSEPass {
+public:
+    CSEPass(std::unordered_set<std::string> &names, int &fresh_count);
+
+    void number(PTR(Expr) root);
+
+    // Returns false when nothing is repeated
+    bool choose();
+
+    PTR(Expr) rebuild();
+
+private:
+    std::vector<Occurrence> occurrences;
+    std::vector<Group> groups;
+    std::unordered_map<GroupKey, int, GroupKeyHash, GroupKeyEqual> group_of;
+    std::unordered_map<std::string, std::vector<int> > binders;
+
+    // What is shared: each gets a fresh name, bound by a
+    // `_let` around the occurrence `hoisted_at` names
+    std::vector<PTR(Expr)> shared;
+    std::vector<std::string> shared_names;
+    std::unordered_map<int, std::vector<int> > hoisted_at;
+
+    // For each occurrence, what it is replaced by or -1
+    std::vector<int> replaced_by;
+
+    std::unordered_set<std::string> &names;
+    int &fresh_count;
+
+    int enter(PTR(Expr) e, int parent, bool strict);
+    size_t context_of(PTR(Expr) e);
+    bool speculatable_before(int scope, int id);
+    std::string fresh_name();
+};
+
+CSEPass::CSEPass(std::unordered_set<std::string> &names, int &fresh_count)
+    : names(names), fresh_count(fresh_count) { }
+
+// Mixes `value` into the hash `seed`
+static size_t mix(size_t seed, size_t value) {
+    return seed ^ (value + 0x9e3779b97f4a7c15ULL + (seed << 6) + (seed >> 2));
+}
+
+size_t CSEPass::context_of(PTR(Expr) e) {
+    std::vector<std::string> vars;
+    vars_list(e->free_vars, vars);
+    size_t context = 0;
+    for (size_t i = 0; i < vars.size(); i++) {
+        std::unordered_map<std::string, std::vector<int> >::iterator found = binders.find(vars[i]);
+        int binder = (found == binders.end() || found->second.empty()) ? -1 : found->second.back();
+        context = mix(context, (size_t)(binder + 1));
+    }
+    return context;
+}
+
+int CSEPass::enter(PTR(Expr) e, int parent, bool strict) {
+    int id = (int)occurrences.size();
+    Occurrence o;
+    o.e = e;
+    o.parent = parent;
+    o.depth = (parent < 0) ? 0 : occurrences[parent].depth + 1;
+    o.end = -1;
+    o.guard = (parent < 0 || !strict) ? id : occurrences[parent].guard;
+    o.child_count = 0;
+    occurrences.push_back(o);
+    if (parent >= 0) {
+        Occurrence &p = occurrences[parent];
+        p.children[p.child_count++] = id;
+    }
+
+    if (e->node_count >= min_node_count && vars_count(e->free_vars) <= max_context_vars) {
+        GroupKey key;
+        key.e = e;
+        key.context = context_of(e);
+        std::unordered_map<GroupKey, int, GroupKeyHash, GroupKeyEqual>::iterator found = group_of.find(key);
+        if (found == group_of.end()) {
+            Group g;
+            g.e = e;
+            groups.push_back(g);
+            found = group_of.insert(std::make_pair(key, (int)groups.size() - 1)).first;
+        }
+        groups[found->second].occurrences.push_back(id);
+    }
+    return id;
+}
+
+/* Walks the tree with an explicit stack, since sums can be
+ far deeper than the C++ stack allows. A `_let` binds its
+ name only between its right-hand side and its body. */
+void CSEPass::number(PTR(Expr) root) {
+    typedef enum { visit, bind, finish } step_t;
+    struct Step {
+        step_t step;
+        PTR(Expr) e;
+        int id;
+        bool strict;
+        const std::string *name;
+    };
+    std::vector<Step> todo;
+    Step first = { visit, root, -1, true, nullptr };
+    todo.push_back(first);
+
+    while (!todo.empty()) {
+        Step s = todo.back();
+        todo.pop_back();
+        if (s.step == bind) {
+            binders[*s.name].push_back(s.id);
+            continue;
+        }
+        if (s.step == finish) {
+            occurrences[s.id].end = (int)occurrences.size();
+            if (s.name != nullptr)
+                binders[*s.name].pop_back();
+            continue;
+        }
+
+        PTR(Expr) e = s.e;
+        int id = enter(e, s.id, s.strict);
+        Step done = { finish, nullptr, id, true, nullptr };
+        // Children are pushed last-first, so they pop in order
+        std::vector<Step> children;
+        if (PTR(AddExpr) add = CAST(AddExpr)(e)) {
+            Step lhs = { visit, add->lhs, id, true, nullptr };
+            Step rhs = { visit, add->rhs, id, true, nullptr };
+            children.push_back(lhs);
+            children.push_back(rhs);
+        } else if (PTR(MultExpr) mult = CAST(MultExpr)(e)) {
+            Step lhs = { visit, mult->lhs, id, true, nullptr };
+            Step rhs = { visit, mult->rhs, id, true, nullptr };
+            children.push_back(lhs);
+            children.push_back(rhs);
+        } else if (PTR(CompExpr) comp = CAST(CompExpr)(e)) {
+            Step lhs = { visit, comp->lhs, id, true, nullptr };
+            Step rhs = { visit, comp->rhs, id, true, nullptr };
+            children.push_back(lhs);
+            children.push_back(rhs);
+        } else if (PTR(CallFunExpr) call = CAST(CallFunExpr)(e)) {
+            Step callee = { visit, call->to_be_called, id, true, nullptr };
+            Step arg = { visit, call->actual_arg, id, true, nullptr };
+            children.push_back(callee);
+            children.push_back(arg);
+        } else if (PTR(IfExpr) if_expr = CAST(IfExpr)(e)) {
+            Step test = { visit, if_expr->if_part, id, true, nullptr };
+            Step then_part = { visit, if_expr->then_part, id, false, nullptr };
+            Step else_part = { visit, if_expr->else_part, id, false, nullptr };
+            children.push_back(test);
+            children.push_back(then_part);
+            children.push_back(else_part);
+        } else if (PTR(LetExpr) let = CAST(LetExpr)(e)) {
+            names.insert(let->var_name);
+            Step rhs = { visit, let->rhs, id, true, nullptr };
+            Step binding = { bind, nullptr, id, true, &let->var_name };
+            Step body = { visit, let->expr, id, true, nullptr };
+            children.push_back(rhs);
+            children.push_back(binding);
+            children.push_back(body);
+            done.name = &let->var_name;
+        } else if (PTR(FunExpr) fun = CAST(FunExpr)(e)) {
+            names.insert(fun->formal_arg);
+            Step binding = { bind, nullptr, id, true, &fun->formal_arg };
+            Step body = { visit, fun->body, id, false, nullptr };
+            children.push_back(binding);
+            children.push_back(body);
+            done.name = &fun->formal_arg;
+        } else if (PTR(VarExpr) var = CAST(VarExpr)(e)) {
+            names.insert(var->name);
+        }
+        todo.push_back(done);
+        for (size_t i = children.size(); i > 0; i--)
+            todo.push_back(children[i - 1]);
+    }
+}
+
+std::string CSEPass::fresh_name() {
+    while (1) {
+        // Names are letters only, so count in base 26
+        std::string suffix;
+        int i = fresh_count++;
+        do {
+            suffix.insert(suffix.begin(), (char)('a' + i % 26));
+            i /= 26;
+        } while (i > 0);
+        std::string candidate = "cse" + suffix;
+        if (names.insert(candidate).second)
+            return candidate;
+    }
+}
+
+// To check whether everything `scope` evaluates before it
+// gets to occurrence `id` is speculatable, so evaluating
+// `id` first can't change which error is raised
+bool CSEPass::speculatable_before(int scope, int id) {
+    for (int at = id; at != scope; at = occurrences[at].parent) {
+        const Occurrence &parent = occurrences[occurrences[at].parent];
+        for (int i = 0; i < parent.child_count && parent.children[i] != at; i++) {
+            if (!speculatable(occurrences[parent.children[i]].e))
+                return false;
+        }
+    }
+    return true;
+}
+
+static bool larger_first(const Group *a, const Group *b) {
+    if (a->e->node_count != b->e->node_count)
+        return a->e->node_count > b->e->node_count;
+    return a->occurrences[0] < b->occurrences[0];
+}
+
+/* Takes the largest repeated subexpressions first. Once
+ an occurrence is replaced, everything inside it is gone,
+ so smaller groups only count their other occurrences. A
+ subexpression that might fail or loop is only moved up
+ to the common scope if one copy was evaluated on every
+ path through that scope anyway, and nothing evaluated
+ before that copy could have failed first. Nothing is
+ moved to a scope that makes a function. */
+bool CSEPass::choose() {
+    std::vector<const Group *> repeated;
+    for (size_t i = 0; i < groups.size(); i++) {
+        if (groups[i].occurrences.size() > 1)
+            repeated.push_back(&groups[i]);
+    }
+    if (repeated.empty())
+        return false;
+    std::sort(repeated.begin(), repeated.end(), larger_first);
+
+    std::vector<bool> covered(occurrences.size(), false);
+    replaced_by.assign(occurrences.size(), -1);
+    bool any = false;
+    for (size_t i = 0; i < repeated.size(); i++) {
+        const Group *g = repeated[i];
+        std::vector<int> live;
+        for (size_t j = 0; j < g->occurrences.size(); j++) {
+            if (!covered[g->occurrences[j]])
+                live.push_back(g->occurrences[j]);
+        }
+        if (live.size() < 2)
+            continue;
+
+        // Climb until the scope holds every occurrence
+        int scope = live[0];
+        for (size_t j = 1; j < live.size(); j++) {
+            while (!(scope <= live[j] && live[j] < occurrences[scope].end))
+                scope = occurrences[scope].parent;
+        }
+
+        // A closure compares by the bindings in scope where it
+        // was made, so a new `_let` must not enclose any `_fun`
+        // (including one in the copies themselves)
+        if (occurrences[scope].e->has_fun)
+            continue;
+
+        // The first copy evaluated on every path through the scope
+        int first = -1;
+        for (size_t j = 0; j < live.size() && first < 0; j++) {
+            if (occurrences[occurrences[live[j]].guard].depth <= occurrences[scope].depth)
+                first = live[j];
+        }
+        if (!speculatable(g->e) && (first < 0 || !speculatable_before(scope, first)))
+            continue;
+
+        int index = (int)shared.size();
+        shared.push_back(g->e);
+        shared_names.push_back(fresh_name());
+        hoisted_at[scope].push_back(index);
+        for (size_t j = 0; j < live.size(); j++) {
+            replaced_by[live[j]] = index;
+            for (int k = live[j]; k < occurrences[live[j]].end; k++)
+                covered[k] = true;
+        }
+        any = true;
+    }
+    return any;
+}
+
+// `e` with its children replaced, or `e` itself if they are the same
+static PTR(Expr) with_children(PTR(Expr) e, PTR(Expr) *c) {
+    if (PTR(AddExpr) add = CAST(AddExpr)(e)) {
+        if (c[0] == add->lhs && c[1] == add->rhs)
+            return e;
+        return MAKE(AddExpr)(c[0], c[1]);
+    } else if (PTR(MultExpr) mult = CAST(MultExpr)(e)) {
+        if (c[0] == mult->lhs && c[1] == mult->rhs)
+            return e;
+        return MAKE(MultExpr)(c[0], c[1]);
+    } else if (PTR(CompExpr) comp = CAST(CompExpr)(e)) {
+        if (c[0] == comp->lhs && c[1] == comp->rhs)
+            return e;
+        return MAKE(CompExpr)(c[0], c[1]);
+    } else if (PTR(CallFunExpr) call = CAST(CallFunExpr)(e)) {
+        if (c[0] == call->to_be_called && c[1] == call->actual_arg)
+            return e;
+        return MAKE(CallFunExpr)(c[0], c[1]);
+    } else if (PTR(IfExpr) if_expr = CAST(IfExpr)(e)) {
+        if (c[0] == if_expr->if_part && c[1] == if_expr->then_part && c[2] == if_expr->else_part)
+            return e;
+        return MAKE(IfExpr)(c[0], c[1], c[2]);
+    } else if (PTR(LetExpr) let = CAST(LetExpr)(e)) {
+        if (c[0] == let->rhs && c[1] == let->expr)
+            return e;
+        return MAKE(LetExpr)(let->var_name, c[0], c[1]);
+    } else if (PTR(FunExpr) fun = CAST(FunExpr)(e)) {
+        if (c[0] == fun->body)
+            return e;
+        return MAKE(FunExpr)(fun->formal_arg, c[0]);
+    }
+    return e;
+}
+
+// Children always have larger numbers than their parent,
+// so building from the last occurrence back needs no stack
+PTR(Expr) CSEPass::rebuild() {
+    std::vector<PTR(Expr)> built(occurrences.size(), nullptr);
+    for (size_t id = occurrences.size(); id > 0; id--) {
+        const Occurrence &o = occurrences[id - 1];
+        PTR(Expr) result;
+        if (replaced_by[id - 1] >= 0) {
+            result = MAKE(VarExpr)(shared_names[replaced_by[id - 1]]);
+        } else {
+            PTR(Expr) children[3];
+            for (int i = 0; i < o.child_count; i++)
+                children[i] = built[o.children[i]];
+            result = with_children(o.e, children);
+        }
+
+        std::unordered_map<int, std::vector<int> >::iterator hoisted = hoisted_at.find((int)id - 1);
+        if (hoisted != hoisted_at.end()) {
+            for (size_t i = hoisted->second.size(); i > 0; i--) {
+                int index = hoisted->second[i - 1];
+                result = MAKE(LetExpr)(shared_names[index], shared[index], result);
+            }
+        }
+        built[id - 1] = result;
+    }
+    return built[0];
+}
+
+PTR(Expr) cse(PTR(Expr) e) {
+    std::unordered_set<std::string> names;
+    int fresh_count = 0;
+    for (int round = 0; round < max_rounds; round++) {
+        CSEPass pass(names, fresh_count);
+        pass.number(e);
+        if (!pass.choose())
+            break;
+        e = pass.rebuild();
+    }
+    return e;
+}
+
+/* for tests */
+#include <sstream>
+#include "parse.hpp"
+#include "arena.hpp"
+#include "API.hpp"
+#include "catch.hpp"
+
+static std::string cse_str(std::string program) {
+    ParseSession session;
+    std::stringstream input(program);
+    return cse(parse(input))->to_string();
+}
+
+TEST_CASE( "cse" ) {
+    CHECK( cse_str("(x + y) * (x + y)") == "(_let csea = (x + y) _in (csea * csea))" );
+    CHECK( cse_str("_fun (a) (a + y) * (a + y)")
+          == "(_fun(a) (_let csea = (a + y) _in (csea * csea)))" );
+    // Names that don't pick a fresh one
+    CHECK( cse_str("_let csea = 1 _in (x + y) * (x + y)")
+          == "(_let csea = 1 _in (_let cseb = (x + y) _in (cseb * cseb)))" );
+    
+    // Copies under different binders are different
+    CHECK( cse_str("(x + y) + (_let x = 1 _in x + y)") == "((x + y) + (_let x = 1 _in (x + y)))" );
+    // Something that might fail moves only ahead of a copy
+    // evaluated on every path anyway
+    CHECK( cse_str("_if c _then x + y _else (x + y) * 2")
+          == "(_if c _then (x + y) _else ((x + y) * 2))" );
+    CHECK( cse_str("(_true + x) + (_if c _then _true + x _else 0)")
+          == "(_let csea = (_true + x) _in (csea + (_if c _then csea _else 0)))" );
+    
+    // Nor around a function, whose bindings in scope would change
+    CHECK( cse_str("f(x + y) + (_fun (x) x + y)(1) + (x + y)")
+          == "(f((x + y)) + ((_fun(x) (x + y))(1) + (x + y)))" );
+    std::string program = "_let p = 0 _in _let q = 1 _in (_fun (z) z) "
+                          "== (_if p + q == 1 _then _fun (z) z _else (_fun (z) z)(p + q))";
+    std::stringstream input(cse_str(program));
+    CHECK( interp(input) == "_true" );
+}
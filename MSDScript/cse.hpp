@@ -0,0 +1,22 @@
+//
+//  cse.hpp
+//  ArithemticParser2
+//
+//  Common subexpression elimination.
+//
+
+#ifndef cse_hpp
+#define cse_hpp
+
+#include "pointer.hpp"
+
+class Expr;
+
+/* Bind each subexpression that is evaluated more than once
+ to a fresh `_let` at the closest scope enclosing all of
+ its occurrences, so it is evaluated only once. Copies
+ only count as the same when their free variables refer
+ to the same binders. */
+PTR(Expr) cse(PTR(Expr) e);
+
+#endif /* cse_hpp */
@@ -11,8 +11,12 @@
 
 PTR(Env) Env::emptyenv = NEW(EmptyEnv)();
 
-PTR(Val) EmptyEnv::lookup(std::string find_name) {
-    throw std::runtime_error("free variable: " + find_name);
+Val EmptyEnv::lookup(int depth, int slot) {
+    throw std::runtime_error("unresolved variable");
+}
+
+void EmptyEnv::set(int slot, Val val) {
+    throw std::runtime_error("unresolved variable");
 }
 
 bool EmptyEnv::equals(PTR(Env) env) {
@@ -20,27 +24,43 @@ bool EmptyEnv::equals(PTR(Env) env) {
     return ee != NULL;
 }
 
-ExtendedEnv::ExtendedEnv(std::string name, PTR(Val) val, PTR(Env) env) {
-    this->rest = env;
-    this->name = name;
-    this->val = val;
+void EmptyEnv::trace(Heap &heap) { }
+
+FrameEnv::FrameEnv(int size, PTR(Env) rest) : slots(size) {
+    this->rest = rest;
 }
 
-PTR(Val) ExtendedEnv::lookup(std::string find_name) {
-    if (find_name == name){
-        return val;
-    }else{
-        return rest->lookup(find_name);
+Val FrameEnv::lookup(int depth, int slot) {
+    PTR(FrameEnv) frame = this;
+    while (depth-- > 0) {
+        frame = static_cast<PTR(FrameEnv)>(frame->rest);
     }
+    return frame->slots[slot];
+}
+
+void FrameEnv::set(int slot, Val val) {
+    slots[slot] = val;
 }
 
-bool ExtendedEnv::equals(PTR(Env) env) {
-    PTR(ExtendedEnv) ee = CAST(ExtendedEnv)(env);
+bool FrameEnv::equals(PTR(Env) env) {
+    PTR(FrameEnv) fe = CAST(FrameEnv)(env);
     
-    if (ee == NULL){
+    // A frame can hold a function closed over the frame itself
+    if (fe == THIS){
+        return true;
+    }
+    if (fe == NULL || fe->slots.size() != slots.size()){
         return false;
-    }else{
-        return name == ee->name && val->equals(ee->val) && rest->equals(ee->rest);
     }
+    for (size_t i = 0; i < slots.size(); i++) {
+        if (!slots[i].equals(fe->slots[i]))
+            return false;
+    }
+    return rest->equals(fe->rest);
 }
 
+void FrameEnv::trace(Heap &heap) {
+    for (size_t i = 0; i < slots.size(); i++)
+        slots[i].trace(heap);
+    heap.mark(rest);
+}
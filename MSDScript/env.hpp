@@ -10,36 +10,47 @@
 #define env_hpp
 
 #include <string>
+#include <vector>
 #include "pointer.hpp"
 #include "value.hpp"
+#include "gc.hpp"
 
 
-class Val;
-
-class Env {
+/* Environments are chains of frames. Variables are found by
+ the lexical address that `resolve` assigned to them: the
+ number of frames to skip, then a slot within that frame. */
+class Env : public Collectable {
 public:
     static PTR(Env) emptyenv;
     
-    virtual PTR(Val) lookup(std::string find_name) = 0;
+    virtual Val lookup(int depth, int slot) = 0;
+    
+    virtual void set(int slot, Val val) = 0;
     
     virtual bool equals(PTR(Env) env) = 0;
 };
 
 class EmptyEnv : public Env {
 public:
-    PTR(Val) lookup(std::string find_name);
+    Val lookup(int depth, int slot);
+    void set(int slot, Val val);
     bool equals(PTR(Env) env);
+    void trace(Heap &heap);
 };
 
-class ExtendedEnv : public Env {
+/* One frame per function call (slot 0 is the argument,
+ `_let`s in the body take the following slots), and one
+ for each outermost `_let` outside any function. */
+class FrameEnv : public Env {
 public:
-    std::string name;
-    PTR(Val) val;
+    std::vector<Val> slots;
     PTR(Env) rest;
     
-    ExtendedEnv(std::string name, PTR(Val) val, PTR(Env) env);
-    PTR(Val) lookup(std::string find_name);
+    FrameEnv(int size, PTR(Env) rest);
+    Val lookup(int depth, int slot);
+    void set(int slot, Val val);
     bool equals(PTR(Env) env);
+    void trace(Heap &heap);
 };
 
 #endif /* env_hpp */
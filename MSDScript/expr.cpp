@@ -1,16 +1,201 @@
 #include "expr.hpp"
 #include <sstream>
+#include <vector>
+#include <algorithm>
+#include <typeinfo>
 #include "env.hpp"
 #include "value.hpp"
 #include "step.hpp"
 #include "cont.hpp"
+#include "vm.hpp"
+#include "resolve.hpp"
+#include "arena.hpp"
+
+// Evaluate an expression that has no free variables,
+// as the optimizer does when folding constants.
+static Val interp_closed(PTR(Expr) e) {
+    return resolve(e)->interp(Env::emptyenv);
+}
+
+// Evaluate `e`, following its tail expressions in a loop
+// rather than by recursion.
+static Val interp_tail_calls(PTR(Expr) e, PTR(Env) env) {
+    Val result;
+    while (e != nullptr)
+        e = e->interp_tail(env, result);
+    return result;
+}
+
+//Expr
+void *Expr::operator new(size_t size) {
+    if (Arena::current != nullptr)
+        return Arena::current->allocate(size);
+    return ::operator new(size);
+}
+
+void Expr::operator delete(void *p) {
+    if (Arena::current != nullptr)
+        Arena::current->release(p);
+    else
+        ::operator delete(p);
+}
+
+Expr::~Expr() { }
+
+bool Expr::equals(PTR(Expr) e) {
+    if (e == THIS)
+        return true;
+    if (e->hash != hash)
+        return false;
+    return deep_equals(e);
+}
+
+PTR(Expr) Expr::subst(std::string var, Val val) {
+    Subst s;
+    s.bind(var, val.to_expr());
+    return subst(s);
+}
+
+PTR(Expr) Expr::subst(const Subst &s) {
+    if (!s.touches(free_vars))
+        return THIS;
+    return subst_node(s);
+}
+
+// Mixes `value` into the hash `seed`
+static size_t hash_mix(size_t seed, size_t value) {
+    return seed ^ (value + 0x9e3779b97f4a7c15ULL + (seed << 6) + (seed >> 2));
+}
+
+static size_t hash_string(const std::string &s) {
+    return std::hash<std::string>()(s);
+}
+
+//Subst
+static bool binding_before(const std::pair<std::string, PTR(Expr)> &b, const std::string &name) {
+    return b.first < name;
+}
+
+void Subst::bind(std::string name, PTR(Expr) e) {
+    std::vector<std::pair<std::string, PTR(Expr)> >::iterator at =
+        std::lower_bound(bindings.begin(), bindings.end(), name, binding_before);
+    if (at != bindings.end() && at->first == name)
+        at->second = e;
+    else
+        bindings.insert(at, std::make_pair(name, e));
+}
+
+void Subst::unbind(const std::string &name) {
+    std::vector<std::pair<std::string, PTR(Expr)> >::iterator at =
+        std::lower_bound(bindings.begin(), bindings.end(), name, binding_before);
+    if (at != bindings.end() && at->first == name)
+        bindings.erase(at);
+}
+
+PTR(Expr) Subst::lookup(const std::string &name) const {
+    std::vector<std::pair<std::string, PTR(Expr)> >::const_iterator at =
+        std::lower_bound(bindings.begin(), bindings.end(), name, binding_before);
+    if (at != bindings.end() && at->first == name)
+        return at->second;
+    return nullptr;
+}
+
+// To check whether any name under `t` is bound in `s`
+static bool any_bound(const Subst &s, const VarNode *t) {
+    return t != nullptr && (s.lookup(t->name) != nullptr
+                            || any_bound(s, t->left.get()) || any_bound(s, t->right.get()));
+}
+
+// Looks up each name of whichever side is smaller
+bool Subst::touches(const VarSet &vars) const {
+    if (bindings.size() <= vars_count(vars)) {
+        for (size_t i = 0; i < bindings.size(); i++) {
+            if (vars_contain(vars, bindings[i].first))
+                return true;
+        }
+        return false;
+    }
+    return any_bound(*this, vars.get());
+}
+
+bool Subst::captures(const std::string &name) const {
+    for (size_t i = 0; i < bindings.size(); i++) {
+        if (vars_contain(bindings[i].second->free_vars, name))
+            return true;
+    }
+    return false;
+}
+
+// A name like `var` that is free neither in `body` nor in
+// any replacement, for renaming a binder out of the way
+static std::string fresh_name(const std::string &var, PTR(Expr) body, const Subst &s) {
+    for (size_t n = 0; ; n++) {
+        // Names are letters only, so count in base 26
+        std::string suffix;
+        size_t i = n;
+        do {
+            suffix.insert(suffix.begin(), (char)('a' + i % 26));
+            i /= 26;
+        } while (i > 0);
+        std::string candidate = var + suffix;
+        if (!vars_contain(body->free_vars, candidate)
+            && s.lookup(candidate) == nullptr && !s.captures(candidate))
+            return candidate;
+    }
+}
+
+/* The substitution to apply under a binder for `var` in
+ `body`: `var` is no longer bound, and if a replacement
+ mentions `var` the binder is renamed to `renamed`. */
+static Subst subst_under(const Subst &s, const std::string &var, PTR(Expr) body, std::string &renamed) {
+    Subst inner = s;
+    inner.unbind(var);
+    renamed = var;
+    if (inner.touches(body->free_vars) && inner.captures(var)) {
+        renamed = fresh_name(var, body, inner);
+        inner.bind(var, MAKE(VarExpr)(renamed));
+    }
+    return inner;
+}
+
+// A different starting seed for each kind of node
+enum {
+    num_seed = 1,
+    add_seed,
+    mult_seed,
+    var_seed,
+    bool_seed,
+    let_seed,
+    if_seed,
+    comp_seed,
+    fun_seed,
+    call_seed
+};
+
+bool Expr::step_atomic(PTR(Env) env, Val &val) {
+    return false;
+}
+
+PTR(Expr) Expr::interp_tail(PTR(Env) &env, Val &result) {
+    result = interp(env);
+    return nullptr;
+}
 
 //NumExpr
 NumExpr::NumExpr(int rep){
     this -> rep = rep;
+    this -> hash = hash_mix(num_seed, rep);
+    this -> free_vars = nullptr;
+    this -> node_count = 1;
+    this -> has_fun = false;
+}
+
+bool NumExpr::same_node(PTR(Expr) e){
+    PTR(NumExpr) n = CAST(NumExpr)(e);
+    return n != NULL && rep == n->rep;
 }
 
-bool NumExpr::equals(PTR(Expr) e){
+bool NumExpr::deep_equals(PTR(Expr) e){
     PTR(NumExpr) n = CAST(NumExpr)(e);
     if (n == NULL){
         return false;
@@ -19,24 +204,34 @@ bool NumExpr::equals(PTR(Expr) e){
     }
 }
 
-PTR(Val) NumExpr::interp(PTR(Env) env){
-    return NEW(NumVal)(rep);
+Val NumExpr::interp(PTR(Env) env){
+    return Val::num(rep);
 }
 
-void NumExpr::step_interp() {
-    Step::mode = Step::continue_mode;
-    Step::val = NEW(NumVal)(rep);
-    Step::cont = Step::cont;
+void NumExpr::step_interp(StepMachine &step) {
+    step.mode = StepMachine::continue_mode;
+    step.val = Val::num(rep);
+    step.cont = step.cont;
 }
 
-PTR(Expr) NumExpr::subst(std::string var, PTR(Val) new_val){
-    return NEW(NumExpr)(rep);
+bool NumExpr::step_atomic(PTR(Env) env, Val &val) {
+    val = Val::num(rep);
+    return true;
 }
 
-bool NumExpr::containsVar(){
-    return false;
+void NumExpr::compile(Compiler &c, bool tail) {
+    c.emit(OP_NUM, rep);
+}
+
+PTR(Expr) NumExpr::resolve(Scope *scope) {
+    return THIS;
 }
 
+PTR(Expr) NumExpr::subst_node(const Subst &s){
+    return THIS;
+}
+
+
 PTR(Expr) NumExpr::optimizer(){
     return THIS;
 }
@@ -45,113 +240,339 @@ std::string NumExpr::to_string(){
     return std::to_string(rep);
 }
 
+/* Long sums and products parse as right-leaning spines,
+ like `1 + (2 + (3 + ...))`. AddExpr and MultExpr walk
+ such a spine in a loop rather than recursing on `rhs`,
+ so its length doesn't use up the C++ stack. */
+
+// Collects the operands of the spine of `T`s starting at
+// `e`, from left to right.
+template <class T>
+static void spine_operands(PTR(T) e, std::vector<PTR(Expr)> &operands) {
+    while (1) {
+        operands.push_back(e->lhs);
+        PTR(T) next = CAST(T)(e->rhs);
+        if (next == NULL) {
+            operands.push_back(e->rhs);
+            return;
+        }
+        e = next;
+    }
+}
+
+// Builds `a op (b op (c ...))` from spine operands.
+template <class T>
+static PTR(Expr) spine_build(std::vector<PTR(Expr)> &operands) {
+    PTR(Expr) e = operands.back();
+    for (size_t i = operands.size() - 1; i > 0; i--)
+        e = MAKE(T)(operands[i - 1], e);
+    return e;
+}
+
+// Evaluates the operands from left to right, then combines
+// them from the right, just as the nested calls would.
+template <class T>
+static Val spine_interp(PTR(T) e, PTR(Env) env, Val (Val::*op)(Val)) {
+    // The common case of no spine, tested without a `CAST`
+    if (typeid(*e->rhs) != typeid(T)) {
+        Val lhs_val = e->lhs->interp(env);
+        return (lhs_val.*op)(e->rhs->interp(env));
+    }
+    std::vector<PTR(Expr)> operands;
+    spine_operands<T>(e, operands);
+    std::vector<Val> vals;
+    vals.reserve(operands.size());
+    for (size_t i = 0; i < operands.size(); i++)
+        vals.push_back(operands[i]->interp(env));
+    Val result = vals.back();
+    for (size_t i = vals.size() - 1; i > 0; i--)
+        result = (vals[i - 1].*op)(result);
+    return result;
+}
+
+template <class T>
+static bool spine_equals(PTR(T) e, PTR(Expr) other) {
+    PTR(Expr) a = e;
+    PTR(Expr) b = other;
+    while (1) {
+        PTR(T) x = CAST(T)(a);
+        PTR(T) y = CAST(T)(b);
+        if (x == NULL)
+            return a->equals(b);
+        if (y == NULL || !x->lhs->equals(y->lhs))
+            return false;
+        a = x->rhs;
+        b = y->rhs;
+    }
+}
+
+template <class T>
+static void spine_compile(PTR(T) e, Compiler &c, op_t op) {
+    std::vector<PTR(Expr)> operands;
+    spine_operands<T>(e, operands);
+    for (size_t i = 0; i < operands.size(); i++)
+        operands[i]->compile(c, false);
+    for (size_t i = 1; i < operands.size(); i++)
+        c.emit(op);
+}
+
+template <class T>
+static PTR(Expr) spine_resolve(PTR(T) e, Scope *scope) {
+    std::vector<PTR(Expr)> operands;
+    spine_operands<T>(e, operands);
+    bool changed = false;
+    for (size_t i = 0; i < operands.size(); i++) {
+        PTR(Expr) resolved = operands[i]->resolve(scope);
+        changed = changed || (resolved != operands[i]);
+        operands[i] = resolved;
+    }
+    // Spines of constants come back as they are
+    return changed ? spine_build<T>(operands) : e;
+}
+
+template <class T>
+static PTR(Expr) spine_subst(PTR(T) e, const Subst &s) {
+    std::vector<PTR(Expr)> operands;
+    spine_operands<T>(e, operands);
+    for (size_t i = 0; i < operands.size(); i++)
+        operands[i] = operands[i]->subst(s);
+    return spine_build<T>(operands);
+}
+
+// To check whether `e` can only evaluate to a number (or fail)
+static bool known_number(PTR(Expr) e) {
+    return CAST(NumExpr)(e) != nullptr || CAST(AddExpr)(e) != nullptr
+        || CAST(MultExpr)(e) != nullptr;
+}
+
+// Appends the operands of an optimized operand. A sum (or
+// product) nested last is just a longer spine, but one nested
+// elsewhere combines its operands before the ones after it
+// are evaluated, so it is only taken apart when all of its
+// operands are numbers and it cannot fail there.
+template <class T>
+static void spine_gather(PTR(Expr) e, bool last, std::vector<PTR(Expr)> &operands) {
+    PTR(T) spine = CAST(T)(e);
+    if (spine == NULL) {
+        operands.push_back(e);
+        return;
+    }
+    std::vector<PTR(Expr)> parts;
+    spine_operands<T>(spine, parts);
+    for (size_t i = 0; !last && i < parts.size(); i++) {
+        if (!known_number(parts[i])) {
+            operands.push_back(e);
+            return;
+        }
+    }
+    for (size_t i = 0; i < parts.size(); i++)
+        spine_gather<T>(parts[i], last && i + 1 == parts.size(), operands);
+}
+
+/* Optimizes every operand and flattens the result into
+ one n-ary sum (or product). `interp` evaluates all the
+ operands in order and then combines them from the right,
+ so the error it reports depends only on the last two
+ operands and the rightmost non-number before the last.
+ Operands that are closed and cannot fail are numbers,
+ so since the arithmetic wraps they fold into a single
+ constant wherever that keeps the error the same: last if
+ the last operand was one of them, else just before the
+ last if that one was, else first. The other operands
+ keep their order and are never evaluated here. The
+ constant is left out when it is the identity and the
+ operands around it still check for numbers. */
+template <class T>
+static PTR(Expr) spine_optimizer(PTR(T) e, Val (Val::*op)(Val), int identity) {
+    std::vector<PTR(Expr)> operands;
+    spine_operands<T>(e, operands);
+    std::vector<PTR(Expr)> flat;
+    for (size_t i = 0; i < operands.size(); i++)
+        spine_gather<T>(operands[i]->optimizer(), i + 1 == operands.size(), flat);
+    
+    std::vector<PTR(Expr)> rest;
+    Val constant = Val::num(identity);
+    bool folded = false;
+    bool last_folded = false;
+    bool before_last_folded = false;
+    for (size_t i = 0; i < flat.size(); i++) {
+        if (flat[i]->containsVar() || !speculatable(flat[i])) {
+            rest.push_back(flat[i]);
+            continue;
+        }
+        Val val = interp_closed(flat[i]);
+        if (!val.is_num()) {
+            // Bound to fail if it is reached; leave the order
+            // alone so the error is the one `interp` reports
+            return spine_build<T>(flat);
+        }
+        constant = (constant.*op)(val);
+        folded = true;
+        last_folded = i + 1 == flat.size();
+        before_last_folded = before_last_folded || i + 2 == flat.size();
+    }
+    
+    if (rest.empty())
+        return constant.to_expr();
+    if (!folded)
+        return spine_build<T>(rest);
+    bool identity_only = constant.equals(Val::num(identity));
+    size_t n = rest.size();
+    if (last_folded) {
+        if (!identity_only || !known_number(rest[n - 1]))
+            rest.push_back(constant.to_expr());
+    } else if (before_last_folded) {
+        if (!identity_only || n == 1 || (!known_number(rest[n - 2]) && !known_number(rest[n - 1])))
+            rest.insert(rest.end() - 1, constant.to_expr());
+    } else if (!identity_only) {
+        rest.insert(rest.begin(), constant.to_expr());
+    }
+    return spine_build<T>(rest);
+}
+
+// Prints as `(a op (b op c))`, appending in place.
+template <class T>
+static std::string spine_to_string(PTR(T) e, std::string op) {
+    std::vector<PTR(Expr)> operands;
+    spine_operands<T>(e, operands);
+    std::string s;
+    for (size_t i = 0; i + 1 < operands.size(); i++) {
+        s += "(";
+        s += operands[i]->to_string();
+        s += op;
+    }
+    s += operands.back()->to_string();
+    s.append(operands.size() - 1, ')');
+    return s;
+}
+
 //AddExpr
 AddExpr::AddExpr(PTR(Expr) lhs, PTR(Expr) rhs) {
     this->lhs = lhs;
     this->rhs = rhs;
+    this->hash = hash_mix(hash_mix(add_seed, lhs->hash), rhs->hash);
+    this->free_vars = vars_union(lhs->free_vars, rhs->free_vars);
+    this->node_count = 1 + lhs->node_count + rhs->node_count;
+    this->has_fun = lhs->has_fun || rhs->has_fun;
 }
 
-bool AddExpr::equals(PTR(Expr) e){
+bool AddExpr::same_node(PTR(Expr) e){
     PTR(AddExpr) a = CAST(AddExpr)(e);
-    if (a == NULL){
-        return false;
-    }else{
-        return (lhs->equals(a->lhs)
-                && rhs->equals(a->rhs));
-    }
+    return a != NULL && lhs == a->lhs && rhs == a->rhs;
+}
+
+bool AddExpr::deep_equals(PTR(Expr) e){
+    return spine_equals<AddExpr>(THIS, e);
 }
 
-PTR(Val) AddExpr::interp(PTR(Env) env){
-    return lhs->interp(env)->add_to(rhs->interp(env));
+Val AddExpr::interp(PTR(Env) env){
+    return spine_interp<AddExpr>(THIS, env, &Val::add_to);
 }
 
-void AddExpr::step_interp() {
-    Step::mode = Step::interp_mode;
-    Step::expr = lhs;
-    Step::cont = NEW(RightThenAddCont)(rhs, Step::env, Step::cont);
+void AddExpr::step_interp(StepMachine &step) {
+    Val lhs_val;
+    if (lhs->step_atomic(step.env, lhs_val)) {
+        RightThenAddCont::deliver(step, lhs_val, rhs, step.env, step.cont);
+        return;
+    }
+    step.mode = StepMachine::interp_mode;
+    step.expr = lhs;
+    step.cont = NEW(RightThenAddCont)(rhs, step.env, step.cont);
+}
+
+void AddExpr::compile(Compiler &c, bool tail) {
+    spine_compile<AddExpr>(THIS, c, OP_ADD);
 }
 
-PTR(Expr) AddExpr::subst(std::string var, PTR(Val) new_val) {
-    return NEW(AddExpr)(lhs->subst(var, new_val),
-                        rhs->subst(var, new_val));
+PTR(Expr) AddExpr::resolve(Scope *scope) {
+    return spine_resolve<AddExpr>(THIS, scope);
 }
 
-bool AddExpr::containsVar(){
-    return lhs->containsVar() || rhs->containsVar();
+PTR(Expr) AddExpr::subst_node(const Subst &s) {
+    return spine_subst<AddExpr>(THIS, s);
 }
 
+
 PTR(Expr) AddExpr::optimizer() {
-    PTR(Expr) lhs_optimized = THIS->lhs->optimizer();
-    PTR(Expr) rhs_optimized = THIS->rhs->optimizer();
-    
-    if (!lhs_optimized->containsVar() && !rhs_optimized->containsVar()) {
-        PTR(Val) new_val = lhs_optimized->interp(Env::emptyenv)->add_to(rhs_optimized
-                 ->interp(Env::emptyenv));
-        return new_val->to_expr();
-    }
-    return NEW(AddExpr)(lhs_optimized, rhs_optimized);
+    return spine_optimizer<AddExpr>(THIS, &Val::add_to, 0);
 }
 
 std::string AddExpr::to_string() {
-    return "(" + lhs->to_string() + " + " + rhs->to_string() + ")";
+    return spine_to_string<AddExpr>(THIS, " + ");
 }
 
 //MultExpr
 MultExpr::MultExpr(PTR(Expr) lhs, PTR(Expr) rhs) {
     THIS->lhs = lhs;
     THIS->rhs = rhs;
+    THIS->hash = hash_mix(hash_mix(mult_seed, lhs->hash), rhs->hash);
+    THIS->free_vars = vars_union(lhs->free_vars, rhs->free_vars);
+    THIS->node_count = 1 + lhs->node_count + rhs->node_count;
+    THIS->has_fun = lhs->has_fun || rhs->has_fun;
 }
 
-bool MultExpr::equals(PTR(Expr) e){
-    PTR(MultExpr) m = dynamic_cast<MultExpr*>(e);
-    if (m == NULL){
-        return false;
-    }else{
-        return (lhs->equals(m->lhs)
-                && rhs->equals(m->rhs));
-    }
+bool MultExpr::same_node(PTR(Expr) e){
+    PTR(MultExpr) m = CAST(MultExpr)(e);
+    return m != NULL && lhs == m->lhs && rhs == m->rhs;
+}
+
+bool MultExpr::deep_equals(PTR(Expr) e){
+    return spine_equals<MultExpr>(THIS, e);
 }
 
-PTR(Val) MultExpr::interp(PTR(Env) env){
-    return lhs->interp(env)->mult_with(rhs->interp(env));
+Val MultExpr::interp(PTR(Env) env){
+    return spine_interp<MultExpr>(THIS, env, &Val::mult_with);
+}
+
+void MultExpr::step_interp(StepMachine &step) {
+    Val lhs_val;
+    if (lhs->step_atomic(step.env, lhs_val)) {
+        RightThenMultCont::deliver(step, lhs_val, rhs, step.env, step.cont);
+        return;
+    }
+    step.mode = StepMachine::interp_mode;
+    step.expr = lhs;
+    step.cont = NEW(RightThenMultCont)(rhs, step.env, step.cont);
 }
 
-void MultExpr::step_interp() {
-    Step::mode = Step::interp_mode;
-    Step::expr = lhs;
-    Step::cont = NEW(RightThenMultCont)(rhs, Step::env, Step::cont);
+void MultExpr::compile(Compiler &c, bool tail) {
+    spine_compile<MultExpr>(THIS, c, OP_MULT);
 }
 
-PTR(Expr) MultExpr::subst(std::string var, PTR(Val) new_val){
-    return NEW(MultExpr)(lhs->subst(var, new_val), rhs->subst(var, new_val));
+PTR(Expr) MultExpr::resolve(Scope *scope) {
+    return spine_resolve<MultExpr>(THIS, scope);
 }
 
-bool MultExpr::containsVar(){
-    return lhs->containsVar() || rhs->containsVar();
+PTR(Expr) MultExpr::subst_node(const Subst &s){
+    return spine_subst<MultExpr>(THIS, s);
 }
 
+
 PTR(Expr) MultExpr::optimizer(){
-    PTR(Expr) lhs_optimized = THIS->lhs->optimizer();
-    PTR(Expr) rhs_optimized = THIS->rhs->optimizer();
-    
-    if (!lhs_optimized->containsVar() && !rhs_optimized->containsVar()){
-        PTR(Val) new_val = lhs_optimized->interp(Env::emptyenv)
-        ->mult_with(rhs_optimized->interp(Env::emptyenv));
-        return new_val->to_expr();
-    }
-    return NEW(MultExpr)(lhs_optimized, rhs_optimized);
+    return spine_optimizer<MultExpr>(THIS, &Val::mult_with, 1);
 }
 
 std::string MultExpr::to_string(){
-    return "(" + lhs->to_string() + " * " + rhs->to_string() + ")";
+    return spine_to_string<MultExpr>(THIS, " * ");
 }
 
 //VarExpr
-VarExpr::VarExpr(std::string name){
+VarExpr::VarExpr(std::string name, int depth, int slot){
     THIS->name = name;
+    THIS->depth = depth;
+    THIS->slot = slot;
+    THIS->hash = hash_mix(var_seed, hash_string(name));
+    THIS->free_vars = vars_of(name);
+    THIS->node_count = 1;
+    THIS->has_fun = false;
 }
 
-bool VarExpr::equals(PTR(Expr) e){
+bool VarExpr::same_node(PTR(Expr) e){
+    PTR(VarExpr) v = CAST(VarExpr)(e);
+    return v != NULL && name == v->name && depth == v->depth && slot == v->slot;
+}
+
+bool VarExpr::deep_equals(PTR(Expr) e){
     PTR(VarExpr) v = CAST(VarExpr)(e);
     if (v == NULL){
         return false;
@@ -160,30 +581,46 @@ bool VarExpr::equals(PTR(Expr) e){
     }
 }
 
-PTR(Val) VarExpr::interp(PTR(Env) env){
-    return env->lookup(name);
+Val VarExpr::interp(PTR(Env) env){
+    if (depth < 0)
+        throw std::runtime_error("free variable: " + name);
+    return env->lookup(depth, slot);
 }
 
-void VarExpr::step_interp() {
-    Step::mode = Step::continue_mode;
-    Step::val = Step::env->lookup(name);
-    Step::cont = Step::cont;
+void VarExpr::step_interp(StepMachine &step) {
+    if (depth < 0)
+        throw std::runtime_error("free variable: " + name);
+    step.mode = StepMachine::continue_mode;
+    step.val = step.env->lookup(depth, slot);
+    step.cont = step.cont;
 }
 
-PTR(Expr) VarExpr::subst(std::string var, PTR(Val) new_val){
-    if (name == var){
-        return new_val->to_expr();
-    }else{
-        return NEW(VarExpr)(name); // or `return THIS`
-    }
+bool VarExpr::step_atomic(PTR(Env) env, Val &val) {
+    if (depth < 0)
+        throw std::runtime_error("free variable: " + name);
+    val = env->lookup(depth, slot);
+    return true;
 }
 
-bool VarExpr::containsVar(){
-    return true;
+void VarExpr::compile(Compiler &c, bool tail) {
+    c.load(name);
+}
+
+PTR(Expr) VarExpr::resolve(Scope *scope) {
+    int depth, slot;
+    if (scope == nullptr || !scope->lookup(name, depth, slot))
+        throw std::runtime_error("free variable: " + name);
+    return MAKE(VarExpr)(name, depth, slot);
+}
+
+PTR(Expr) VarExpr::subst_node(const Subst &s){
+    PTR(Expr) replacement = s.lookup(name);
+    return replacement != nullptr ? replacement : THIS;
 }
 
+
 PTR(Expr) VarExpr::optimizer(){
-    return NEW(VarExpr)(name);
+    return MAKE(VarExpr)(name);
 }
 
 std::string VarExpr::to_string(){
@@ -193,9 +630,18 @@ std::string VarExpr::to_string(){
 //BoolExpr
 BoolExpr::BoolExpr(bool rep){
     THIS->rep = rep;
+    THIS->hash = hash_mix(bool_seed, rep);
+    THIS->free_vars = nullptr;
+    THIS->node_count = 1;
+    THIS->has_fun = false;
+}
+
+bool BoolExpr::same_node(PTR(Expr) e){
+    PTR(BoolExpr) b = CAST(BoolExpr)(e);
+    return b != NULL && rep == b->rep;
 }
 
-bool BoolExpr::equals(PTR(Expr) e) {
+bool BoolExpr::deep_equals(PTR(Expr) e) {
     PTR(BoolExpr) b = CAST(BoolExpr)(e);
     if (b == NULL){
         return false;
@@ -204,26 +650,36 @@ bool BoolExpr::equals(PTR(Expr) e) {
     }
 }
 
-PTR(Val) BoolExpr::interp(PTR(Env) env){
-    return NEW(BoolVal)(rep);
+Val BoolExpr::interp(PTR(Env) env){
+    return Val::boolean(rep);
 }
 
-void BoolExpr::step_interp() {
-    Step::mode = Step::continue_mode;
-    Step::val = NEW(BoolVal)(rep);
-    Step::cont = Step::cont;
+void BoolExpr::step_interp(StepMachine &step) {
+    step.mode = StepMachine::continue_mode;
+    step.val = Val::boolean(rep);
+    step.cont = step.cont;
 }
 
-PTR(Expr) BoolExpr::subst(std::string var, PTR(Val) new_val){
-    return NEW(BoolExpr)(rep);
+bool BoolExpr::step_atomic(PTR(Env) env, Val &val) {
+    val = Val::boolean(rep);
+    return true;
 }
 
-bool BoolExpr::containsVar(){
-    return false;
+void BoolExpr::compile(Compiler &c, bool tail) {
+    c.emit(OP_BOOL, rep);
+}
+
+PTR(Expr) BoolExpr::resolve(Scope *scope) {
+    return THIS;
 }
 
+PTR(Expr) BoolExpr::subst_node(const Subst &s){
+    return THIS;
+}
+
+
 PTR(Expr) BoolExpr::optimizer(){
-    return NEW(BoolExpr)(rep);
+    return MAKE(BoolExpr)(rep);
 }
 
 std::string BoolExpr::to_string() {
@@ -235,13 +691,27 @@ std::string BoolExpr::to_string() {
 }
 
 //LetExpr
-LetExpr::LetExpr(std::string var_name, PTR(Expr) rhs, PTR(Expr) expr){
+LetExpr::LetExpr(std::string var_name, PTR(Expr) rhs, PTR(Expr) expr,
+                 int slot, int frame_size){
     THIS -> var_name = var_name;
     THIS -> rhs = rhs;
     THIS -> expr = expr;
+    THIS -> slot = slot;
+    THIS -> frame_size = frame_size;
+    THIS -> hash = hash_mix(hash_mix(hash_mix(let_seed, hash_string(var_name)),
+                                     rhs->hash), expr->hash);
+    THIS -> free_vars = vars_union(rhs->free_vars, vars_without(expr->free_vars, var_name));
+    THIS -> node_count = 1 + rhs->node_count + expr->node_count;
+    THIS -> has_fun = rhs->has_fun || expr->has_fun;
+}
+
+bool LetExpr::same_node(PTR(Expr) e) {
+    PTR(LetExpr) l = CAST(LetExpr)(e);
+    return l != NULL && var_name == l->var_name && rhs == l->rhs && expr == l->expr
+    && slot == l->slot && frame_size == l->frame_size;
 }
 
-bool LetExpr::equals(PTR(Expr) e) {
+bool LetExpr::deep_equals(PTR(Expr) e) {
     PTR(LetExpr) l = dynamic_cast<LetExpr*>(e);
     
     if (l == NULL){
@@ -251,38 +721,236 @@ bool LetExpr::equals(PTR(Expr) e) {
     }
 }
 
-PTR(Val) LetExpr::interp(PTR(Env) env){
-    PTR(Val) rhs_value = rhs -> interp(env);
-    PTR(Env) new_env = NEW(ExtendedEnv)(var_name, rhs_value, env);
-    return expr -> interp(new_env);
+Val LetExpr::interp(PTR(Env) env){
+    return interp_tail_calls(THIS, env);
+}
+
+PTR(Expr) LetExpr::interp_tail(PTR(Env) &env, Val &result){
+    if (frame_size > 0)
+        env = NEW(FrameEnv)(frame_size, env);
+    env->set(slot, rhs -> interp(env));
+    return expr;
+}
+
+void LetExpr::step_interp(StepMachine &step) {
+    if (frame_size > 0)
+        step.env = NEW(FrameEnv)(frame_size, step.env);
+    Val rhs_val;
+    if (rhs->step_atomic(step.env, rhs_val)) {
+        LetCont::deliver(step, rhs_val, slot, expr, step.env, step.cont);
+        return;
+    }
+    step.mode = StepMachine::interp_mode;
+    step.expr = rhs;
+    step.cont = NEW(LetCont)(slot, expr, step.env, step.cont);
+}
+
+void LetExpr::compile(Compiler &c, bool tail) {
+    rhs->compile(c, false);
+    c.emit(OP_STORE, c.bind(var_name));
+    expr->compile(c, tail);
+    c.unbind();
+}
+
+PTR(Expr) LetExpr::resolve(Scope *scope) {
+    // Outside any function, the `_let` brings its own frame
+    Scope own_frame(nullptr);
+    Scope *frame = (scope == nullptr) ? &own_frame : scope;
+    
+    PTR(Expr) rhs_resolved = rhs->resolve(frame);
+    int var_slot = frame->bind(var_name);
+    PTR(Expr) expr_resolved = expr->resolve(frame);
+    frame->unbind();
+    
+    int own_size = (frame == &own_frame) ? own_frame.size : 0;
+    return MAKE(LetExpr)(var_name, rhs_resolved, expr_resolved, var_slot, own_size);
+}
+
+PTR(Expr) LetExpr::subst_node(const Subst &s){
+    std::string renamed;
+    Subst inner = subst_under(s, var_name, expr, renamed);
+    return MAKE(LetExpr)(renamed, rhs->subst(s), expr->subst(inner));
+}
+
+
+// The expression to inline for a `_let` whose right-hand
+// side optimized to `rhs`, or nullptr to keep the `_let`.
+// A function value is only inlined as written: turning a
+// closure back into an expression would lose what it captured.
+// A right-hand side that might fail or loop stays for the
+// program to evaluate, if it ever gets there.
+static PTR(Expr) inline_value(PTR(Expr) rhs) {
+    if (rhs->containsVar() || !speculatable(rhs))
+        return nullptr;
+    if (CAST(FunExpr)(rhs) != nullptr)
+        return rhs;
+    Val val = interp_closed(rhs);
+    if (val.is_fun())
+        return nullptr;
+    return val.to_expr();
+}
+
+// Arithmetic can fail on a non-number, so only comparisons,
+// tests and bindings of such parts count.
+bool speculatable(PTR(Expr) e) {
+    if (CAST(NumExpr)(e) != nullptr || CAST(BoolExpr)(e) != nullptr
+        || CAST(VarExpr)(e) != nullptr || CAST(FunExpr)(e) != nullptr)
+        return true;
+    PTR(CompExpr) comp = CAST(CompExpr)(e);
+    if (comp != nullptr)
+        return speculatable(comp->lhs) && speculatable(comp->rhs);
+    PTR(IfExpr) if_expr = CAST(IfExpr)(e);
+    if (if_expr != nullptr)
+        return speculatable(if_expr->if_part) && speculatable(if_expr->then_part)
+            && speculatable(if_expr->else_part);
+    PTR(LetExpr) let = CAST(LetExpr)(e);
+    if (let != nullptr)
+        return speculatable(let->rhs) && speculatable(let->expr);
+    return false;
 }
 
-void LetExpr::step_interp() {
-    Step::mode = Step::interp_mode;
-    Step::expr = rhs;
-    Step::cont = NEW(LetCont)(var_name, expr, Step::env, Step::cont);
+// Counts the free occurrences of `name` in `e`, up to 2. An
+// occurrence inside a `_fun` counts as 2, since the function
+// may be called any number of times.
+static int count_uses(PTR(Expr) e, const std::string &name) {
+    if (!vars_contain(e->free_vars, name))
+        return 0;
+    if (CAST(VarExpr)(e) != nullptr)
+        return 1;
+    if (CAST(FunExpr)(e) != nullptr)
+        return 2;
+    
+    std::vector<PTR(Expr)> parts;
+    if (CAST(AddExpr)(e) != nullptr) {
+        spine_operands<AddExpr>(CAST(AddExpr)(e), parts);
+    } else if (CAST(MultExpr)(e) != nullptr) {
+        spine_operands<MultExpr>(CAST(MultExpr)(e), parts);
+    } else if (CAST(LetExpr)(e) != nullptr) {
+        parts.push_back(CAST(LetExpr)(e)->rhs);
+        parts.push_back(CAST(LetExpr)(e)->expr);
+    } else if (CAST(IfExpr)(e) != nullptr) {
+        parts.push_back(CAST(IfExpr)(e)->if_part);
+        parts.push_back(CAST(IfExpr)(e)->then_part);
+        parts.push_back(CAST(IfExpr)(e)->else_part);
+    } else if (CAST(CompExpr)(e) != nullptr) {
+        parts.push_back(CAST(CompExpr)(e)->lhs);
+        parts.push_back(CAST(CompExpr)(e)->rhs);
+    } else if (CAST(CallFunExpr)(e) != nullptr) {
+        parts.push_back(CAST(CallFunExpr)(e)->to_be_called);
+        parts.push_back(CAST(CallFunExpr)(e)->actual_arg);
+    }
+    int uses = 0;
+    for (size_t i = 0; i < parts.size() && uses < 2; i++)
+        uses += count_uses(parts[i], name);
+    return uses < 2 ? uses : 2;
+}
+
+/* The names bound around the expression being optimized,
+ innermost last, each with whether it surely holds a number.
+ A `_let` of a sum or product does: its body is only reached
+ once the right-hand side has evaluated to one. */
+static thread_local std::vector<std::pair<std::string, bool> > bound_names;
+
+// Binds names in `bound_names` until the end of the scope
+class BoundNames {
+public:
+    BoundNames() {
+        saved = bound_names.size();
+    }
+    ~BoundNames() {
+        bound_names.resize(saved);
+    }
+    void bind(const std::string &name, bool number) {
+        bound_names.push_back(std::make_pair(name, number));
+    }
+private:
+    size_t saved;
+};
+
+static bool makes_number(PTR(Expr) e) {
+    return CAST(NumExpr)(e) != nullptr || CAST(AddExpr)(e) != nullptr
+        || CAST(MultExpr)(e) != nullptr;
 }
 
-PTR(Expr) LetExpr::subst(std::string var, PTR(Val) val){
-    if (var == var_name) {
-        return NEW(LetExpr)(var, rhs, expr);
+static bool known_number(const std::string &name) {
+    for (size_t i = bound_names.size(); i > 0; i--) {
+        if (bound_names[i - 1].first == name)
+            return bound_names[i - 1].second;
     }
-    return NEW(LetExpr)(var_name, rhs->subst(var, val), expr->subst(var, val));
+    return false;
 }
 
-bool LetExpr::containsVar(){
-    PTR(Env) empty_env = NEW(EmptyEnv)();
-    return rhs->containsVar() || expr->subst(var_name, rhs->interp(empty_env))->containsVar();
+// Sums and products of numbers and of variables known to
+// hold numbers can't fail, though `speculatable` doesn't
+// know it
+static bool safe_arithmetic(PTR(Expr) e) {
+    std::vector<PTR(Expr)> todo(1, e);
+    while (!todo.empty()) {
+        PTR(Expr) part = todo.back();
+        todo.pop_back();
+        if (PTR(AddExpr) add = CAST(AddExpr)(part)) {
+            todo.push_back(add->lhs);
+            todo.push_back(add->rhs);
+        } else if (PTR(MultExpr) mult = CAST(MultExpr)(part)) {
+            todo.push_back(mult->lhs);
+            todo.push_back(mult->rhs);
+        } else if (PTR(VarExpr) var = CAST(VarExpr)(part)) {
+            if (!known_number(var->name))
+                return false;
+        } else if (CAST(NumExpr)(part) == nullptr) {
+            return false;
+        }
+    }
+    return true;
 }
 
+/* Optimizes a whole chain of nested `_let`s at once.
+ Bindings to inline collect into one substitution that is
+ applied to each later right-hand side and then to the
+ innermost body in a single pass, instead of copying the
+ rest of the program once per binding. Besides closed
+ values, a binding is inlined when it is just another
+ variable, or when it is speculatable and used at most
+ once outside any `_fun`; an unused one simply goes away.
+ A `_let` that stays is renamed if a pending replacement
+ mentions its name. */
 PTR(Expr) LetExpr::optimizer(){
-    PTR(Expr) rhs_optimized = rhs->optimizer();
-    PTR(Expr) expr_optimized = expr->optimizer();
+    Subst known;
+    std::vector<std::pair<std::string, PTR(Expr)> > kept;
+    BoundNames bound;
+    PTR(Expr) e = THIS;
+    PTR(LetExpr) let;
+    while ((let = CAST(LetExpr)(e)) != nullptr) {
+        PTR(Expr) rhs_optimized = let->rhs->subst(known)->optimizer();
+        PTR(Expr) value = inline_value(rhs_optimized);
+        if (value == nullptr && (CAST(VarExpr)(rhs_optimized) != nullptr
+                                 || (speculatable(rhs_optimized) && count_uses(let->expr, let->var_name) < 2)))
+            value = rhs_optimized;
+        
+        if (value != nullptr) {
+            known.bind(let->var_name, value);
+            bound.bind(let->var_name, false);
+        } else if (known.captures(let->var_name)) {
+            std::string renamed = fresh_name(let->var_name, let->expr, known);
+            known.bind(let->var_name, MAKE(VarExpr)(renamed));
+            kept.push_back(std::make_pair(renamed, rhs_optimized));
+            bound.bind(renamed, makes_number(rhs_optimized));
+        } else {
+            known.unbind(let->var_name);
+            kept.push_back(std::make_pair(let->var_name, rhs_optimized));
+            bound.bind(let->var_name, makes_number(rhs_optimized));
+        }
+        e = let->expr;
+    }
     
-    if (!rhs_optimized->containsVar()) {
-        return expr_optimized->subst(var_name, rhs_optimized->interp(Env::emptyenv))->optimizer();
+    PTR(Expr) result = e->subst(known)->optimizer();
+    for (size_t i = kept.size(); i > 0; i--) {
+        // Uses can disappear as the body folds
+        if (count_uses(result, kept[i - 1].first) == 0 && speculatable(kept[i - 1].second))
+            continue;
+        result = MAKE(LetExpr)(kept[i - 1].first, kept[i - 1].second, result);
     }
-    return NEW(LetExpr)(var_name, rhs_optimized, expr_optimized);
+    return result;
 }
 
 std::string LetExpr::to_string(){
@@ -294,9 +962,21 @@ IfExpr::IfExpr(PTR(Expr) if_part, PTR(Expr) then_part, PTR(Expr) else_part) {
     THIS->if_part = if_part;
     THIS->then_part = then_part;
     THIS->else_part = else_part;
+    THIS->hash = hash_mix(hash_mix(hash_mix(if_seed, if_part->hash),
+                                   then_part->hash), else_part->hash);
+    THIS->free_vars = vars_union(if_part->free_vars,
+                                 vars_union(then_part->free_vars, else_part->free_vars));
+    THIS->node_count = 1 + if_part->node_count + then_part->node_count + else_part->node_count;
+    THIS->has_fun = if_part->has_fun || then_part->has_fun || else_part->has_fun;
+}
+
+bool IfExpr::same_node(PTR(Expr) e){
+    PTR(IfExpr) i = CAST(IfExpr)(e);
+    return i != NULL && if_part == i->if_part && then_part == i->then_part
+    && else_part == i->else_part;
 }
 
-bool IfExpr::equals(PTR(Expr) e){
+bool IfExpr::deep_equals(PTR(Expr) e){
     PTR(IfExpr) i = CAST(IfExpr)(e);
     
     if (i == NULL){
@@ -308,49 +988,71 @@ bool IfExpr::equals(PTR(Expr) e){
     }
 }
 
-PTR(Val) IfExpr::interp(PTR(Env) env) {
-    PTR(Val) if_value= if_part -> interp(env);
+Val IfExpr::interp(PTR(Env) env) {
+    return interp_tail_calls(THIS, env);
+}
+
+PTR(Expr) IfExpr::interp_tail(PTR(Env) &env, Val &result) {
+    Val if_value= if_part -> interp(env);
     
-    if (if_value->equals(NEW(BoolVal)(true))) {
-        return then_part -> interp(env);
+    if (if_value.equals(Val::boolean(true))) {
+        return then_part;
     } else {
-        return else_part -> interp(env);
+        return else_part;
     }
 }
 
-void IfExpr::step_interp() {
-    Step::mode = Step::interp_mode;
-    Step::expr = if_part;
-    Step::cont = NEW(IfCont)(then_part, else_part, Step::env, Step::cont);
+void IfExpr::step_interp(StepMachine &step) {
+    Val test;
+    if (if_part->step_atomic(step.env, test)) {
+        IfCont::deliver(step, test, then_part, else_part, step.env, step.cont);
+        return;
+    }
+    step.mode = StepMachine::interp_mode;
+    step.expr = if_part;
+    step.cont = NEW(IfCont)(then_part, else_part, step.env, step.cont);
 }
 
-PTR(Expr) IfExpr::subst(std::string var, PTR(Val) val) {
-    return NEW(IfExpr)(if_part -> subst(var, val), then_part -> subst(var, val), else_part->subst(var, val));
+void IfExpr::compile(Compiler &c, bool tail) {
+    if_part->compile(c, false);
+    int to_else = c.here();
+    c.emit(OP_JUMP_UNLESS_TRUE);
+    then_part->compile(c, tail);
+    int to_end = c.here();
+    c.emit(OP_JUMP);
+    c.patch(to_else);
+    else_part->compile(c, tail);
+    c.patch(to_end);
 }
 
-bool IfExpr::containsVar(){
-    if (if_part->containsVar()) {
-        return true;
-    }
-    PTR(Val) if_value = if_part -> interp(Env::emptyenv);
-    
-    if (if_value->equals(NEW(BoolVal)(true))){
-        return then_part -> containsVar();
-    }else{
-        return else_part -> containsVar();
-    }
+PTR(Expr) IfExpr::resolve(Scope *scope) {
+    return MAKE(IfExpr)(if_part->resolve(scope), then_part->resolve(scope), else_part->resolve(scope));
+}
+
+PTR(Expr) IfExpr::subst_node(const Subst &s) {
+    return MAKE(IfExpr)(if_part -> subst(s), then_part -> subst(s), else_part->subst(s));
 }
 
+
+// A closed test that can't fail picks its branch just as
+// `interp` would, and identical branches don't need it
+// either, unless they make functions: branches that look
+// alike may have been rewritten from ones that weren't
 PTR(Expr) IfExpr::optimizer(){
     PTR(Expr) if_part_optimized = if_part->optimizer();
     
-    if (if_part_optimized->equals(NEW(BoolExpr)(true))) {
-        return then_part->optimizer();
-    } else if (if_part_optimized->equals(NEW(BoolExpr)(false))){
+    if (!if_part_optimized->containsVar() && speculatable(if_part_optimized)) {
+        Val test = interp_closed(if_part_optimized);
+        if (test.is_bool() && test.bool_rep())
+            return then_part->optimizer();
         return else_part->optimizer();
-    } else {
-        return NEW(IfExpr)(if_part_optimized, then_part->optimizer(), else_part->optimizer());
     }
+    PTR(Expr) then_optimized = then_part->optimizer();
+    PTR(Expr) else_optimized = else_part->optimizer();
+    if (then_optimized->equals(else_optimized) && speculatable(if_part_optimized)
+        && !then_optimized->has_fun)
+        return then_optimized;
+    return MAKE(IfExpr)(if_part_optimized, then_optimized, else_optimized);
 }
 
 std::string IfExpr::to_string() {
@@ -363,9 +1065,18 @@ std::string IfExpr::to_string() {
 CompExpr::CompExpr(PTR(Expr) lhs, PTR(Expr) rhs) {
     this ->lhs = lhs;
     this ->rhs = rhs;
+    this ->hash = hash_mix(hash_mix(comp_seed, lhs->hash), rhs->hash);
+    this ->free_vars = vars_union(lhs->free_vars, rhs->free_vars);
+    this ->node_count = 1 + lhs->node_count + rhs->node_count;
+    this ->has_fun = lhs->has_fun || rhs->has_fun;
+}
+
+bool CompExpr::same_node(PTR(Expr) e) {
+    PTR(CompExpr) ee = CAST(CompExpr)(e);
+    return ee != NULL && lhs == ee->lhs && rhs == ee->rhs;
 }
 
-bool CompExpr::equals(PTR(Expr) e) {
+bool CompExpr::deep_equals(PTR(Expr) e) {
     PTR(CompExpr) ee = CAST(CompExpr)(e);
     if (ee == NULL){
         return false;
@@ -374,39 +1085,62 @@ bool CompExpr::equals(PTR(Expr) e) {
     }
 }
 
-PTR(Val) CompExpr::interp(PTR(Env) env) {
-    PTR(Val) lhs_value = lhs->interp(env);
-    PTR(Val) rhs_value = rhs->interp(env);
+Val CompExpr::interp(PTR(Env) env) {
+    Val lhs_value = lhs->interp(env);
+    Val rhs_value = rhs->interp(env);
     
-    if (lhs_value->equals(rhs_value)){
-        return NEW(BoolVal)(true);
+    if (lhs_value.equals(rhs_value)){
+        return Val::boolean(true);
     }else{
-        return NEW(BoolVal)(false);
+        return Val::boolean(false);
+    }
+}
+
+void CompExpr::step_interp(StepMachine &step) {
+    Val lhs_val;
+    if (lhs->step_atomic(step.env, lhs_val)) {
+        RightThenCompCont::deliver(step, lhs_val, rhs, step.env, step.cont);
+        return;
     }
+    step.mode = StepMachine::interp_mode;
+    step.expr = lhs;
+    step.cont = NEW(RightThenCompCont)(rhs, step.env, step.cont);
 }
 
-void CompExpr::step_interp() {
-    Step::mode = Step::interp_mode;
-    Step::expr = lhs;
-    Step::cont = NEW(RightThenCompCont)(rhs, Step::env, Step::cont);
+void CompExpr::compile(Compiler &c, bool tail) {
+    lhs->compile(c, false);
+    rhs->compile(c, false);
+    c.emit(OP_EQ);
 }
 
-PTR(Expr) CompExpr::subst(std::string var, PTR(Val) val) {
-    return NEW(CompExpr)(lhs->subst(var, val), rhs->subst(var, val));
+PTR(Expr) CompExpr::resolve(Scope *scope) {
+    return MAKE(CompExpr)(lhs->resolve(scope), rhs->resolve(scope));
 }
 
-bool CompExpr::containsVar(){
-    return lhs->containsVar() || rhs->containsVar();
+PTR(Expr) CompExpr::subst_node(const Subst &s) {
+    return MAKE(CompExpr)(lhs->subst(s), rhs->subst(s));
 }
 
+
 PTR(Expr) CompExpr::optimizer() {
     PTR(Expr) lhs_optimized = lhs->optimizer();
     PTR(Expr) rhs_optimized = rhs->optimizer();
     
-    if (!lhs_optimized->containsVar() && !rhs_optimized->containsVar()){
-        return NEW(BoolExpr)(lhs_optimized->equals(rhs_optimized));
+    if (lhs_optimized->has_fun || rhs_optimized->has_fun) {
+        // A function compares by what was in scope where it
+        // was made, which optimizing may have changed, so
+        // keep the sides as written
+        return MAKE(CompExpr)(lhs, rhs);
+    }else if (!lhs_optimized->containsVar() && !rhs_optimized->containsVar()
+        && speculatable(lhs_optimized) && speculatable(rhs_optimized)){
+        // Compare as `interp` would; a side that might fail or
+        // loop keeps the `==`, so its error is still reached
+        return MAKE(BoolExpr)(interp_closed(lhs_optimized).equals(interp_closed(rhs_optimized)));
+    }else if (lhs_optimized->equals(rhs_optimized) && speculatable(lhs_optimized)){
+        // The same variables always give the same value
+        return MAKE(BoolExpr)(true);
     }else{
-        return NEW(CompExpr)(lhs_optimized, rhs_optimized);
+        return MAKE(CompExpr)(lhs_optimized, rhs_optimized);
     }
 }
 
@@ -415,12 +1149,26 @@ std::string CompExpr::to_string() {
 }
 
 //FunExpr
-FunExpr::FunExpr(std::string formal_arg, PTR(Expr) body) {
+FunExpr::FunExpr(std::string formal_arg, PTR(Expr) body, int frame_size,
+                 Bindings in_scope, int level) {
     this -> formal_arg = formal_arg;
     this -> body = body;
+    this -> frame_size = frame_size;
+    this -> in_scope = in_scope;
+    this -> level = level;
+    this -> hash = hash_mix(hash_mix(fun_seed, hash_string(formal_arg)), body->hash);
+    this -> free_vars = vars_without(body->free_vars, formal_arg);
+    this -> node_count = 1 + body->node_count;
+    this -> has_fun = true;
+}
+
+bool FunExpr::same_node(PTR(Expr) e) {
+    PTR(FunExpr) f = CAST(FunExpr)(e);
+    return f != NULL && formal_arg == f->formal_arg && body == f->body
+    && frame_size == f->frame_size && in_scope == f->in_scope && level == f->level;
 }
 
-bool FunExpr::equals(PTR(Expr) e) {
+bool FunExpr::deep_equals(PTR(Expr) e) {
     PTR(FunExpr) f = CAST(FunExpr)(e);
     
     if (f == NULL){
@@ -430,31 +1178,71 @@ bool FunExpr::equals(PTR(Expr) e) {
     }
 }
 
-PTR(Val) FunExpr::interp(PTR(Env) env) {
-    return NEW(FunVal)(formal_arg, body, env);
+Val FunExpr::interp(PTR(Env) env) {
+    return NEW(FunVal)(formal_arg, body, env, frame_size, in_scope, level);
 }
 
-void FunExpr::step_interp() {
-    Step::mode = Step::continue_mode;
-    Step::val = NEW(FunVal)(formal_arg, body, Step::env);
+void FunExpr::step_interp(StepMachine &step) {
+    step.mode = StepMachine::continue_mode;
+    step.val = NEW(FunVal)(formal_arg, body, step.env, frame_size, in_scope, level);
 }
 
-PTR(Expr) FunExpr::subst(std::string var, PTR(Val) val) {
-    if (var == formal_arg){
-        return NEW(FunExpr)(formal_arg, body);
-    }else{
-        return NEW(FunExpr)(formal_arg, body->subst(var, val));
-    }
+bool FunExpr::step_atomic(PTR(Env) env, Val &val) {
+    val = NEW(FunVal)(formal_arg, body, env, frame_size, in_scope, level);
+    return true;
+}
+
+void FunExpr::compile(Compiler &c, bool tail) {
+    c.emit(OP_CLOSURE, c.compile_function(formal_arg, body));
+}
+
+PTR(Expr) FunExpr::resolve(Scope *scope) {
+    Scope frame(scope);
+    frame.bind(formal_arg);
+    PTR(Expr) body_resolved = body->resolve(&frame);
+    if (scope == nullptr)
+        return MAKE(FunExpr)(formal_arg, body_resolved, frame.size);
+    return MAKE(FunExpr)(formal_arg, body_resolved, frame.size, scope->in_scope, scope->level);
 }
 
-// _fun(x) x + x doens't contain a variable
-// _fun(x) x + y contain a variable
-bool FunExpr::containsVar(){
-    return body->subst(formal_arg, NEW(NumVal)(0))->containsVar();
+PTR(Expr) FunExpr::subst_node(const Subst &s) {
+    std::string renamed;
+    Subst inner = subst_under(s, formal_arg, body, renamed);
+    return MAKE(FunExpr)(renamed, body->subst(inner));
 }
 
+
+/* `_let`s at the head of the body that don't depend on the
+ argument are floated out of the function, so they are
+ evaluated once when the function is made instead of on
+ every call. Only ones that can't fail move, since the
+ function might never be called: speculatable ones, and
+ arithmetic on numbers bound outside the function or by
+ `_let`s floated before them. */
 PTR(Expr) FunExpr::optimizer() {
-    return NEW(FunExpr)(formal_arg, body->optimizer());
+    PTR(Expr) body_optimized;
+    {
+        BoundNames bound;
+        bound.bind(formal_arg, false);
+        body_optimized = body->optimizer();
+    }
+    
+    std::vector<PTR(LetExpr)> floated;
+    BoundNames bound;
+    PTR(LetExpr) let;
+    while ((let = CAST(LetExpr)(body_optimized)) != nullptr
+           && let->var_name != formal_arg
+           && !vars_contain(let->rhs->free_vars, formal_arg)
+           && (speculatable(let->rhs) || safe_arithmetic(let->rhs))) {
+        floated.push_back(let);
+        bound.bind(let->var_name, makes_number(let->rhs));
+        body_optimized = let->expr;
+    }
+    
+    PTR(Expr) result = MAKE(FunExpr)(formal_arg, body_optimized);
+    for (size_t i = floated.size(); i > 0; i--)
+        result = MAKE(LetExpr)(floated[i - 1]->var_name, floated[i - 1]->rhs, result);
+    return result;
 }
 
 std::string FunExpr::to_string(){
@@ -465,9 +1253,18 @@ std::string FunExpr::to_string(){
 CallFunExpr::CallFunExpr(PTR(Expr) to_be_called, PTR(Expr) actual_arg) {
     this -> to_be_called = to_be_called;
     this -> actual_arg = actual_arg;
+    this -> hash = hash_mix(hash_mix(call_seed, to_be_called->hash), actual_arg->hash);
+    this -> free_vars = vars_union(to_be_called->free_vars, actual_arg->free_vars);
+    this -> node_count = 1 + to_be_called->node_count + actual_arg->node_count;
+    this -> has_fun = to_be_called->has_fun || actual_arg->has_fun;
+}
+
+bool CallFunExpr::same_node(PTR(Expr) e){
+    PTR(CallFunExpr) c = CAST(CallFunExpr)(e);
+    return c != NULL && to_be_called == c->to_be_called && actual_arg == c->actual_arg;
 }
 
-bool CallFunExpr::equals(PTR(Expr) e){
+bool CallFunExpr::deep_equals(PTR(Expr) e){
     PTR(CallFunExpr) c = CAST(CallFunExpr)(e);
     
     if (c == NULL){
@@ -477,26 +1274,121 @@ bool CallFunExpr::equals(PTR(Expr) e){
     }
 }
 
-PTR(Val) CallFunExpr::interp(PTR(Env) env) {
-    return to_be_called->interp(env)->call(actual_arg->interp(env));
+Val CallFunExpr::interp(PTR(Env) env) {
+    return interp_tail_calls(THIS, env);
+}
+
+PTR(Expr) CallFunExpr::interp_tail(PTR(Env) &env, Val &result) {
+    Val fun_val = to_be_called->interp(env);
+    Val arg_val = actual_arg->interp(env);
+    if (!fun_val.is_fun())
+        throw std::runtime_error("Function call error occured");
+    PTR(FunVal) fun = fun_val.fun();
+    env = NEW(FrameEnv)(fun->frame_size, fun->env);
+    env->set(0, arg_val);
+    return fun->body;
+}
+
+void CallFunExpr::step_interp(StepMachine &step) {
+    Val fun_val;
+    if (to_be_called->step_atomic(step.env, fun_val)) {
+        ArgThenCallCont::deliver(step, fun_val, actual_arg, step.env, step.cont);
+        return;
+    }
+    step.mode = StepMachine::interp_mode;
+    step.expr = to_be_called;
+    step.cont = NEW(ArgThenCallCont)(actual_arg, step.env, step.cont);
+}
+
+void CallFunExpr::compile(Compiler &c, bool tail) {
+    to_be_called->compile(c, false);
+    actual_arg->compile(c, false);
+    c.emit(tail ? OP_TAIL_CALL : OP_CALL);
+}
+
+PTR(Expr) CallFunExpr::resolve(Scope *scope) {
+    return MAKE(CallFunExpr)(to_be_called->resolve(scope), actual_arg->resolve(scope));
 }
 
-void CallFunExpr::step_interp() {
-    Step::mode = Step::interp_mode;
-    Step::expr = to_be_called;
-    Step::cont = NEW(ArgThenCallCont)(actual_arg, Step::env, Step::cont);
+PTR(Expr) CallFunExpr::subst_node(const Subst &s) {
+    return MAKE(CallFunExpr)(to_be_called->subst(s), actual_arg->subst(s));
 }
 
-PTR(Expr) CallFunExpr::subst(std::string var, PTR(Val) val) {
-    return NEW(CallFunExpr)(to_be_called->subst(var, val), actual_arg->subst(var, val));
+
+// Inlining left before `simplify` stops inlining calls
+static thread_local int inline_fuel = 1000;
+
+// The functions being inlined, innermost last
+static thread_local std::vector<PTR(FunExpr)> *inlining = nullptr;
+
+// How many nodes an inlined call may add to the program
+static const size_t inline_growth = 64;
+
+PTR(Expr) simplify(PTR(Expr) e, int &fuel) {
+    int saved_fuel = inline_fuel;
+    std::vector<PTR(FunExpr)> *saved_inlining = inlining;
+    std::vector<PTR(FunExpr)> own_inlining;
+    inline_fuel = fuel;
+    inlining = &own_inlining;
+    try {
+        PTR(Expr) result = e->optimizer();
+        fuel = inline_fuel > 0 ? inline_fuel : 0;
+        inline_fuel = saved_fuel;
+        inlining = saved_inlining;
+        return result;
+    } catch (...) {
+        inline_fuel = saved_fuel;
+        inlining = saved_inlining;
+        throw;
+    }
 }
 
-bool CallFunExpr::containsVar() {
-    return actual_arg->containsVar() || to_be_called->containsVar();
+// To check whether inlining `fun` here would unroll a call
+// already being inlined
+static bool inlining_again(PTR(FunExpr) fun) {
+    for (size_t i = 0; i < inlining->size(); i++) {
+        if ((*inlining)[i]->equals(fun))
+            return true;
+    }
+    return false;
 }
 
+/* A call of a `_fun` whose argument is known is inlined as
+ a `_let`, which keeps the argument evaluated first and
+ lets `LetExpr::optimizer` substitute and fold it. A call
+ of a function already being inlined is not unrolled again
+ when its argument is a `_fun`, as in self-application;
+ for other arguments, tests on them fold and end the
+ unrolling. If the result grows by more than
+ `inline_growth` nodes, or still makes a function, the
+ call is kept. */
 PTR(Expr) CallFunExpr::optimizer() {
-    return NEW(CallFunExpr)(to_be_called->optimizer(), actual_arg->optimizer());
+    PTR(Expr) callee = to_be_called->optimizer();
+    PTR(Expr) arg = actual_arg->optimizer();
+    PTR(Expr) call = MAKE(CallFunExpr)(callee, arg);
+    
+    PTR(FunExpr) fun = CAST(FunExpr)(callee);
+    if (fun == nullptr || arg->containsVar() || inline_fuel <= 0 || inlining == nullptr)
+        return call;
+    if (CAST(FunExpr)(arg) != nullptr && inlining_again(fun))
+        return call;
+    inline_fuel--;
+    inlining->push_back(fun);
+    PTR(Expr) inlined;
+    try {
+        inlined = MAKE(LetExpr)(fun->formal_arg, arg, fun->body)->optimizer();
+    } catch (...) {
+        inlining->pop_back();
+        throw;
+    }
+    inlining->pop_back();
+    if (inlined->node_count > call->node_count + inline_growth)
+        return call;
+    // Functions made by the inlined body would be made with
+    // different bindings in scope, so `==` could tell
+    if (inlined->has_fun)
+        return call;
+    return inlined;
 }
 
 std::string CallFunExpr::to_string() {
@@ -628,52 +1520,52 @@ static std::string evaluate_expr(PTR(Expr) expr) {
 //
 //TEST_CASE( "Interp") {
 //    // to_value method for NumExpr
-//    CHECK( (NEW(NumExpr)(3))->interp(Env::emptyenv)->equals(NEW(NumVal)(3)) );
-//    CHECK( !(NEW(NumExpr)(10))->interp(Env::emptyenv)->equals(NEW(NumVal)(20)) );
+//    CHECK( (NEW(NumExpr)(3))->interp(Env::emptyenv).equals(Val::num(3)) );
+//    CHECK( !(NEW(NumExpr)(10))->interp(Env::emptyenv).equals(Val::num(20)) );
 //
-//    CHECK( Step::interp_by_steps(NEW(NumExpr)(10))->equals(NEW(NumVal)(10)) );
-//    CHECK( !Step::interp_by_steps(NEW(NumExpr)(10))->equals(NEW(NumVal)(20)) );
+//    CHECK( StepMachine().interp_by_steps(NEW(NumExpr)(10)).equals(Val::num(10)) );
+//    CHECK( !StepMachine().interp_by_steps(NEW(NumExpr)(10)).equals(Val::num(20)) );
 //
 //    // AddExpr
 //    CHECK( (NEW(AddExpr)(NEW(NumExpr)(3), NEW(NumExpr)(5)))->interp(Env::emptyenv)
-//          ->equals(NEW(NumVal)(8)) );
+//          .equals(Val::num(8)) );
 //    CHECK( !(NEW(AddExpr)(NEW(NumExpr)(0), NEW(NumExpr)(1)))->interp(Env::emptyenv)
-//          ->equals(NEW(BoolVal)(true)) );
+//          .equals(Val::boolean(true)) );
 //
-//    CHECK( Step::interp_by_steps(NEW(AddExpr)(NEW(NumExpr)(3), NEW(NumExpr)(5)))
-//          ->equals(NEW(NumVal)(8)) );
-//    CHECK( !Step::interp_by_steps(NEW(AddExpr)(NEW(NumExpr)(0), NEW(NumExpr)(1)))
-//          ->equals(NEW(BoolVal)(true)) );
+//    CHECK( StepMachine().interp_by_steps(NEW(AddExpr)(NEW(NumExpr)(3), NEW(NumExpr)(5)))
+//          .equals(Val::num(8)) );
+//    CHECK( !StepMachine().interp_by_steps(NEW(AddExpr)(NEW(NumExpr)(0), NEW(NumExpr)(1)))
+//          .equals(Val::boolean(true)) );
 //
 //    // MultExpr
 //    CHECK( (NEW(MultExpr)(NEW(NumExpr)(3), NEW(NumExpr)(5)))->interp(Env::emptyenv)
-//          ->equals(NEW(NumVal)(15)) );
+//          .equals(Val::num(15)) );
 //    CHECK( !(NEW(MultExpr)(NEW(NumExpr)(0), NEW(NumExpr)(1)))->interp(Env::emptyenv)
-//          ->equals(NEW(BoolVal)(false)) );
+//          .equals(Val::boolean(false)) );
 //
-//    CHECK( Step::interp_by_steps(NEW(MultExpr)(NEW(NumExpr)(3), NEW(NumExpr)(5)))
-//          ->equals(NEW(NumVal)(15)) );
-//    CHECK( !Step::interp_by_steps(NEW(MultExpr)(NEW(NumExpr)(0), NEW(NumExpr)(1)))
-//          ->equals(NEW(BoolVal)(false)) );
+//    CHECK( StepMachine().interp_by_steps(NEW(MultExpr)(NEW(NumExpr)(3), NEW(NumExpr)(5)))
+//          .equals(Val::num(15)) );
+//    CHECK( !StepMachine().interp_by_steps(NEW(MultExpr)(NEW(NumExpr)(0), NEW(NumExpr)(1)))
+//          .equals(Val::boolean(false)) );
 //
 //    // VarExpr
 //    CHECK( evaluate_expr(NEW(VarExpr)("hello")) == "free variable: hello" );
 //    CHECK( evaluate_expr(NEW(VarExpr)("world")) == "free variable: world" );
 //
 //    // BoolExpr
-//    CHECK( (NEW(BoolExpr)(true))->interp(Env::emptyenv)->equals(NEW(BoolVal)(true)) );
-//    CHECK( (NEW(BoolExpr)(false))->interp(Env::emptyenv)->equals(NEW(BoolVal)(false)) );
-//    CHECK( !(NEW(BoolExpr)(false))->interp(Env::emptyenv)->equals(NEW(BoolVal)(true)) );
-//    CHECK( Step::interp_by_steps(NEW(BoolExpr)(true))->equals(NEW(BoolVal)(true)) );
-//    CHECK( Step::interp_by_steps(NEW(BoolExpr)(false))->equals(NEW(BoolVal)(false)) );
-//    CHECK( !Step::interp_by_steps(NEW(BoolExpr)(true))->equals(NEW(BoolVal)(false)) );
-//    CHECK( !Step::interp_by_steps(NEW(BoolExpr)(false))->equals(NEW(BoolVal)(true)) );
+//    CHECK( (NEW(BoolExpr)(true))->interp(Env::emptyenv).equals(Val::boolean(true)) );
+//    CHECK( (NEW(BoolExpr)(false))->interp(Env::emptyenv).equals(Val::boolean(false)) );
+//    CHECK( !(NEW(BoolExpr)(false))->interp(Env::emptyenv).equals(Val::boolean(true)) );
+//    CHECK( StepMachine().interp_by_steps(NEW(BoolExpr)(true)).equals(Val::boolean(true)) );
+//    CHECK( StepMachine().interp_by_steps(NEW(BoolExpr)(false)).equals(Val::boolean(false)) );
+//    CHECK( !StepMachine().interp_by_steps(NEW(BoolExpr)(true)).equals(Val::boolean(false)) );
+//    CHECK( !StepMachine().interp_by_steps(NEW(BoolExpr)(false)).equals(Val::boolean(true)) );
 //
 //    //LetExpr
 //    CHECK( (NEW(LetExpr)("x",
 //                         NEW(NumExpr)(1),
 //                         NEW(AddExpr)(NEW(VarExpr)("x"), NEW(NumExpr)(4))))
-//          ->interp(Env::emptyenv)->equals(NEW(NumVal)(5)));
+//          ->interp(Env::emptyenv).equals(Val::num(5));
 //    CHECK( evaluate_expr(NEW(LetExpr)("x",
 //                                      NEW(VarExpr)("y"),
 //                                      NEW(AddExpr)(NEW(VarExpr)("x"), NEW(NumExpr)(4))))
@@ -683,24 +1575,24 @@ static std::string evaluate_expr(PTR(Expr) expr) {
 //                         NEW(LetExpr)("x",
 //                                      NEW(NumExpr)(2),
 //                                      NEW(VarExpr)("x"))))
-//          ->interp(Env::emptyenv)->equals(NEW(NumVal)(2)) );
+//          ->interp(Env::emptyenv).equals(Val::num(2)) );
 //
-//    CHECK( Step::interp_by_steps(NEW(LetExpr)("x",
+//    CHECK( StepMachine().interp_by_steps(NEW(LetExpr)("x",
 //                                              NEW(NumExpr)(1),
 //                                              NEW(AddExpr)(NEW(VarExpr)("x"), NEW(NumExpr)(4))))
-//          ->equals(NEW(NumVal)(5)));
-//    CHECK( Step::interp_by_steps(NEW(LetExpr)("x",
+//          .equals(Val::num(5));
+//    CHECK( StepMachine().interp_by_steps(NEW(LetExpr)("x",
 //                                              NEW(NumExpr)(1),
 //                                              NEW(LetExpr)("x",
 //                                                           NEW(NumExpr)(2),
 //                                                           NEW(VarExpr)("x"))))
-//          ->equals(NEW(NumVal)(2)) );
+//          .equals(Val::num(2)) );
 //
 //    // IfExpr
 //    CHECK( (NEW(IfExpr)(NEW(BoolExpr)(false),
 //                        NEW(NumExpr)(3),
 //                        NEW(NumExpr)(6)))
-//          ->interp(Env::emptyenv)->equals(NEW(NumVal)(6)) );
+//          ->interp(Env::emptyenv).equals(Val::num(6)) );
 //    CHECK( evaluate_expr(NEW(IfExpr)(NEW(CompExpr)(NEW(VarExpr)("x"), NEW(NumExpr)(4)),
 //                                     NEW(BoolExpr)(true),
 //                                     NEW(BoolExpr)(false)))
@@ -708,31 +1600,31 @@ static std::string evaluate_expr(PTR(Expr) expr) {
 //    CHECK( !(NEW(IfExpr)(NEW(CompExpr)(NEW(NumExpr)(3), NEW(NumExpr)(4)),
 //                         NEW(NumExpr)(3),
 //                         NEW(NumExpr)(6)))
-//          ->interp(Env::emptyenv)->equals(NEW(NumVal)(3)) );
+//          ->interp(Env::emptyenv).equals(Val::num(3)) );
 //
-//    CHECK( Step::interp_by_steps(NEW(IfExpr)(NEW(BoolExpr)(false),
+//    CHECK( StepMachine().interp_by_steps(NEW(IfExpr)(NEW(BoolExpr)(false),
 //                                             NEW(NumExpr)(3),
 //                                             NEW(NumExpr)(6)))
-//          ->equals(NEW(NumVal)(6)) );
-//    CHECK( !Step::interp_by_steps(NEW(IfExpr)(NEW(CompExpr)(NEW(NumExpr)(3), NEW(NumExpr)(7)),
+//          .equals(Val::num(6)) );
+//    CHECK( !StepMachine().interp_by_steps(NEW(IfExpr)(NEW(CompExpr)(NEW(NumExpr)(3), NEW(NumExpr)(7)),
 //                                              NEW(NumExpr)(3),
 //                                              NEW(NumExpr)(9)))
-//          ->equals(NEW(NumVal)(3)) );
+//          .equals(Val::num(3)) );
 //
 //    // CompExpr
 //    CHECK((NEW(CompExpr)(NEW(BoolExpr)(true), NEW(BoolExpr)(true)))
-//          ->interp(Env::emptyenv)->equals((NEW(BoolVal)(true))) );
+//          ->interp(Env::emptyenv).equals(Val::boolean(true)) );
 //    CHECK((NEW(CompExpr)(NEW(AddExpr)(NEW(NumExpr)(6), NEW(NumExpr)(6)),
 //                         NEW(MultExpr)(NEW(NumExpr)(3), NEW(NumExpr)(4))))
-//          ->interp(Env::emptyenv)->equals((NEW(BoolVal)(true))) );
+//          ->interp(Env::emptyenv).equals(Val::boolean(true)) );
 //    CHECK(evaluate_expr(NEW(CompExpr)(NEW(VarExpr)("abcde"), NEW(NumExpr)(2)))
 //          == "free variable: abcde" );
 //
-//    CHECK( Step::interp_by_steps(NEW(CompExpr)(NEW(BoolExpr)(true), NEW(BoolExpr)(true)))
-//          ->equals((NEW(BoolVal)(true))) );
-//    CHECK( Step::interp_by_steps(NEW(CompExpr)(NEW(AddExpr)(NEW(NumExpr)(6), NEW(NumExpr)(6)),
+//    CHECK( StepMachine().interp_by_steps(NEW(CompExpr)(NEW(BoolExpr)(true), NEW(BoolExpr)(true)))
+//          .equals(Val::boolean(true)) );
+//    CHECK( StepMachine().interp_by_steps(NEW(CompExpr)(NEW(AddExpr)(NEW(NumExpr)(6), NEW(NumExpr)(6)),
 //                                               NEW(MultExpr)(NEW(NumExpr)(3), NEW(NumExpr)(4))))
-//          ->equals((NEW(BoolVal)(true))) );
+//          .equals(Val::boolean(true)) );
 //
 //    // FunExpr
 //    CHECK( (NEW(FunExpr)("x", NEW(AddExpr)(NEW(VarExpr)("x"), NEW(VarExpr)("x"))))->interp(Env::emptyenv)
@@ -740,72 +1632,72 @@ static std::string evaluate_expr(PTR(Expr) expr) {
 //    CHECK( !((NEW(FunExpr)("y", NEW(AddExpr)(NEW(VarExpr)("x"), NEW(VarExpr)("x"))))->interp(Env::emptyenv)
 //             ->to_string() == "FUNCTION]") );
 //
-//    CHECK( Step::interp_by_steps(NEW(FunExpr)("x", NEW(AddExpr)(NEW(VarExpr)("x"), NEW(VarExpr)("x"))))
+//    CHECK( StepMachine().interp_by_steps(NEW(FunExpr)("x", NEW(AddExpr)(NEW(VarExpr)("x"), NEW(VarExpr)("x"))))
 //          ->to_string() == "[FUNCTION]" );
-//    CHECK( !(Step::interp_by_steps(NEW(FunExpr)("y", NEW(AddExpr)(NEW(VarExpr)("x"), NEW(VarExpr)("x"))))
+//    CHECK( !(StepMachine().interp_by_steps(NEW(FunExpr)("y", NEW(AddExpr)(NEW(VarExpr)("x"), NEW(VarExpr)("x"))))
 //             ->to_string() == "FUNCTION]") );
 //
 //    // CallFunExpr
 //    CHECK( (NEW(CallFunExpr)(NEW(FunExpr)("x", NEW(AddExpr)(NEW(VarExpr)("x"), NEW(VarExpr)("x"))),
 //                             NEW(NumExpr)(4)))
-//          ->interp(Env::emptyenv)->equals(NEW(NumVal)(8)));
+//          ->interp(Env::emptyenv).equals(Val::num(8));
 //    CHECK( !(NEW(CallFunExpr)(NEW(FunExpr)("x", NEW(MultExpr)(NEW(VarExpr)("x"), NEW(VarExpr)("x"))),
 //                              NEW(NumExpr)(4)))
-//          ->interp(Env::emptyenv)->equals(NEW(NumVal)(15)));
+//          ->interp(Env::emptyenv).equals(Val::num(15));
 //
-//    CHECK( Step::interp_by_steps(NEW(CallFunExpr)(NEW(FunExpr)("x", NEW(AddExpr)(NEW(VarExpr)("x"), NEW(VarExpr)("x"))),
+//    CHECK( StepMachine().interp_by_steps(NEW(CallFunExpr)(NEW(FunExpr)("x", NEW(AddExpr)(NEW(VarExpr)("x"), NEW(VarExpr)("x"))),
 //                                                  NEW(NumExpr)(4)))
-//          ->equals(NEW(NumVal)(8)));
-//    CHECK( !Step::interp_by_steps(NEW(CallFunExpr)(NEW(FunExpr)("x", NEW(MultExpr)(NEW(VarExpr)("x"), NEW(VarExpr)("x"))),
+//          .equals(Val::num(8));
+//    CHECK( !StepMachine().interp_by_steps(NEW(CallFunExpr)(NEW(FunExpr)("x", NEW(MultExpr)(NEW(VarExpr)("x"), NEW(VarExpr)("x"))),
 //                                                   NEW(NumExpr)(4)))
-//          ->equals(NEW(NumVal)(15)));
+//          .equals(Val::num(15));
 //}
 //
 //TEST_CASE( "subst") {
 //    // subst method for NumExpr
-//    CHECK( (NEW(NumExpr)(10))->subst("pig", NEW(NumVal)(3))
+//    CHECK( (NEW(NumExpr)(10))->subst("pig", Val::num(3))
 //          ->equals(NEW(NumExpr)(10)) );
-//    CHECK( !(NEW(NumExpr)(10))->subst("pig", NEW(NumVal)(9))
+//    CHECK( !(NEW(NumExpr)(10))->subst("pig", Val::num(9))
 //          ->equals(NEW(NumExpr)(9)) );
 //
 //    // AddExpr
-//    CHECK( (NEW(AddExpr)(NEW(NumExpr)(2), NEW(VarExpr)("pig")))->subst("pig", NEW(NumVal)(3))
+//    CHECK( (NEW(AddExpr)(NEW(NumExpr)(2), NEW(VarExpr)("pig")))->subst("pig", Val::num(3))
 //          ->equals(NEW(AddExpr)(NEW(NumExpr)(2), NEW(NumExpr)(3))) );
-//    CHECK( !(NEW(AddExpr)(NEW(VarExpr)("cat"), NEW(VarExpr)("pig")))->subst("pig", NEW(NumVal)(3))
+//    CHECK( !(NEW(AddExpr)(NEW(VarExpr)("cat"), NEW(VarExpr)("pig")))->subst("pig", Val::num(3))
 //          ->equals(NEW(AddExpr)(NEW(NumExpr)(2), NEW(NumExpr)(3))) );
 //
 //    // MultExpr
-//    CHECK( (NEW(MultExpr)(NEW(NumExpr)(2), NEW(VarExpr)("pig")))->subst("pig", NEW(NumVal)(5))
+//    CHECK( (NEW(MultExpr)(NEW(NumExpr)(2), NEW(VarExpr)("pig")))->subst("pig", Val::num(5))
 //          ->equals(NEW(MultExpr)(NEW(NumExpr)(2), NEW(NumExpr)(5))) );
-//    CHECK( !(NEW(MultExpr)(NEW(VarExpr)("cat"), NEW(VarExpr)("pig")))->subst("pig", NEW(NumVal)(3))
+//    CHECK( !(NEW(MultExpr)(NEW(VarExpr)("cat"), NEW(VarExpr)("pig")))->subst("pig", Val::num(3))
 //          ->equals(NEW(MultExpr)(NEW(NumExpr)(2), NEW(NumExpr)(3))) );
 //
 //    // VarExpr
-//    CHECK( (NEW(VarExpr)("fish"))->subst("pig", NEW(NumVal)(3))
+//    CHECK( (NEW(VarExpr)("fish"))->subst("pig", Val::num(3))
 //          ->equals(NEW(VarExpr)("fish")) );
-//    CHECK( (NEW(VarExpr)("pig"))->subst("pig", NEW(NumVal)(3) )
+//    CHECK( (NEW(VarExpr)("pig"))->subst("pig", Val::num(3) )
 //          ->equals(NEW(NumExpr)(3)) );
-//    CHECK( (NEW(VarExpr)("pig"))->subst("pig", NEW(BoolVal)(true) )
+//    CHECK( (NEW(VarExpr)("pig"))->subst("pig", Val::boolean(true) )
 //          ->equals(NEW(BoolExpr)(true)) );
-//    CHECK( !(NEW(VarExpr)("cat"))->subst("pig", NEW(NumVal)(3) )
+//    CHECK( !(NEW(VarExpr)("cat"))->subst("pig", Val::num(3) )
 //          ->equals(NEW(NumExpr)(3)) );
 //
 //    // BoolExpr
-//    CHECK( (NEW(BoolExpr)(true))->subst("x", NEW(NumVal)(3))->equals(NEW(BoolExpr)(true)) );
-//    CHECK( !(NEW(BoolExpr)(false))->subst("false", NEW(NumVal)(3))->equals(NEW(NumExpr)(3)) );
+//    CHECK( (NEW(BoolExpr)(true))->subst("x", Val::num(3))->equals(NEW(BoolExpr)(true)) );
+//    CHECK( !(NEW(BoolExpr)(false))->subst("false", Val::num(3))->equals(NEW(NumExpr)(3)) );
 //
 //    // subst method for LetExpr
 //    CHECK( (NEW(LetExpr)("x",
 //                         NEW(VarExpr)("y"),
 //                         NEW(AddExpr)(NEW(VarExpr)("x"), NEW(NumExpr)(4))))
-//          ->subst("y", NEW(NumVal)(3))
+//          ->subst("y", Val::num(3))
 //          ->equals(NEW(LetExpr)("x",
 //                                NEW(NumExpr)(3),
 //                                NEW(AddExpr)(NEW(VarExpr)("x"), NEW(NumExpr)(4)))) );
 //    CHECK( !(NEW(LetExpr)("x",
 //                          NEW(VarExpr)("z"),
 //                          NEW(AddExpr)(NEW(VarExpr)("x"), NEW(NumExpr)(4))))
-//          ->subst("y", NEW(NumVal)(3))
+//          ->subst("y", Val::num(3))
 //          ->equals(NEW(LetExpr)("x",
 //                                NEW(NumExpr)(3),
 //                                NEW(AddExpr)(NEW(VarExpr)("x"), NEW(NumExpr)(4)))) );
@@ -813,7 +1705,7 @@ static std::string evaluate_expr(PTR(Expr) expr) {
 //    CHECK( (NEW(LetExpr)("x",
 //                         NEW(NumExpr)(3),
 //                         NEW(AddExpr)(NEW(VarExpr)("x"), NEW(NumExpr)(4))))
-//          ->subst("x", NEW(NumVal)(7))
+//          ->subst("x", Val::num(7))
 //          ->equals(NEW(LetExpr)("x",
 //                                NEW(NumExpr)(3),
 //                                NEW(AddExpr)(NEW(VarExpr)("x"), NEW(NumExpr)(4)))) );
@@ -822,7 +1714,7 @@ static std::string evaluate_expr(PTR(Expr) expr) {
 //    CHECK( (NEW(IfExpr)(NEW(CompExpr)(NEW(VarExpr)("x"), NEW(NumExpr)(3)),
 //                        NEW(BoolExpr)(true),
 //                        NEW(BoolExpr)(false)))
-//          ->subst("x", NEW(NumVal)(3))
+//          ->subst("x", Val::num(3))
 //          ->equals(NEW(IfExpr)(NEW(CompExpr)(NEW(NumExpr)(3), NEW(NumExpr)(3)),
 //                               NEW(BoolExpr)(true),
 //                               NEW(BoolExpr)(false))) );
@@ -830,48 +1722,48 @@ static std::string evaluate_expr(PTR(Expr) expr) {
 //    CHECK( !(NEW(IfExpr)(NEW(CompExpr)(NEW(VarExpr)("x"), NEW(NumExpr)(3)),
 //                         NEW(BoolExpr)(true),
 //                         NEW(BoolExpr)(false)))
-//          ->subst("y", NEW(NumVal)(3))
+//          ->subst("y", Val::num(3))
 //          ->equals(NEW(IfExpr)(NEW(CompExpr)(NEW(NumExpr)(3), NEW(NumExpr)(3)),
 //                               NEW(BoolExpr)(true),
 //                               NEW(BoolExpr)(false))) );
 //
 //    // CompExpr
 //    CHECK( (NEW(CompExpr)(NEW(VarExpr)("x"), NEW(BoolExpr)(true)))
-//          ->subst("x", NEW(NumVal)(124))
+//          ->subst("x", Val::num(124))
 //          ->equals(NEW(CompExpr)(NEW(NumExpr)(124), NEW(BoolExpr)(true))) );
 //
 //    CHECK( !(NEW(CompExpr)(NEW(VarExpr)("x"), NEW(BoolExpr)(true)))
-//          ->subst("yx", NEW(NumVal)(124))
+//          ->subst("yx", Val::num(124))
 //          ->equals(NEW(CompExpr)(NEW(NumExpr)(124), NEW(BoolExpr)(true))) );
 //
 //    CHECK( (NEW(CompExpr)(NEW(AddExpr)(NEW(VarExpr)("x"), NEW(NumExpr)(4)),
 //                          NEW(MultExpr)(NEW(NumExpr)(12), NEW(VarExpr)("x"))))
-//          ->subst("x", NEW(NumVal)(124))
+//          ->subst("x", Val::num(124))
 //          ->equals(NEW(CompExpr)(NEW(AddExpr)(NEW(NumExpr)(124), NEW(NumExpr)(4)),
 //                                 NEW(MultExpr)(NEW(NumExpr)(12), NEW(NumExpr)(124)))) );
 //
 //    // FunExpr
-//    CHECK( (NEW(FunExpr)("x", NEW(AddExpr)(NEW(VarExpr)("x"), NEW(VarExpr)("x"))))->subst("x", NEW(NumVal)(3))
+//    CHECK( (NEW(FunExpr)("x", NEW(AddExpr)(NEW(VarExpr)("x"), NEW(VarExpr)("x"))))->subst("x", Val::num(3))
 //          ->equals( NEW(FunExpr)("x", NEW(AddExpr)(NEW(VarExpr)("x"), NEW(VarExpr)("x")))) );
-//    CHECK( (NEW(FunExpr)("x", NEW(AddExpr)(NEW(VarExpr)("x"), NEW(VarExpr)("y"))))->subst("y", NEW(NumVal)(3))
+//    CHECK( (NEW(FunExpr)("x", NEW(AddExpr)(NEW(VarExpr)("x"), NEW(VarExpr)("y"))))->subst("y", Val::num(3))
 //          ->equals( NEW(FunExpr)("x", NEW(AddExpr)(NEW(VarExpr)("x"), NEW(NumExpr)(3)))) );
-//    CHECK( !(NEW(FunExpr)("x", NEW(MultExpr)(NEW(VarExpr)("x"), NEW(VarExpr)("y"))))->subst("x", NEW(NumVal)(3))
+//    CHECK( !(NEW(FunExpr)("x", NEW(MultExpr)(NEW(VarExpr)("x"), NEW(VarExpr)("y"))))->subst("x", Val::num(3))
 //          ->equals( NEW(FunExpr)("x", NEW(AddExpr)(NEW(NumExpr)(3), NEW(VarExpr)("y")))) );
 //
 //    // CallFunExpr
 //    CHECK( (NEW(CallFunExpr)(NEW(FunExpr)("x", NEW(AddExpr)(NEW(VarExpr)("x"), NEW(VarExpr)("x"))),
 //                             NEW(NumExpr)(4)))
-//          ->subst("x", NEW(NumVal)(3))
+//          ->subst("x", Val::num(3))
 //          ->equals((NEW(CallFunExpr)(NEW(FunExpr)("x", NEW(AddExpr)(NEW(VarExpr)("x"), NEW(VarExpr)("x"))),
 //                                     NEW(NumExpr)(4)))) );
 //    CHECK( (NEW(CallFunExpr)(NEW(FunExpr)("x", NEW(AddExpr)(NEW(VarExpr)("x"), NEW(VarExpr)("y"))),
 //                             NEW(NumExpr)(4)))
-//          ->subst("y", NEW(NumVal)(3))
+//          ->subst("y", Val::num(3))
 //          ->equals((NEW(CallFunExpr)(NEW(FunExpr)("x", NEW(AddExpr)(NEW(VarExpr)("x"), NEW(NumExpr)(3))),
 //                                     NEW(NumExpr)(4)))) );
 //    CHECK( !(NEW(CallFunExpr)(NEW(FunExpr)("x", NEW(MultExpr)(NEW(VarExpr)("x"), NEW(VarExpr)("x"))),
 //                              NEW(NumExpr)(4)))
-//          ->subst("x", NEW(NumVal)(3))
+//          ->subst("x", Val::num(3))
 //          ->equals((NEW(CallFunExpr)(NEW(FunExpr)("x", NEW(AddExpr)(NEW(NumExpr)(3), NEW(NumExpr)(3))),
 //                                     NEW(NumExpr)(4)))) );
 //}
@@ -1013,3 +1905,210 @@ static std::string evaluate_expr(PTR(Expr) expr) {
 //
 //}
 //
+
+/* for tests */
+#include "API.hpp"
+#include "parse.hpp"
+#include "catch.hpp"
+
+static std::string optimized(std::string program) {
+    std::stringstream input(program);
+    return optimizer(input);
+}
+
+// The result of `program`, checked to be the same after
+// it has been through `--opt`
+static std::string result_kept(std::string program) {
+    std::stringstream input(program);
+    std::string result = interp(input);
+    std::stringstream output(optimized(program));
+    CHECK( interp(output) == result );
+    return result;
+}
+
+TEST_CASE( "inlining" ) {
+    CHECK( optimized("(_fun (x) x + 1)(2)") == "3" );
+    CHECK( optimized("(_fun (f) f(3))(_fun (y) y * 2)") == "6" );
+    CHECK( optimized("(_fun (x) x + y)(2)") == "(2 + y)" );
+    // Not with an unknown argument
+    CHECK( optimized("(_fun (x) x + 1)(y)") == "(_fun(x) (x + 1))(y)" );
+    
+    // A function made in the inlined body would be made with
+    // other bindings in scope, so those calls stay
+    CHECK( optimized("(_fun (u) _fun (y) y)(1)") == "(_fun(u) (_fun(y) y))(1)" );
+    CHECK( result_kept("(_fun (u) _fun (y) y)(1) == (_fun (u) _fun (y) y)(2)") == "_false" );
+    CHECK( result_kept("(_fun (u) _fun (y) y)(1) == (_fun (u) _fun (y) y)(1)") == "_true" );
+    CHECK( result_kept("_let mk = _fun (u) _fun (y) u _in mk(1) == mk(2)") == "_false" );
+    CHECK( result_kept("(_let u = 1 _in _fun (y) y) == (_let u = 2 _in _fun (y) y)") == "_false" );
+    CHECK( result_kept("(_fun (y) y) == (_fun (y) y)") == "_true" );
+}
+
+TEST_CASE( "simplifying" ) {
+    CHECK( optimized("1 + x + 2 + 3") == "(x + 6)" );
+    CHECK( optimized("2 * x * 3") == "(x * 6)" );
+    CHECK( optimized("x == x") == "_true" );
+    CHECK( optimized("_if _true _then 1 _else y") == "1" );
+    CHECK( optimized("_if c _then x + 1 _else x + 1") == "(x + 1)" );
+    // Errors stay where `interp` would raise them
+    CHECK( optimized("_true + 1 + 2") == "(_true + (1 + 2))" );
+    
+    // Branches that make functions are kept, since they may
+    // only look alike once optimized
+    CHECK( optimized("_if c _then _fun (y) y _else _fun (y) y")
+          == "(_if c _then (_fun(y) y) _else (_fun(y) y))" );
+}
+
+TEST_CASE( "let bindings" ) {
+    CHECK( optimized("_let x = 1 _in _let y = z _in x + y") == "(1 + z)" );
+    CHECK( optimized("_let x = y _in x + x") == "(y + y)" );
+    // A binding that might fail stays even when unused
+    CHECK( optimized("_let x = z + 1 _in 3") == "(_let x = (z + 1) _in 3)" );
+    CHECK( optimized("_let x = _true + 1 _in 3") == "(_let x = (_true + 1) _in 3)" );
+    CHECK( result_kept("_let x = 2 _in _let y = x * x _in _let x = y + 1 _in x * y") == "20" );
+}
+
+TEST_CASE( "floating lets out of functions" ) {
+    CHECK( optimized("_fun (x) _let k = _fun (y) y _in k(x)") == "(_fun(x) (_fun(y) y)(x))" );
+    // Arithmetic on numbers can't fail, so it moves too
+    CHECK( optimized("_fun (n) _let m = n + 1 _in _fun (x) _let k = m * 2 _in x + k")
+          == "(_fun(n) (_let m = (n + 1) _in (_let k = (m * 2) _in (_fun(x) (x + k)))))" );
+    CHECK( optimized("_let m = a + b _in _fun (x) _let k = m * 2 _in _let j = k + 1 _in x + j")
+          == "(_let m = (a + b) _in (_let k = (m * 2) _in (_let j = (k + 1) _in (_fun(x) (x + j)))))" );
+    
+    // Not when a variable might not hold a number
+    CHECK( optimized("_fun (x) _let k = m * 2 _in x + k") == "(_fun(x) (_let k = (m * 2) _in (x + k)))" );
+    CHECK( optimized("_fun (m) _fun (x) _let k = m * 2 _in x + k")
+          == "(_fun(m) (_fun(x) (_let k = (m * 2) _in (x + k))))" );
+    CHECK( optimized("_let m = a + b _in _fun (m) _let k = m * 2 _in k")
+          == "(_let m = (a + b) _in (_fun(m) (_let k = (m * 2) _in k)))" );
+    CHECK( result_kept("_let f = _fun (m) _fun (x) _let k = m * 2 _in x + k _in _let g = f(_true) _in 1") == "1" );
+    CHECK( result_kept("_let f = _fun (n) _let m = n + 1 _in _fun (x) _let k = m * 2 _in x + k _in f(3)(4)") == "12" );
+}
+
+static std::string interpreted(std::string program) {
+    std::stringstream input(program);
+    return interp(input);
+}
+
+TEST_CASE( "tail calls" ) {
+    // Far deeper than the C++ stack would allow if each call
+    // in tail position nested
+    CHECK( interpreted("_let loop = _fun (f) _fun (n) _if n == 0 _then 0 _else f(f)(n + -1) "
+                       "_in loop(loop)(1000000)") == "0" );
+    // Through `_let` bodies and both branches
+    CHECK( interpreted("_let even = _fun (f) _fun (n) _if n == 0 _then _true "
+                       "            _else _let m = n + -1 _in _if m == 0 _then _false _else f(f)(m + -1) "
+                       "_in even(even)(1000001)") == "_false" );
+    // Calls that aren't tails still work as before
+    CHECK( interpreted("_let sum = _fun (f) _fun (n) _if n == 0 _then 0 _else n + f(f)(n + -1) "
+                       "_in sum(sum)(1000)") == "500500" );
+    CHECK_THROWS_WITH( interpreted("_let f = _fun (n) _if n == 0 _then 1(2) _else 0 _in f(0)"),
+                       "Function call error occured" );
+}
+
+TEST_CASE( "long sums and products" ) {
+    std::string sum = "0", product = "1";
+    for (int i = 1; i <= 200000; i++) {
+        sum += " + " + std::to_string(i);
+        product += " * -1";
+    }
+    // Wrapping as 32-bit arithmetic does
+    CHECK( interpreted(sum) == "-1474736480" );
+    CHECK( interpreted(product) == "1" );
+    CHECK( interpreted("_let x = 3 _in " + sum + " + x * x * x") == "-1474736453" );
+    
+    // The same error as evaluating right to left would give
+    CHECK_THROWS_WITH( interpreted("1 + _true + 3"), "Booleans could not add" );
+    CHECK_THROWS_WITH( interpreted("1 + 2 + _true"), "This is not a number" );
+    CHECK_THROWS_WITH( interpreted("(_fun (x) x) + 2 + 3"), "Functions could not add." );
+    CHECK_THROWS_WITH( interpreted("1 + 2 * _true + 4"), "This is not a number" );
+    CHECK_THROWS_WITH( interpreted(sum + " + _false"), "This is not a number" );
+}
+
+static PTR(Expr) parsed(std::string program) {
+    std::stringstream input(program);
+    return parse(input);
+}
+
+TEST_CASE( "substitution" ) {
+    ParseSession session;
+    Subst s;
+    s.bind("x", MAKE(NumExpr)(5));
+    CHECK( parsed("x + y")->subst(s)->to_string() == "(5 + y)" );
+    CHECK( parsed("x + y")->subst("x", Val::num(5))->to_string() == "(5 + y)" );
+    // Bound occurrences stay
+    CHECK( parsed("x + (_let x = x _in x) + (_fun (x) x)")->subst(s)->to_string()
+          == "(5 + ((_let x = 5 _in x) + (_fun(x) x)))" );
+    
+    // Untouched subtrees come back as they are
+    PTR(Expr) untouched = parsed("y * (z + 1)");
+    CHECK( untouched->subst(s) == untouched );
+    PTR(AddExpr) partly = CAST(AddExpr)(parsed("x + y * (z + 1)")->subst(s));
+    REQUIRE( partly != nullptr );
+    CHECK( partly->rhs == untouched );
+    
+    // Binders that would capture a replacement are renamed
+    Subst capturing;
+    capturing.bind("x", MAKE(VarExpr)("y"));
+    CHECK( parsed("_fun (y) x + y")->subst(capturing)->to_string() == "(_fun(ya) (y + ya))" );
+    CHECK( parsed("_let y = 1 _in x * y")->subst(capturing)->to_string() == "(_let ya = 1 _in (y * ya))" );
+    CHECK( parsed("_fun (y) y")->subst(capturing)->to_string() == "(_fun(y) y)" );
+    
+    // Every binding at once
+    capturing.bind("y", MAKE(VarExpr)("x"));
+    CHECK( parsed("x + y")->subst(capturing)->to_string() == "(y + x)" );
+    capturing.unbind("x");
+    CHECK( capturing.lookup("x") == nullptr );
+    CHECK( parsed("x + y")->subst(capturing)->to_string() == "(x + x)" );
+}
+
+static size_t steps_taken(std::string program, std::string &result) {
+    std::stringstream input(program);
+    StepMachine machine;
+    result = machine.interp_by_steps(resolve(parse(input))).to_string();
+    return machine.steps;
+}
+
+TEST_CASE( "stepping atomic subexpressions" ) {
+    ParseSession session;
+    std::string result;
+    // Literals, variables and `_fun`s go straight to what needs
+    // them instead of taking a step of their own, so only
+    // compound expressions take steps
+    CHECK( steps_taken("1", result) == 1 );
+    CHECK( steps_taken("1 + 2", result) == 1 );
+    CHECK( result == "3" );
+    CHECK( steps_taken("_let x = 5 _in x * x", result) == 2 );
+    CHECK( result == "25" );
+    CHECK( steps_taken("(_fun (x) x + 1)(2)", result) == 2 );
+    CHECK( result == "3" );
+    CHECK( steps_taken("(1 + 2) * (3 + 4)", result) == 5 );
+    CHECK( result == "21" );
+    
+    // Every result and error is as `interp` gives
+    const char *programs[] = {
+        "_if 1 == 1 _then 2 _else 3",
+        "_let f = _fun (x) _fun (y) x * y _in f(6)(7)",
+        "(_fun (x) x) == (_fun (x) x)",
+        "_let x = 1 _in _let y = x + x _in _if x == y _then x _else y + (_fun (z) z)(y)",
+        "_let loop = _fun (f) _fun (n) _if n == 0 _then 0 _else f(f)(n + -1) _in loop(loop)(1000)",
+        "_true + 1",
+        "1 * (_fun (x) x)",
+        "2(3)",
+        "x + 1"
+    };
+    for (size_t i = 0; i < sizeof(programs) / sizeof(programs[0]); i++) {
+        std::string expected;
+        try {
+            expected = interpreted(programs[i]);
+        } catch (std::runtime_error &e) {
+            expected = e.what();
+        }
+        try {
+            steps_taken(programs[i], result);
+        } catch (std::runtime_error &e) {
+            result = e.what();
+        }
+        CHECK( result == expected );
+    }
+}
@@ -3,24 +3,123 @@
 
 #include <string>
 #include <iostream>
+#include <memory>
+#include <vector>
 #include "pointer.hpp"
+#include "value.hpp"
+#include "arena.hpp"
+#include "varset.hpp"
 
-class Val;
 class Env;
+class Compiler;
+class Scope;
+class StepMachine;
+class Expr;
+
+/* Replacements for free variables, applied all at once by
+ `Expr::subst`. Substitution is capture-avoiding: a binder
+ whose name is free in a replacement gets renamed. */
+class Subst {
+public:
+    // Bind `name` to `e`, replacing any earlier binding
+    void bind(std::string name, PTR(Expr) e);
+    void unbind(const std::string &name);
+    
+    // The replacement for `name`, or nullptr
+    PTR(Expr) lookup(const std::string &name) const;
+    
+    // To check whether any bound name is in `vars`
+    bool touches(const VarSet &vars) const;
+    
+    // To check whether `name` is free in some replacement
+    bool captures(const std::string &name) const;
+    
+    bool empty() const { return bindings.empty(); }
+    
+private:
+    // Sorted by name
+    std::vector<std::pair<std::string, PTR(Expr)> > bindings;
+};
+
 class Expr ENABLE_THIS(Expr){
 public:
-    virtual bool equals(PTR(Expr) e) = 0;
+    // Nodes come from `Arena::current` when there is one
+    static void *operator new(size_t size);
+    static void operator delete(void *p);
+    virtual ~Expr();
+    
+    /* Build a `T` through `MAKE(T)(...)`. While an arena is
+     current, a node identical to one already made in it
+     (same fields, same children) is not made again: the
+     existing node is returned, so repeated subtrees are
+     shared and equal trees are usually the same pointer. */
+    template <class T, class... Args>
+    static PTR(T) make(Args... args);
+    
+    // Structural hash, ignoring resolved addresses, so that
+    // trees which are `equals` hash the same
+    size_t hash;
+    
+    // Compares structure (but not resolved addresses),
+    // answering from the pointers and hashes when it can
+    bool equals(PTR(Expr) e);
+    
+    // The full comparison behind `equals`
+    virtual bool deep_equals(PTR(Expr) e) = 0;
+    
+    // To check whether `e` is the same kind of node with the
+    // same fields, comparing children by identity
+    virtual bool same_node(PTR(Expr) e) = 0;
     
     // To compute the number value of an expression,
-    virtual PTR(Val) interp(PTR(Env) env) = 0;
+    // which must have been through `resolve`
+    virtual Val interp(PTR(Env) env) = 0;
+    
+    // To evaluate only up to the expression in tail position:
+    // either set `result` and return nullptr, or update `env`
+    // and return the expression whose value is the result.
+    // `interp` loops on this so tail calls don't use C++ stack
+    virtual PTR(Expr) interp_tail(PTR(Env) &env, Val &result);
+    
+    virtual void step_interp(StepMachine &step) = 0;
+    
+    // To evaluate a literal, variable or `_fun` in place,
+    // setting `val`, so the step machine can hand the value
+    // straight to what needs it; false for anything else
+    virtual bool step_atomic(PTR(Env) env, Val &val);
+    
+    // To emit bytecode for the expression; `tail` is true
+    // when its value is the result of the enclosing function
+    virtual void compile(Compiler &c, bool tail) = 0;
+    
+    // To give variables their lexical address in `scope`
+    virtual PTR(Expr) resolve(Scope *scope) = 0;
+    
+    // To substitute a value in place of a variable
+    PTR(Expr) subst(std::string var, Val val);
+    
+    // To apply every substitution in `s` in one pass, returning
+    // this same node when none of its free variables is bound
+    PTR(Expr) subst(const Subst &s);
     
-    virtual void step_interp() = 0;
+    // The rebuilding half of `subst`, for nodes it touches
+    virtual PTR(Expr) subst_node(const Subst &s) = 0;
     
-    // To substitute a number in place of a variable
-    virtual PTR(Expr) subst(std::string var, PTR(Val) val) = 0;
+    // Free variables, computed once when the node is made
+    VarSet free_vars;
     
-    // To check whether a expression contains a variable
-    virtual bool containsVar() = 0;
+    // To check whether a expression contains a free variable
+    bool containsVar() { return free_vars != nullptr; }
+    
+    // Size of the tree, counting shared subtrees each time
+    // they occur, also computed once when the node is made
+    size_t node_count;
+    
+    // Whether a `_fun` occurs anywhere in the tree. A closure
+    // compares by the bindings in scope where it was made, so
+    // moving, sharing or dropping what surrounds one can change
+    // what `==` on it gives; also computed once
+    bool has_fun;
     
     // To optimize a expression
     virtual PTR(Expr) optimizer() = 0;
@@ -33,13 +132,16 @@ public:
     int rep;
     NumExpr(int rep);
     
-    bool equals(PTR(Expr) e);
+    bool deep_equals(PTR(Expr) e);
+    bool same_node(PTR(Expr) e);
     
-    PTR(Val) interp(PTR(Env) env);
-    void step_interp();
+    Val interp(PTR(Env) env);
+    void step_interp(StepMachine &step);
+    bool step_atomic(PTR(Env) env, Val &val);
+    void compile(Compiler &c, bool tail);
+    PTR(Expr) resolve(Scope *scope);
     
-    PTR(Expr) subst(std::string var, PTR(Val) val);
-    bool containsVar();
+    PTR(Expr) subst_node(const Subst &s);
     PTR(Expr) optimizer();
     
     std::string to_string();
@@ -51,13 +153,15 @@ public:
     PTR(Expr) rhs;
         
     AddExpr(PTR(Expr) lhs, PTR(Expr) rhs);
-    bool equals(PTR(Expr) e);
+    bool deep_equals(PTR(Expr) e);
+    bool same_node(PTR(Expr) e);
         
-    PTR(Val) interp(PTR(Env) env);
-    void step_interp();
+    Val interp(PTR(Env) env);
+    void step_interp(StepMachine &step);
+    void compile(Compiler &c, bool tail);
+    PTR(Expr) resolve(Scope *scope);
     
-    PTR(Expr) subst(std::string var, PTR(Val) val);
-    bool containsVar();
+    PTR(Expr) subst_node(const Subst &s);
     PTR(Expr) optimizer();
     
     std::string to_string();
@@ -69,13 +173,15 @@ public:
     PTR(Expr) rhs;
         
     MultExpr(PTR(Expr) lhs, PTR(Expr) rhs);
-    bool equals(PTR(Expr) e);
+    bool deep_equals(PTR(Expr) e);
+    bool same_node(PTR(Expr) e);
         
-    PTR(Val) interp(PTR(Env) env);
-    void step_interp();
+    Val interp(PTR(Env) env);
+    void step_interp(StepMachine &step);
+    void compile(Compiler &c, bool tail);
+    PTR(Expr) resolve(Scope *scope);
     
-    PTR(Expr) subst(std::string var, PTR(Val) val);
-    bool containsVar();
+    PTR(Expr) subst_node(const Subst &s);
     PTR(Expr) optimizer();
     
     std::string to_string();
@@ -84,15 +190,22 @@ public:
 class VarExpr : public Expr {
 public:
     std::string name;
+    // Set by `resolve`: frames to skip and the slot in
+    // that frame; -1 while unresolved
+    int depth;
+    int slot;
         
-    VarExpr(std::string name);
-    bool equals(PTR(Expr) e);
+    VarExpr(std::string name, int depth = -1, int slot = -1);
+    bool deep_equals(PTR(Expr) e);
+    bool same_node(PTR(Expr) e);
         
-    PTR(Val) interp(PTR(Env) env);
-    void step_interp();
+    Val interp(PTR(Env) env);
+    void step_interp(StepMachine &step);
+    bool step_atomic(PTR(Env) env, Val &val);
+    void compile(Compiler &c, bool tail);
+    PTR(Expr) resolve(Scope *scope);
     
-    PTR(Expr) subst(std::string var, PTR(Val) val);
-    bool containsVar();
+    PTR(Expr) subst_node(const Subst &s);
     PTR(Expr) optimizer();
     
     std::string to_string();
@@ -102,13 +215,16 @@ class BoolExpr : public Expr {
 public:
     bool rep;
     BoolExpr(bool rep);
-    bool equals(PTR(Expr) e);
+    bool deep_equals(PTR(Expr) e);
+    bool same_node(PTR(Expr) e);
         
-    PTR(Val) interp(PTR(Env) env);
-    void step_interp();
+    Val interp(PTR(Env) env);
+    void step_interp(StepMachine &step);
+    bool step_atomic(PTR(Env) env, Val &val);
+    void compile(Compiler &c, bool tail);
+    PTR(Expr) resolve(Scope *scope);
     
-    PTR(Expr) subst(std::string var, PTR(Val) val);
-    bool containsVar();
+    PTR(Expr) subst_node(const Subst &s);
     PTR(Expr) optimizer();
     
     std::string to_string();
@@ -119,14 +235,23 @@ public:
     std::string var_name;
     PTR(Expr) rhs;
     PTR(Expr) expr;
-    LetExpr(std::string var_name, PTR(Expr) rhs, PTR(Expr) expr);
-    bool equals(PTR(Expr) e);
-    
-    PTR(Val) interp(PTR(Env) env);
-    void step_interp();
-    
-    PTR(Expr) subst(std::string var, PTR(Val) val);
-    bool containsVar();
+    // Set by `resolve`: the slot holding `var_name` and, for
+    // a `_let` that has no frame to live in, the size of the
+    // frame it opens (0 otherwise)
+    int slot;
+    int frame_size;
+    LetExpr(std::string var_name, PTR(Expr) rhs, PTR(Expr) expr,
+            int slot = -1, int frame_size = 0);
+    bool deep_equals(PTR(Expr) e);
+    bool same_node(PTR(Expr) e);
+    
+    Val interp(PTR(Env) env);
+    PTR(Expr) interp_tail(PTR(Env) &env, Val &result);
+    void step_interp(StepMachine &step);
+    void compile(Compiler &c, bool tail);
+    PTR(Expr) resolve(Scope *scope);
+    
+    PTR(Expr) subst_node(const Subst &s);
     PTR(Expr) optimizer();
     
     std::string to_string();
@@ -139,13 +264,16 @@ public:
     PTR(Expr) else_part;
         
     IfExpr(PTR(Expr) if_part, PTR(Expr) then_part, PTR(Expr) else_part);
-    bool equals(PTR(Expr) e);
+    bool deep_equals(PTR(Expr) e);
+    bool same_node(PTR(Expr) e);
     
-    PTR(Val) interp(PTR(Env) env);
-    void step_interp();
+    Val interp(PTR(Env) env);
+    PTR(Expr) interp_tail(PTR(Env) &env, Val &result);
+    void step_interp(StepMachine &step);
+    void compile(Compiler &c, bool tail);
+    PTR(Expr) resolve(Scope *scope);
     
-    PTR(Expr) subst(std::string var, PTR(Val) val);
-    bool containsVar();
+    PTR(Expr) subst_node(const Subst &s);
     PTR(Expr) optimizer();
     std::string to_string();
 };
@@ -156,13 +284,15 @@ public:
     PTR(Expr) rhs;
         
     CompExpr(PTR(Expr) lhs, PTR(Expr) rhs);
-    bool equals(PTR(Expr) e);
+    bool deep_equals(PTR(Expr) e);
+    bool same_node(PTR(Expr) e);
     
-    PTR(Val) interp(PTR(Env) env);
-    void step_interp();
+    Val interp(PTR(Env) env);
+    void step_interp(StepMachine &step);
+    void compile(Compiler &c, bool tail);
+    PTR(Expr) resolve(Scope *scope);
     
-    PTR(Expr) subst(std::string var, PTR(Val) val);
-    bool containsVar();
+    PTR(Expr) subst_node(const Subst &s);
     PTR(Expr) optimizer();
     
     std::string to_string();
@@ -172,14 +302,24 @@ class FunExpr : public Expr {
 public:
     std::string formal_arg;
     PTR(Expr) body;
-    FunExpr(std::string formal_arg, PTR(Expr) body);
-    bool equals(PTR(Expr) e);
+    // Set by `resolve`: slots needed by a call's frame, and
+    // the bindings in scope where the closure is made, at
+    // frame `level`
+    int frame_size;
+    Bindings in_scope;
+    int level;
+    FunExpr(std::string formal_arg, PTR(Expr) body, int frame_size = 1,
+            Bindings in_scope = nullptr, int level = 0);
+    bool deep_equals(PTR(Expr) e);
+    bool same_node(PTR(Expr) e);
         
-    PTR(Val) interp(PTR(Env) env);
-    void step_interp();
+    Val interp(PTR(Env) env);
+    void step_interp(StepMachine &step);
+    bool step_atomic(PTR(Env) env, Val &val);
+    void compile(Compiler &c, bool tail);
+    PTR(Expr) resolve(Scope *scope);
     
-    PTR(Expr) subst(std::string var, PTR(Val) val);
-    bool containsVar();
+    PTR(Expr) subst_node(const Subst &s);
     PTR(Expr) optimizer();
     
     std::string to_string();
@@ -191,16 +331,46 @@ public:
     PTR(Expr) actual_arg;
         
     CallFunExpr(PTR(Expr) to_be_called, PTR(Expr) actual_arg);
-    bool equals(PTR(Expr) e);
+    bool deep_equals(PTR(Expr) e);
+    bool same_node(PTR(Expr) e);
     
-    PTR(Val) interp(PTR(Env) env);
-    void step_interp();
+    Val interp(PTR(Env) env);
+    PTR(Expr) interp_tail(PTR(Env) &env, Val &result);
+    void step_interp(StepMachine &step);
+    void compile(Compiler &c, bool tail);
+    PTR(Expr) resolve(Scope *scope);
     
-    PTR(Expr) subst(std::string var, PTR(Val) val);
-    bool containsVar();
+    PTR(Expr) subst_node(const Subst &s);
     PTR(Expr) optimizer();
     
     std::string to_string();
 };
     
+/* One bottom-up pass of `optimizer` over a whole program.
+ Calls of known functions are inlined at most `fuel` times,
+ so even a program that calls itself forever is optimized
+ in bounded time; `fuel` is left holding what was not
+ used. With no fuel, calls are kept. */
+PTR(Expr) simplify(PTR(Expr) e, int &fuel);
+
+// To check whether evaluating `e` can neither fail nor run
+// forever, so it may be evaluated fewer times, or sooner,
+// than written
+bool speculatable(PTR(Expr) e);
+
+#define MAKE(T) Expr::make<T>
+
+template <class T, class... Args>
+PTR(T) Expr::make(Args... args) {
+    if (Arena::current == nullptr)
+        return NEW(T)(args...);
+    T candidate(args...);
+    PTR(Expr) found = Arena::current->find_interned(&candidate);
+    if (found != nullptr)
+        return static_cast<PTR(T)>(found);
+    PTR(T) node = NEW(T)(candidate);
+    Arena::current->intern(node);
+    return node;
+}
+
 #endif /* expr_hpp */
@@ -0,0 +1,355 @@
+//
+//  gc.cpp
+//  ArithemticParser2
+//
+//  Mark-sweep collection for runtime values.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <new>
+#include <stdexcept>
+#include "gc.hpp"
+
+static const size_t min_collection_bytes = 1024 * 1024;
+static const size_t slab_bytes = 64 * 1024;
+
+// Aligned so that the object following it is too
+struct alignas(16) Heap::Header {
+    Header *next;
+    Heap *heap;
+    size_t size;
+    bool marked;
+    bool pooled;
+};
+
+static void *object_of(Heap::Header *h) {
+    return h + 1;
+}
+
+static Heap::Header *header_of(void *obj) {
+    return (Heap::Header *)obj - 1;
+}
+
+thread_local Heap *Heap::current = nullptr;
+
+//GCStats
+std::string GCStats::report() const {
+    char out[512];
+    snprintf(out, sizeof(out),
+             "collections       %zu\n"
+             "objects allocated %zu\n"
+             "objects freed     %zu\n"
+             "objects recycled  %zu\n"
+             "live objects      %zu\n"
+             "live bytes        %zu\n"
+             "peak bytes        %zu\n"
+             "pause ms          %.2f\n",
+             collections, objects_allocated, objects_freed, objects_recycled,
+             live_objects, live_bytes, peak_bytes, pause_seconds * 1000);
+    return out;
+}
+
+//Collectable
+void *Collectable::operator new(size_t size) {
+    if (Heap::current != nullptr)
+        return Heap::current->allocate(size);
+    
+    Heap::Header *h = (Heap::Header *)malloc(sizeof(Heap::Header) + size);
+    if (h == nullptr)
+        throw std::bad_alloc();
+    h->next = nullptr;
+    h->heap = nullptr;
+    h->size = size;
+    h->marked = false;
+    h->pooled = false;
+    return object_of(h);
+}
+
+void Collectable::operator delete(void *p) {
+    Heap::Header *h = header_of(p);
+    if (h->heap != nullptr)
+        h->heap->release(p);
+    else
+        free(h);
+}
+
+Collectable::~Collectable() { }
+
+//Heap
+Heap::Heap(size_t limit) {
+    this->limit = limit;
+    stats = GCStats();
+    objects = nullptr;
+    allocated_since_collection = 0;
+    next_collection = min_collection_bytes;
+    slab_next = nullptr;
+    slab_end = nullptr;
+}
+
+Heap::~Heap() {
+    while (objects != nullptr) {
+        Header *h = objects;
+        objects = h->next;
+        ((PTR(Collectable))object_of(h))->~Collectable();
+        free(h);
+    }
+    // Pooled objects still live hold nothing that needs
+    // their destructors
+    for (size_t i = 0; i < slabs.size(); i++)
+        free(slabs[i]);
+}
+
+void *Heap::allocate(size_t size) {
+    Header *h = (Header *)malloc(sizeof(Header) + size);
+    if (h == nullptr)
+        throw std::bad_alloc();
+    h->next = objects;
+    h->heap = this;
+    h->size = size;
+    h->marked = false;
+    h->pooled = false;
+    objects = h;
+    
+    stats.objects_allocated++;
+    stats.live_objects++;
+    stats.live_bytes += size;
+    if (stats.live_bytes > stats.peak_bytes)
+        stats.peak_bytes = stats.live_bytes;
+    allocated_since_collection += size;
+    return object_of(h);
+}
+
+// Only reached when a constructor throws, so the
+// object is still the newest one.
+void Heap::release(void *p) {
+    Header *h = header_of(p);
+    if (h->pooled) {
+        return_block(h);
+        return;
+    }
+    if (objects == h) {
+        objects = h->next;
+        stats.live_objects--;
+        stats.live_bytes -= h->size;
+        free(h);
+    }
+}
+
+bool Heap::wants_collection() {
+    return allocated_since_collection >= next_collection;
+}
+
+/* Pooled objects are traced every time they are reached,
+ with no mark bit to stop at. That terminates only because
+ pooled continuations form acyclic, unshared chains: each
+ is referred to by exactly one register or continuation.
+ Anything that builds them (the step machine, or
+ `load_snapshot`) must keep it that way. */
+void Heap::mark(PTR(Collectable) obj) {
+    if (obj == nullptr)
+        return;
+    Header *h = header_of(obj);
+    // Objects outside this heap never point into it
+    if (h->heap != this || h->marked)
+        return;
+    // Pooled objects are never swept, so a mark would stay
+    if (!h->pooled)
+        h->marked = true;
+    grey.push_back(obj);
+}
+
+static size_t size_class(size_t size) {
+    return (size + 15) / 16;
+}
+
+void *Heap::allocate_pooled(size_t size) {
+    size_t c = size_class(size);
+    Header *h;
+    if (c < free_blocks.size() && free_blocks[c] != nullptr) {
+        h = free_blocks[c];
+        free_blocks[c] = h->next;
+    } else {
+        size_t bytes = sizeof(Header) + c * 16;
+        if (slab_next == nullptr || (size_t)(slab_end - slab_next) < bytes) {
+            size_t slab = bytes > slab_bytes ? bytes : slab_bytes;
+            slab_next = (char *)malloc(slab);
+            if (slab_next == nullptr)
+                throw std::bad_alloc();
+            slab_end = slab_next + slab;
+            slabs.push_back(slab_next);
+        }
+        h = (Header *)slab_next;
+        slab_next += bytes;
+    }
+    h->next = nullptr;
+    h->heap = this;
+    h->size = size;
+    h->marked = false;
+    h->pooled = true;
+    
+    stats.objects_allocated++;
+    stats.live_objects++;
+    stats.live_bytes += size;
+    if (stats.live_bytes > stats.peak_bytes)
+        stats.peak_bytes = stats.live_bytes;
+    return object_of(h);
+}
+
+void Heap::return_block(Header *h) {
+    size_t c = size_class(h->size);
+    if (c >= free_blocks.size())
+        free_blocks.resize(c + 1, nullptr);
+    stats.live_objects--;
+    stats.live_bytes -= h->size;
+    h->next = free_blocks[c];
+    free_blocks[c] = h;
+}
+
+void Heap::recycle(PTR(Collectable) obj) {
+    Header *h = header_of(obj);
+    if (h->heap != this || !h->pooled)
+        return;
+    obj->~Collectable();
+    stats.objects_recycled++;
+    return_block(h);
+}
+
+void Heap::collect() {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    
+    // Trace with an explicit stack, since environment and
+    // continuation chains can be very long
+    while (!grey.empty()) {
+        PTR(Collectable) obj = grey.back();
+        grey.pop_back();
+        obj->trace(*this);
+    }
+    
+    Header **link = &objects;
+    while (*link != nullptr) {
+        Header *h = *link;
+        if (h->marked) {
+            h->marked = false;
+            link = &h->next;
+        } else {
+            *link = h->next;
+            stats.objects_freed++;
+            stats.live_objects--;
+            stats.live_bytes -= h->size;
+            ((PTR(Collectable))object_of(h))->~Collectable();
+            free(h);
+        }
+    }
+    
+    stats.collections++;
+    allocated_since_collection = 0;
+    next_collection = stats.live_bytes > min_collection_bytes ? stats.live_bytes : min_collection_bytes;
+    stats.pause_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    
+    if (limit != 0 && stats.live_bytes > limit)
+        throw std::runtime_error("out of memory: heap limit exceeded");
+}
+
+/* for tests */
+#include <sstream>
+#include "API.hpp"
+#include "catch.hpp"
+
+class TestCell : public Collectable {
+public:
+    PTR(TestCell) next;
+    TestCell(PTR(TestCell) next) {
+        this->next = next;
+    }
+    void trace(Heap &heap) {
+        heap.mark(next);
+    }
+};
+
+// Pooled the way `Cont` is
+class PooledCell : public TestCell {
+public:
+    PooledCell() : TestCell(nullptr) { }
+    static void *operator new(size_t size) {
+        return Heap::current->allocate_pooled(size);
+    }
+};
+
+static const char deep_sum[] =
+    "_let sum = _fun (f) _fun (n) _if n == 0 _then 0 _else n + f(f)(n + -1) "
+    "_in sum(sum)(100000)";
+
+TEST_CASE( "heap collection" ) {
+    Heap heap;
+    PTR(TestCell) kept;
+    {
+        CurrentHeap current(&heap);
+        kept = NEW(TestCell)(NEW(TestCell)(nullptr));
+        NEW(TestCell)(NEW(TestCell)(nullptr));
+    }
+    CHECK( heap.stats.objects_allocated == 4 );
+    CHECK( heap.stats.live_objects == 4 );
+    
+    heap.mark(kept);
+    heap.collect();
+    CHECK( heap.stats.collections == 1 );
+    CHECK( heap.stats.objects_freed == 2 );
+    CHECK( heap.stats.live_objects == 2 );
+    CHECK( heap.stats.live_bytes == 2 * sizeof(TestCell) );
+    CHECK( heap.stats.peak_bytes == 4 * sizeof(TestCell) );
+    
+    // Cycles are collected too
+    kept->next->next = kept;
+    heap.collect();
+    CHECK( heap.stats.live_objects == 0 );
+    
+    // Objects made with no current heap are never freed
+    // by one
+    PTR(TestCell) outside = NEW(TestCell)(nullptr);
+    heap.mark(outside);
+    heap.collect();
+    CHECK( heap.stats.live_objects == 0 );
+    delete outside;
+}
+
+TEST_CASE( "heap pooled objects" ) {
+    Heap heap;
+    CurrentHeap current(&heap);
+    PTR(PooledCell) first = NEW(PooledCell)();
+    CHECK( heap.stats.live_objects == 1 );
+    
+    // Pooled objects survive collection unmarked...
+    heap.collect();
+    CHECK( heap.stats.live_objects == 1 );
+    
+    // ...and their memory is reused once recycled
+    heap.recycle(first);
+    CHECK( heap.stats.objects_recycled == 1 );
+    CHECK( heap.stats.live_objects == 0 );
+    PTR(PooledCell) second = NEW(PooledCell)();
+    CHECK( second == first );
+    heap.recycle(second);
+}
+
+TEST_CASE( "heap limit" ) {
+    Heap heap(2 * sizeof(TestCell));
+    PTR(TestCell) kept;
+    {
+        CurrentHeap current(&heap);
+        kept = NEW(TestCell)(NEW(TestCell)(NEW(TestCell)(nullptr)));
+    }
+    heap.mark(kept);
+    CHECK_THROWS_WITH( heap.collect(), "out of memory: heap limit exceeded" );
+    
+    GCStats stats;
+    std::stringstream unbounded(deep_sum);
+    CHECK( step_interp(unbounded, 0, &stats) == "705082704" );
+    CHECK( stats.collections > 0 );
+    CHECK( stats.peak_bytes > 1024 * 1024 );
+    std::stringstream bounded(deep_sum);
+    CHECK_THROWS_WITH( step_interp(bounded, 1024 * 1024, &stats),
+                       "out of memory: heap limit exceeded" );
+    CHECK( stats.live_bytes > 1024 * 1024 );
+}
@@ -0,0 +1,117 @@
+//
+//  gc.hpp
+//  ArithemticParser2
+//
+//  Mark-sweep collection for runtime values.
+//
+
+#ifndef gc_hpp
+#define gc_hpp
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include "pointer.hpp"
+
+class Heap;
+
+/* Base class of `Val`, `Env` and `Cont`. Objects created
+ while a `Heap` is current belong to that heap and are
+ freed by its collections; anything else is never freed. */
+class Collectable {
+public:
+    static void *operator new(size_t size);
+    static void operator delete(void *p);
+    virtual ~Collectable();
+    
+    // To call `heap.mark` on every collectable object
+    // this one refers to
+    virtual void trace(Heap &heap) = 0;
+};
+
+struct GCStats {
+    size_t collections;
+    size_t objects_allocated;
+    size_t objects_freed;
+    size_t objects_recycled;
+    size_t live_objects;
+    size_t live_bytes;
+    size_t peak_bytes;
+    double pause_seconds;
+    
+    // One line per counter, for `--gc-stats`
+    std::string report() const;
+};
+
+class Heap {
+public:
+    /* `limit` is the most bytes that may survive a collection
+     before evaluation fails; 0 means no limit. */
+    Heap(size_t limit = 0);
+    ~Heap();
+    
+    size_t limit;
+    GCStats stats;
+    
+    void *allocate(size_t size);
+    void release(void *p);
+    
+    // Whether enough has been allocated since the last
+    // collection to make another one worthwhile
+    bool wants_collection();
+    
+    /* A collection is `mark` on each root followed by
+     `collect`, and may only happen where the roots are the
+     only references to objects in this heap. Throws
+     `runtime_error` if the survivors exceed `limit`. */
+    void mark(PTR(Collectable) obj);
+    void collect();
+    
+    /* Objects that are used once and never shared, like the
+     continuations of a step machine, can bypass collection:
+     `allocate_pooled` takes memory from a free list kept
+     for each size, and `recycle` returns it as soon as the
+     object is dead. `mark` traces through pooled objects
+     without marking them, so they must not form cycles;
+     they do count towards `limit`. */
+    void *allocate_pooled(size_t size);
+    void recycle(PTR(Collectable) obj);
+    
+    /* The heap that `NEW` allocates collectables from,
+     or NULL for none. */
+    static thread_local Heap *current;
+    
+    /* Every collectable is preceded by a header, whether
+     or not it belongs to a heap. */
+    struct Header;
+    
+private:
+    Header *objects;
+    size_t allocated_since_collection;
+    size_t next_collection;
+    std::vector<PTR(Collectable)> grey;
+    
+    // Pooled memory: free blocks by size in 16-byte steps,
+    // and the slabs they are cut from
+    std::vector<Header *> free_blocks;
+    std::vector<char *> slabs;
+    char *slab_next;
+    char *slab_end;
+    
+    void return_block(Header *h);
+};
+
+// Makes a heap current until the end of the scope
+class CurrentHeap {
+public:
+    Heap *saved;
+    CurrentHeap(Heap *heap) {
+        saved = Heap::current;
+        Heap::current = heap;
+    }
+    ~CurrentHeap() {
+        Heap::current = saved;
+    }
+};
+
+#endif /* gc_hpp */
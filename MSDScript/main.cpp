@@ -7,20 +7,163 @@
 #include "env.hpp"
 #include "expr.hpp"
 #include "step.hpp"
+#include "vm.hpp"
+#include "resolve.hpp"
+#include "arena.hpp"
+#include "API.hpp"
+#include "serve.hpp"
+#include "passes.hpp"
+#include "snapshot.hpp"
+#include <fstream>
 
 int main(int argc, const char * argv[]) {
     
-    //Catch::Session().run();
+    if (argc >= 2 && std::string(argv[1]) == "--test") {
+        // --test [catch options]: run the test cases in place of a program
+        argv[1] = argv[0];
+        return Catch::Session().run(argc - 1, argv + 1);
+    }
+    
+    if (argc >= 2 && std::string(argv[1]) == "--green") {
+        // --green n [--quantum steps] [--step-limit steps]
+        int workers = argc >= 3 ? atoi(argv[2]) : 0;
+        size_t quantum = 10000;
+        size_t step_limit = 0;
+        if (workers < 1) {
+            std::cerr << "--green needs a positive count" << std::endl;
+            exit(1);
+        }
+        for (int i = 3; i < argc; i++) {
+            std::string parameter(argv[i]);
+            if (parameter == "--quantum" && i + 1 < argc) {
+                quantum = atol(argv[++i]);
+            } else if (parameter == "--step-limit" && i + 1 < argc) {
+                step_limit = atol(argv[++i]);
+            } else {
+                std::cerr << "Unknown parameter" << parameter << std::endl;
+                exit(1);
+            }
+        }
+        serve_green(0, 1, workers, quantum, step_limit);
+        return 0;
+    }
+    
+    if (argc >= 2 && (std::string(argv[1]) == "--serve" || std::string(argv[1]) == "--jobs")) {
+        // --serve [--opt | --step | --vm] [--socket path]
+        // --jobs n [--opt | --step | --vm]
+        engine_t engine = interp;
+        std::string socket_path;
+        int jobs = 0;
+        for (int i = 1; i < argc; i++) {
+            std::string parameter(argv[i]);
+            if (parameter == "--serve") {
+                continue;
+            } else if (parameter == "--opt") {
+                engine = optimizer;
+            } else if (parameter == "--step") {
+                engine = step_interp;
+            } else if (parameter == "--vm") {
+                engine = vm_interp;
+            } else if (parameter == "--socket" && i + 1 < argc) {
+                socket_path = argv[++i];
+            } else if (parameter == "--jobs" && i + 1 < argc) {
+                jobs = atoi(argv[++i]);
+                if (jobs < 1) {
+                    std::cerr << "--jobs needs a positive count" << std::endl;
+                    exit(1);
+                }
+            } else {
+                std::cerr << "Unknown parameter" << parameter << std::endl;
+                exit(1);
+            }
+        }
+        if (jobs > 0)
+            serve_batch(0, 1, engine, jobs);
+        else if (socket_path.empty())
+            serve_stream(0, 1, engine);
+        else
+            serve_socket(socket_path, engine);
+        return 0;
+    }
     
-    if (argc == 1) {
-        std::cout << parse(std::cin)->interp(Env::emptyenv)->to_string() << std::endl;
+    ParseSession session;
+    
+    if (argc >= 2 && (std::string(argv[1]) == "--checkpoint" || std::string(argv[1]) == "--resume")) {
+        // --checkpoint path steps: step the program for at most `steps` steps,
+        //     saving the machine to `path` if it isn't done by then
+        // --resume path [steps]: carry on from `path`, saving again if
+        //     `steps` more steps don't finish it
+        if (argc < 3 || (std::string(argv[1]) == "--checkpoint" && argc < 4)) {
+            std::cerr << argv[1] << " needs a snapshot path" << (argc < 3 ? "" : " and a step count") << std::endl;
+            exit(1);
+        }
+        std::string path(argv[2]);
+        size_t max_steps = argc >= 4 ? atol(argv[3]) : (size_t)-1;
+        StepMachine machine;
+        if (std::string(argv[1]) == "--checkpoint") {
+            machine.start(resolve(parse(std::cin)));
+        } else {
+            std::ifstream in(path, std::ios::binary);
+            if (!in) {
+                std::cerr << "can't read " << path << std::endl;
+                exit(1);
+            }
+            load_snapshot(machine, in);
+        }
+        if (machine.run(max_steps)) {
+            std::cout << machine.val.to_string() << std::endl;
+        } else {
+            std::ofstream out(path, std::ios::binary | std::ios::trunc);
+            save_snapshot(machine, out);
+            std::cout << "saved to " << path << " after " << machine.steps << " steps" << std::endl;
+        }
+    } else if (argc >= 2 && std::string(argv[1]) == "--opt") {
+        // --opt [--passes fold,inline,cse] [--rounds n] [--budget nodes] [--stats]
+        PassManager manager;
+        bool show_stats = false;
+        for (int i = 2; i < argc; i++) {
+            std::string parameter(argv[i]);
+            if (parameter == "--passes" && i + 1 < argc) {
+                manager.use(argv[++i]);
+            } else if (parameter == "--rounds" && i + 1 < argc) {
+                manager.max_rounds = atoi(argv[++i]);
+            } else if (parameter == "--budget" && i + 1 < argc) {
+                manager.node_budget = atol(argv[++i]);
+            } else if (parameter == "--stats") {
+                show_stats = true;
+            } else {
+                std::cerr << "Unknown parameter" << parameter << std::endl;
+                exit(1);
+            }
+        }
+        std::string optimized = manager.run(parse(std::cin))->to_string();
+        std::cout << optimized << std::endl;
+        if (show_stats)
+            std::cerr << manager.report();
+    } else if (argc >= 2 && std::string(argv[1]) == "--step") {
+        // --step [--heap-limit bytes] [--gc-stats]
+        StepMachine machine;
+        bool show_stats = false;
+        for (int i = 2; i < argc; i++) {
+            std::string parameter(argv[i]);
+            if (parameter == "--heap-limit" && i + 1 < argc) {
+                machine.heap.limit = atol(argv[++i]);
+            } else if (parameter == "--gc-stats") {
+                show_stats = true;
+            } else {
+                std::cerr << "Unknown parameter" << parameter << std::endl;
+                exit(1);
+            }
+        }
+        std::cout << machine.interp_by_steps(resolve(parse(std::cin))).to_string() << std::endl;
+        if (show_stats)
+            std::cerr << machine.heap.stats.report();
+    } else if (argc == 1) {
+        std::cout << resolve(parse(std::cin))->interp(Env::emptyenv).to_string() << std::endl;
     } else if (argc == 2) {
         std::string parameter(argv[1]);
-        if (parameter == "--opt") {
-            std::string optimized = parse(std::cin)->optimizer()->to_string();
-            std::cout << optimized << std::endl;
-        } else if (parameter == "--step") {
-            std::cout << Step::interp_by_steps(parse(std::cin))->to_string() << std::endl;
+        if (parameter == "--vm") {
+            std::cout << VM::interp(resolve(parse(std::cin))) << std::endl;
         } else {
             std::cerr << "Unknown parameter" << parameter << std::endl;
             exit(1);
@@ -1,195 +1,403 @@
 #include <iostream>
 #include <sstream>
+#include <vector>
+#include <limits.h>
+#include <string.h>
 #include "parse.hpp"
 #include "expr.hpp"
 #include "env.hpp"
 #include "value.hpp"
 #include "step.hpp"
 
-PTR(Expr) parse(std::istream &in);
-static PTR(Expr) parse_expr(std::istream &in);
-static PTR(Expr) parse_comparg(std::istream &in);
-static PTR(Expr) parse_addend(std::istream &in);
-static PTR(Expr) parse_multicand(std::istream &in);
-static PTR(Expr) parse_inner(std::istream &in);
-static PTR(Expr) parse_number(std::istream &in);
-static PTR(Expr) parse_variable(std::istream &in);
-static PTR(Expr) parse_let(std::istream &in);
-static PTR(Expr) parse_if(std::istream &in);
-static PTR(Expr) parse_fun(std::istream &in);
-static std::string parse_keyword(std::istream &in);
-static std::string parse_alphabetic(std::istream &in, std::string prefix);
-static char peek_after_spaces(std::istream &in);
+typedef enum {
+    tok_number,   // `-` and/or digits; the value is in `num`
+    tok_name,     // letters
+    tok_keyword,  // `_` followed by letters
+    tok_punct,    // one of ( ) + * =
+    tok_other,    // any other single character
+    tok_end
+} tok_kind_t;
 
-static char peek_after_spaces(std::istream &in) {
-    char c;
-    while (1) {
-        c = in.peek();
-        if (!isspace(c))
-            break;
-        c = in.get();
-    }
-    return c;
-}
-
-// Take an input stream that contains an expression,
-// and returns the parsed representation of that expression.
-// Throws `runtime_error` for parse errors.
-PTR(Expr) parse(std::istream &in) {
-    PTR(Expr) e = parse_expr(in);
+/* A token refers to its text in the source buffer
+ rather than holding a copy. */
+struct Token {
+    tok_kind_t kind;
+    const char *start;
+    size_t length;
+    int num;
     
-    char c = peek_after_spaces(in);
-    if (!in.eof()){
-        throw std::runtime_error((std::string)"expected end of file at " + c);
+    bool is(char punct) const {
+        return kind == tok_punct && *start == punct;
     }
-    return e;
-}
+    bool is_keyword(const char *keyword) const {
+        return kind == tok_keyword && strlen(keyword) == length
+        && memcmp(start, keyword, length) == 0;
+    }
+    std::string text() const {
+        return std::string(start, length);
+    }
+    // The character error messages report for this token
+    char first() const {
+        return kind == tok_end ? (char)EOF : *start;
+    }
+};
 
-static PTR(Expr) parse_expr(std::istream &in) {
-    PTR(Expr) e = parse_comparg(in);
-    char c = peek_after_spaces(in);
-    if (c == '=') {
-        in >> c;
-        in >> c;
-        if (c != '=') {
-            throw std::runtime_error((std::string)"expected == at =" + c);
+/* Splits a buffer into tokens on demand, with one
+ token of lookahead. The buffer must outlive the lexer. */
+class Lexer {
+public:
+    Lexer(const char *start, const char *end) {
+        this->pos = start;
+        this->end = end;
+        this->has_ahead = false;
+    }
+    
+    const Token &peek() {
+        if (!has_ahead) {
+            ahead = lex();
+            has_ahead = true;
         }
-        PTR(Expr) rhs = parse_expr(in);
-        e = NEW(CompExpr)(e, rhs);
+        return ahead;
     }
-    return e;
-}
-
-static PTR(Expr) parse_comparg(std::istream &in) {
-    PTR(Expr) e = parse_addend(in);
-    char c = peek_after_spaces(in);
-    if (c == '+') {
-        in >> c;
-        PTR(Expr) rhs = parse_comparg(in);
-        e = NEW(AddExpr)(e, rhs);
+    
+    Token next() {
+        peek();
+        has_ahead = false;
+        return ahead;
     }
-    return e;
-}
-
-// Takes an input stream that starts with an addend,
-// consuming the largest initial addend possible, where
-// an addend is an expression that does not have `+`
-// except within nested expressions (like parentheses).
-static PTR(Expr) parse_addend(std::istream &in) {
-    PTR(Expr) e = parse_multicand(in);
-    char c = peek_after_spaces(in);
-    if (c == '*') {
-        c = in.get();
-        PTR(Expr) rhs = parse_addend(in);
-        e = NEW(MultExpr)(e, rhs);
+    
+    /* What to report as found in place of a keyword such as
+     `_in`. The stream parser this replaced skipped the first
+     character, taking it to be `_`, and read the letters after
+     it, so `x` came out as `_` and `xyz` as `_yz`; keep its
+     messages. */
+    std::string keyword_at(const Token &t) const {
+        std::string found = "_";
+        if (t.kind == tok_end)
+            return found;
+        for (const char *p = t.start + 1; p < end && isalpha((unsigned char)*p); p++)
+            found += *p;
+        return found;
     }
-    return e;
-}
+    
+private:
+    const char *pos;
+    const char *end;
+    Token ahead;
+    bool has_ahead;
+    
+    Token lex();
+};
 
-static PTR(Expr) parse_multicand(std::istream &in) {
-    PTR(Expr) e = parse_inner(in);
-    while (peek_after_spaces(in) == '(') {
-        PTR(Expr) actual_arg = parse_inner(in);
-        e = NEW(CallFunExpr)(e, actual_arg);
-    }
-    return e;
+static bool is_alpha(char c) {
+    return isalpha((unsigned char)c);
 }
 
+static bool is_digit(char c) {
+    return isdigit((unsigned char)c);
+}
 
-// Parses something with no immediate `+` or `*` from `in`.
-/* <ParseNumOrParen> = <number>
- |(<expr>)
- |<variable>
- */
-static PTR(Expr) parse_inner(std::istream &in) {
-    PTR(Expr) e;
-    char c = peek_after_spaces(in);
-    if (c == '(') {
-        c = in.get();
-        e = parse_expr(in);
-        c = peek_after_spaces(in);
-        if (c == ')'){
-            c = in.get();
-        }else{
-            throw std::runtime_error((std::string)"expected a close parenthesis");
+Token Lexer::lex() {
+    while (pos < end && isspace((unsigned char)*pos))
+        pos++;
+    
+    Token t;
+    t.start = pos;
+    t.num = 0;
+    if (pos == end) {
+        t.kind = tok_end;
+    } else if (*pos == '-' || is_digit(*pos)) {
+        // Spaces may separate a minus sign from its digits
+        bool negative = (*pos == '-');
+        if (negative) {
+            pos++;
+            while (pos < end && isspace((unsigned char)*pos))
+                pos++;
         }
-    } else if (c == '-' || isdigit(c)) {
-        e = parse_number(in);
-    } else if (isalpha(c)) {
-        e = parse_variable(in);
-    } else if (c == '_') {
-        std::string keyword = parse_keyword(in);
-        if (keyword == "_true")
-            return NEW(BoolExpr)(true);
-        else if (keyword == "_false")
-            return NEW(BoolExpr)(false);
-        else if (keyword == "_let")
-            return parse_let(in);
-        else if (keyword == "_if")
-            return parse_if(in);
-        else if (keyword == "_fun")
-            return parse_fun(in);
-        else
-            throw std::runtime_error((std::string)"unexpected keyword " + keyword);
+        if (pos == end || !is_digit(*pos))
+            throw std::runtime_error((std::string)"expected a digit after -");
+        // Saturates at INT_MAX, as `istream >> int` did; the
+        // sign comes after, so the lowest literal is -INT_MAX
+        int num = 0;
+        while (pos < end && is_digit(*pos)) {
+            int digit = *pos++ - '0';
+            if (num > (INT_MAX - digit) / 10)
+                num = INT_MAX;
+            else
+                num = num * 10 + digit;
+        }
+        t.kind = tok_number;
+        t.num = negative ? -num : num;
+    } else if (is_alpha(*pos) || *pos == '_') {
+        t.kind = (*pos == '_') ? tok_keyword : tok_name;
+        pos++;
+        while (pos < end && is_alpha(*pos))
+            pos++;
+    } else if (strchr("()+*=", *pos) != nullptr) {
+        t.kind = tok_punct;
+        pos++;
     } else {
-        throw std::runtime_error((std::string)"expected a digit or open parenthesis at " + c);
+        t.kind = tok_other;
+        pos++;
     }
-    return e;
+    t.length = pos - t.start;
+    return t;
 }
 
-// Parses a number, assuming that `in` starts with a digit.
-static PTR(Expr) parse_number(std::istream &in) {
-    char next = in.peek();
-    bool isNegative = false;
-    if (next == '-') {
-        isNegative = true;
-        in.get();
-    }
-    int num = 0;
-    in >> num;
-    if (isNegative){
-        return NEW(NumExpr)(-num);
-    }else{
-        return NEW(NumExpr)(num);
+/* The grammar, with each rule right-associative:
+ <expr>      = <comparg> [== <expr>]
+ <comparg>   = <addend> [+ <comparg>]
+ <addend>    = <multicand> [* <addend>]
+ <multicand> = <inner> {(<expr>)}
+ <inner>     = <number> | <variable> | (<expr>) | _true | _false
+ | _let <variable> = <expr> _in <expr>
+ | _if <expr> _then <expr> _else <expr>
+ | _fun (<variable>) <expr>
+ 
+ The parser keeps its own stack of partly parsed rules
+ instead of recursing in C++, so neither long operator
+ chains nor deep nesting can overflow the native stack.
+ A chain such as `1 + 2 + 3` is one frame that collects
+ its operands and folds them to the right at the end. */
+
+typedef enum {
+    rule_expr,
+    rule_comparg,
+    rule_addend,
+    rule_multicand,
+    rule_inner
+} rule_t;
+
+struct ParseFrame {
+    rule_t rule;
+    // Where to resume: 0 on entry, then rule-specific
+    int state;
+    // Where this frame's operands, or the parts of a
+    // _let/_if/_fun, start on the shared `parts` stack
+    size_t base;
+    // The variable of a _let or _fun
+    Token name;
+    
+    ParseFrame(rule_t rule, size_t base) {
+        this->rule = rule;
+        this->state = 0;
+        this->base = base;
     }
-}
+};
 
-// Parses an expression, assuming that `in` starts with a letter.
-static PTR(Expr) parse_variable(std::istream &in) {
-    return NEW(VarExpr)(parse_alphabetic(in, ""));
-}
+// States of `rule_inner` after its first token
+enum {
+    inner_paren = 1,
+    inner_let_rhs,
+    inner_let_body,
+    inner_if_test,
+    inner_if_then,
+    inner_if_else,
+    inner_fun_body
+};
+
+static PTR(Expr) parse_expr(Lexer &lex);
+static bool parse_name(Lexer &lex, Token &name);
+static PTR(Expr) fold_right(rule_t rule, std::vector<PTR(Expr)> &parts, size_t base);
 
-// Parses an expression, assuming that `in` starts with a letter.
-static std::string parse_keyword(std::istream &in) {
-    in.get();
-    return parse_alphabetic(in, "_");
+// Take an input stream that contains an expression,
+// and returns the parsed representation of that expression.
+// Throws `runtime_error` for parse errors.
+PTR(Expr) parse(std::istream &in) {
+    std::string buffer;
+    char chunk[65536];
+    while (in.read(chunk, sizeof(chunk)) || in.gcount() > 0)
+        buffer.append(chunk, in.gcount());
+    return parse(buffer.data(), buffer.data() + buffer.size());
 }
 
-// Parses an expression, assuming that `in` starts with a letter.
-static std::string parse_alphabetic(std::istream &in, std::string prefix) {
-    std::string name = prefix;
-    while (1) {
-        char c = in.peek();
-        if (!isalpha(c))
-            break;
-        name += in.get();
+PTR(Expr) parse(const char *start, const char *end) {
+    Lexer lex(start, end);
+    PTR(Expr) e = parse_expr(lex);
+    
+    const Token &t = lex.peek();
+    if (t.kind != tok_end){
+        throw std::runtime_error((std::string)"expected end of file at " + t.first());
     }
-    return name;
+    return e;
 }
 
-static PTR(Expr) parse_if(std::istream &in) {
-    PTR(Expr) if_part = parse_expr(in);
-    std::string _then = parse_keyword(in);
-    if (_then != "_then") {
-        throw std::runtime_error((std::string)"expected _then, but found " + _then);
+// Parses one <expr>, leaving the lexer at the token after it.
+static PTR(Expr) parse_expr(Lexer &lex) {
+    std::vector<ParseFrame> stack;
+    std::vector<PTR(Expr)> parts;
+    stack.push_back(ParseFrame(rule_expr, 0));
+    // What the most recently finished frame produced
+    PTR(Expr) result = nullptr;
+    
+// Start parsing `rule`, coming back to the current frame after
+#define CALL(rule) { stack.push_back(ParseFrame(rule, parts.size())); continue; }
+// Finish the current frame, producing `e`
+#define RETURN(e) { result = (e); parts.resize(f.base); stack.pop_back(); continue; }
+    
+    while (!stack.empty()) {
+        ParseFrame &f = stack.back();
+        switch (f.rule) {
+            case rule_expr:
+            case rule_comparg:
+            case rule_addend: {
+                rule_t operand_rule = (rule_t)(f.rule + 1);
+                if (f.state == 0) {
+                    f.state = 1;
+                    CALL(operand_rule);
+                }
+                parts.push_back(result);
+                const Token &t = lex.peek();
+                if (f.rule == rule_expr && t.is('=')) {
+                    lex.next();
+                    Token t2 = lex.next();
+                    // At the end of input, report the missing
+                    // operand instead, as the stream parser did
+                    if (!t2.is('=') && t2.kind != tok_end) {
+                        throw std::runtime_error((std::string)"expected == at =" + t2.first());
+                    }
+                    CALL(operand_rule);
+                } else if ((f.rule == rule_comparg && t.is('+'))
+                           || (f.rule == rule_addend && t.is('*'))) {
+                    lex.next();
+                    CALL(operand_rule);
+                }
+                RETURN(fold_right(f.rule, parts, f.base));
+            }
+                
+            case rule_multicand:
+                if (f.state == 0) {
+                    f.state = 1;
+                    CALL(rule_inner);
+                }
+                if (f.state == 1) {
+                    parts.push_back(result);
+                    f.state = 2;
+                } else {
+                    parts[f.base] = MAKE(CallFunExpr)(parts[f.base], result);
+                }
+                if (lex.peek().is('('))
+                    CALL(rule_inner);
+                RETURN(parts[f.base]);
+                
+            case rule_inner:
+                switch (f.state) {
+                    case 0: {
+                        Token t = lex.next();
+                        if (t.is('(')) {
+                            f.state = inner_paren;
+                            CALL(rule_expr);
+                        } else if (t.kind == tok_number) {
+                            RETURN(MAKE(NumExpr)(t.num));
+                        } else if (t.kind == tok_name) {
+                            RETURN(MAKE(VarExpr)(t.text()));
+                        } else if (t.kind != tok_keyword) {
+                            throw std::runtime_error((std::string)"expected a digit or open parenthesis at " + t.first());
+                        } else if (t.is_keyword("_true")) {
+                            RETURN(MAKE(BoolExpr)(true));
+                        } else if (t.is_keyword("_false")) {
+                            RETURN(MAKE(BoolExpr)(false));
+                        } else if (t.is_keyword("_let")) {
+                            if (!parse_name(lex, f.name)) {
+                                throw std::runtime_error((std::string)"variable name error");
+                            }
+                            Token eq = lex.next();
+                            if (!eq.is('=')) {
+                                throw std::runtime_error((std::string)"expected =, but found " + eq.first());
+                            }
+                            f.state = inner_let_rhs;
+                            CALL(rule_expr);
+                        } else if (t.is_keyword("_if")) {
+                            f.state = inner_if_test;
+                            CALL(rule_expr);
+                        } else if (t.is_keyword("_fun")) {
+                            Token open = lex.next();
+                            if (!open.is('(')){
+                                throw std::runtime_error((std::string)"expected ( after _fun, but found" + open.first());
+                            }
+                            if (!parse_name(lex, f.name)){
+                                throw std::runtime_error((std::string)"formal_arg name error");
+                            }
+                            Token close = lex.next();
+                            if (!close.is(')')){
+                                throw std::runtime_error((std::string)"expected ) after formal_arg, but found" + close.first());
+                            }
+                            f.state = inner_fun_body;
+                            CALL(rule_expr);
+                        } else {
+                            throw std::runtime_error((std::string)"unexpected keyword " + t.text());
+                        }
+                    }
+                    case inner_paren:
+                        if (!lex.next().is(')')){
+                            throw std::runtime_error((std::string)"expected a close parenthesis");
+                        }
+                        RETURN(result);
+                    case inner_let_rhs: {
+                        parts.push_back(result);
+                        Token _in = lex.next();
+                        if (!_in.is_keyword("_in")) {
+                            throw std::runtime_error((std::string)"expected _in, but found " + lex.keyword_at(_in));
+                        }
+                        f.state = inner_let_body;
+                        CALL(rule_expr);
+                    }
+                    case inner_let_body:
+                        RETURN(MAKE(LetExpr)(f.name.text(), parts[f.base], result));
+                    case inner_if_test: {
+                        parts.push_back(result);
+                        Token _then = lex.next();
+                        if (!_then.is_keyword("_then")) {
+                            throw std::runtime_error((std::string)"expected _then, but found " + lex.keyword_at(_then));
+                        }
+                        f.state = inner_if_then;
+                        CALL(rule_expr);
+                    }
+                    case inner_if_then: {
+                        parts.push_back(result);
+                        Token _else = lex.next();
+                        if (!_else.is_keyword("_else")) {
+                            throw std::runtime_error((std::string)"expected _else, but found" + lex.keyword_at(_else));
+                        }
+                        f.state = inner_if_else;
+                        CALL(rule_expr);
+                    }
+                    case inner_if_else:
+                        RETURN(MAKE(IfExpr)(parts[f.base], parts[f.base + 1], result));
+                    case inner_fun_body:
+                        RETURN(MAKE(FunExpr)(f.name.text(), result));
+                }
+        }
     }
-    PTR(Expr) then_part = parse_expr(in);
-    std::string _else = parse_keyword(in);
-    if (_else != "_else") {
-        throw std::runtime_error((std::string)"expected _else, but found" + _else);
+#undef CALL
+#undef RETURN
+    
+    return result;
+}
+
+// Builds `a op (b op (c ...))` from the operands of a
+// chain, which are the `parts` from `base` on.
+static PTR(Expr) fold_right(rule_t rule, std::vector<PTR(Expr)> &parts, size_t base) {
+    PTR(Expr) e = parts.back();
+    for (size_t i = parts.size() - 1; i > base; i--) {
+        PTR(Expr) lhs = parts[i - 1];
+        if (rule == rule_expr)
+            e = MAKE(CompExpr)(lhs, e);
+        else if (rule == rule_comparg)
+            e = MAKE(AddExpr)(lhs, e);
+        else
+            e = MAKE(MultExpr)(lhs, e);
     }
-    PTR(Expr) else_part = parse_expr(in);
-    return NEW(IfExpr)(if_part, then_part, else_part);
+    return e;
+}
+
+// Parses a variable name into `name`, or returns false and
+// consumes nothing if the next token is not a name.
+static bool parse_name(Lexer &lex, Token &name) {
+    if (lex.peek().kind != tok_name)
+        return false;
+    name = lex.next();
+    return true;
 }
 
 /* for tests */
@@ -209,46 +417,6 @@ static std::string parse_str_error(std::string s) {
     }
 }
 
-static PTR(Expr) parse_let(std::istream &in) {
-    peek_after_spaces(in);
-    std::string varName = parse_alphabetic(in, "");
-    if (varName == "") {
-        throw std::runtime_error((std::string)"variable name error");
-    }
-    char c = peek_after_spaces(in);
-    if (c != '=') {
-        throw std::runtime_error((std::string)"expected =, but found " + c);
-    }
-    c = in.get();
-    PTR(Expr) expr_rhs = parse_expr(in);
-    std::string _in = parse_keyword(in);
-    if (_in != "_in") {
-        throw std::runtime_error((std::string)"expected _in, but found " + _in);
-    }
-    PTR(Expr) expr = parse_expr(in);
-    return NEW(LetExpr)(varName, expr_rhs, expr);
-}
-
-static PTR(Expr) parse_fun(std::istream &in) {
-    char c = peek_after_spaces(in);
-    if (c != '('){
-        throw std::runtime_error((std::string)"expected ( after _fun, but found" + c);
-    }
-    in.get();
-    peek_after_spaces(in);
-    std::string formal_arg = parse_alphabetic(in, "");
-    if (formal_arg == ""){
-        throw std::runtime_error((std::string)"formal_arg name error");
-    }
-    c = peek_after_spaces(in);
-    if (c != ')'){
-        throw std::runtime_error((std::string)"expected ) after formal_arg, but found" + c);
-    }
-    in.get();
-    PTR(Expr) body = parse_expr(in);
-    return NEW(FunExpr)(formal_arg, body);
-}
-
 // TEST_CASE( "Simple expressions" ) {
 //     CHECK ( parse_str_error(" ( 1 ") == "expected a close parenthesis" );
 //     CHECK ( parse_str_error(" 1 )") == "expected end of file at )" );
@@ -335,30 +503,30 @@ static PTR(Expr) parse_fun(std::istream &in) {
     
 //     CHECK( parse_str("_let f = _fun(x) x + x"
 //                      "_in f(2)")
-//           ->interp(Env::emptyenv)->equals(NEW(NumVal)(4)) );
-//     CHECK( Step::interp_by_steps(parse_str("_let f = _fun(x) x + x"
+//           ->interp(Env::emptyenv).equals(Val::num(4)) );
+//     CHECK( StepMachine().interp_by_steps(parse_str("_let f = _fun(x) x + x"
 //                                            "_in f(2)"))
-//           ->equals(NEW(NumVal)(4)) );
+//           .equals(Val::num(4)) );
     
 //     CHECK( parse_str("_let f = _fun(x)"
 //                      "_fun(y)"
 //                      "x * x + y * y"
 //                      "_in f(2)(3)")
-//           ->interp(Env::emptyenv)->equals(NEW(NumVal)(13)) );
-//     CHECK( Step::interp_by_steps(parse_str("_let f = _fun(x)"
+//           ->interp(Env::emptyenv).equals(Val::num(13)) );
+//     CHECK( StepMachine().interp_by_steps(parse_str("_let f = _fun(x)"
 //                                            "_fun(y)"
 //                                            "x * x + y * y"
 //                                            "_in f(2)(3)"))
-//           ->equals(NEW(NumVal)(13)) );
+//           .equals(Val::num(13)) );
     
 //     CHECK( parse_str("(_fun(x) _fun(y) x * x + y * y)(2)")
 //           ->interp(Env::emptyenv)->to_string() == "[FUNCTION]" );
-//     CHECK( Step::interp_by_steps(parse_str("(_fun(x) _fun(y) x * x + y * y)(2)"))
+//     CHECK( StepMachine().interp_by_steps(parse_str("(_fun(x) _fun(y) x * x + y * y)(2)"))
 //           ->to_string() == "[FUNCTION]" );
     
 //     CHECK( parse_str("((_fun(x) _fun(y) x * x + y * y)(2))(3)")
 //           ->interp(Env::emptyenv)->to_string() == "13" );
-//     CHECK( Step::interp_by_steps(parse_str("((_fun(x) _fun(y) x * x + y * y)(2))(3)"))
+//     CHECK( StepMachine().interp_by_steps(parse_str("((_fun(x) _fun(y) x * x + y * y)(2))(3)"))
 //           ->to_string() == "13" );
 
     
@@ -369,7 +537,7 @@ static PTR(Expr) parse_fun(std::istream &in) {
 //                      "                  _else x * factrl(factrl)(x + -1)"
 //                      "_in factrl(factrl)(5)")
 //           ->interp(Env::emptyenv)->to_string() == "120" );
-//     CHECK( Step::interp_by_steps(parse_str("_let factrl = _fun(factrl)"
+//     CHECK( StepMachine().interp_by_steps(parse_str("_let factrl = _fun(factrl)"
 //                                            "                _fun(x)"
 //                                            "                  _if x == 1"
 //                                            "                  _then 1"
@@ -386,7 +554,7 @@ static PTR(Expr) parse_fun(std::istream &in) {
 //                      "                 _else fib(fib)(x + -1)"
 //                      "                       + fib(fib)(x + -2)"
 //                      "_in fib(fib)(10)")->interp(Env::emptyenv)->to_string() == "89");
-//     CHECK( Step::interp_by_steps(parse_str("_let fib = _fun (fib)"
+//     CHECK( StepMachine().interp_by_steps(parse_str("_let fib = _fun (fib)"
 //                                            "              _fun (x)"
 //                                            "                 _if x == 0"
 //                                            "                 _then 1"
@@ -405,7 +573,7 @@ static PTR(Expr) parse_fun(std::istream &in) {
 //           ->interp(Env::emptyenv)
 //           ->to_string() == "0");
     
-//     CHECK(Step::interp_by_steps(parse_str("_let countdown = _fun(countdown)"
+//     CHECK(StepMachine().interp_by_steps(parse_str("_let countdown = _fun(countdown)"
 //                                           "  _fun(n)"
 //                                           "    _if n == 0"
 //                                           "    _then 0"
@@ -413,3 +581,92 @@ static PTR(Expr) parse_fun(std::istream &in) {
 //                                           "_in countdown(countdown)(2000000)") )
 //           ->to_string() == "0");
 // }
+
+#include "arena.hpp"
+#include "catch.hpp"
+
+TEST_CASE( "parse" ) {
+    ParseSession session;
+    CHECK( parse_str(" ( 5 + 1 ) ")->equals(MAKE(AddExpr)(MAKE(NumExpr)(5), MAKE(NumExpr)(1))) );
+    CHECK( parse_str("1+2*3")->equals(MAKE(AddExpr)(MAKE(NumExpr)(1),
+                                                    MAKE(MultExpr)(MAKE(NumExpr)(2), MAKE(NumExpr)(3)))) );
+    CHECK( parse_str("5+2+3")->equals(MAKE(AddExpr)(MAKE(NumExpr)(5),
+                                                    MAKE(AddExpr)(MAKE(NumExpr)(2), MAKE(NumExpr)(3)))) );
+    CHECK( parse_str("f(1)(2)")->equals(MAKE(CallFunExpr)(MAKE(CallFunExpr)(MAKE(VarExpr)("f"), MAKE(NumExpr)(1)),
+                                                          MAKE(NumExpr)(2))) );
+    CHECK( parse_str("_let x = - 3 _in x == _true")
+          ->equals(MAKE(LetExpr)("x", MAKE(NumExpr)(-3),
+                                 MAKE(CompExpr)(MAKE(VarExpr)("x"), MAKE(BoolExpr)(true)))) );
+    CHECK( parse_str("_if _false _then _fun (y) y _else 0")
+          ->equals(MAKE(IfExpr)(MAKE(BoolExpr)(false), MAKE(FunExpr)("y", MAKE(VarExpr)("y")),
+                                MAKE(NumExpr)(0))) );
+    
+    // Literals saturate rather than wrap
+    CHECK( parse_str("2147483647")->equals(MAKE(NumExpr)(2147483647)) );
+    CHECK( parse_str("99999999999")->equals(MAKE(NumExpr)(2147483647)) );
+    CHECK( parse_str("-2147483648")->equals(MAKE(NumExpr)(-2147483647)) );
+    
+    // A buffer that isn't NUL-terminated
+    const char text[] = { '1', '+', '2', '3' };
+    CHECK( parse(text, text + 3)->equals(MAKE(AddExpr)(MAKE(NumExpr)(1), MAKE(NumExpr)(2))) );
+    
+    // Neither long chains nor deep nesting use the C++ stack
+    std::string chain = "1", nested = "1";
+    for (int i = 0; i < 100000; i++) {
+        chain += " + 1";
+        nested = "(" + nested + ")";
+    }
+    CHECK( parse_str(chain) != nullptr );
+    CHECK( parse_str(nested)->equals(MAKE(NumExpr)(1)) );
+}
+
+TEST_CASE( "parse errors" ) {
+    ParseSession session;
+    CHECK( parse_str_error(" ( 1 ") == "expected a close parenthesis" );
+    CHECK( parse_str_error(" 1 )") == "expected end of file at )" );
+    CHECK( parse_str_error("?") == "expected a digit or open parenthesis at ?" );
+    CHECK( parse_str_error("_hello ") == "unexpected keyword _hello" );
+    CHECK( parse_str_error("1 = 2") == "expected == at =2" );
+    CHECK( parse_str_error("1 =") == (std::string)"expected a digit or open parenthesis at " + (char)EOF );
+    CHECK( parse_str_error("_let 1 = 2 _in 3") == "variable name error" );
+    CHECK( parse_str_error("_let x 1 _in 3") == "expected =, but found 1" );
+    CHECK( parse_str_error("_fun x x") == "expected ( after _fun, but foundx" );
+    CHECK( parse_str_error("_fun (1) x") == "formal_arg name error" );
+    CHECK( parse_str_error("_fun (x 1") == "expected ) after formal_arg, but found1" );
+    CHECK( parse_str_error("- x") == "expected a digit after -" );
+    
+    // Whatever stands in place of a keyword is reported the
+    // way the stream parser did
+    CHECK( parse_str_error("_let x = 1 x") == "expected _in, but found _" );
+    CHECK( parse_str_error("_let x = 1 xyz 2") == "expected _in, but found _yz" );
+    CHECK( parse_str_error("_let x = 1") == "expected _in, but found _" );
+    CHECK( parse_str_error("_if 1 _the 2") == "expected _then, but found _the" );
+    CHECK( parse_str_error("_if 1 _then 2 3") == "expected _else, but found_" );
+}
+
+TEST_CASE( "parse without recursion" ) {
+    ParseSession session;
+    // Each rule right-associative, at any length
+    CHECK( parse_str("1 == 2 == 3")->equals(MAKE(CompExpr)(MAKE(NumExpr)(1),
+                                                           MAKE(CompExpr)(MAKE(NumExpr)(2), MAKE(NumExpr)(3)))) );
+    CHECK( parse_str("1 * 2 + 3 * 4 == 5")
+          ->equals(MAKE(CompExpr)(MAKE(AddExpr)(MAKE(MultExpr)(MAKE(NumExpr)(1), MAKE(NumExpr)(2)),
+                                                MAKE(MultExpr)(MAKE(NumExpr)(3), MAKE(NumExpr)(4))),
+                                  MAKE(NumExpr)(5))) );
+    std::string product = "2";
+    for (int i = 0; i < 100000; i++)
+        product += " * 2";
+    PTR(Expr) e = parse_str(product);
+    CHECK( e->node_count == 200001 );
+    CHECK( CAST(MultExpr)(CAST(MultExpr)(e)->rhs) != nullptr );
+    
+    // Deeply nested bindings, tests and calls
+    std::string opening, closing;
+    for (int i = 0; i < 10000; i++) {
+        opening += "(_fun (x) _if _true _then (_let x = 1 _in ";
+        closing += ") _else 0)(2)";
+    }
+    e = parse_str(opening + "x" + closing);
+    CHECK( e->node_count == 1 + 10000 * (2 + 3 + 3) );
+    CHECK( CAST(CallFunExpr)(e) != nullptr );
+}
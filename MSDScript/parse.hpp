@@ -8,5 +8,9 @@ class Expr;
 
 PTR(Expr) parse(std::istream &in);
 
+// Parses the text from `start` up to `end`, which must
+// stay in place until parsing returns (e.g. an mmap'd file).
+PTR(Expr) parse(const char *start, const char *end);
+
 
 #endif /* parse_hpp */
@@ -0,0 +1,180 @@
+//
+//  passes.cpp
+//  ArithemticParser2
+//
+//  The optimizer's pipeline of rewrite passes.
+//
+
+#include <chrono>
+#include <sstream>
+#include <stdexcept>
+#include <stdio.h>
+#include "passes.hpp"
+#include "expr.hpp"
+#include "cse.hpp"
+
+PassStats::PassStats(std::string name) {
+    this->name = name;
+    this->runs = 0;
+    this->changed = 0;
+    this->rejected = 0;
+    this->nodes_in = 0;
+    this->nodes_out = 0;
+    this->seconds = 0;
+}
+
+// Folds constants, branches and `_let`s, drops dead
+// bindings, but keeps every call
+static PTR(Expr) fold_pass(PTR(Expr) e, int &fuel) {
+    int no_fuel = 0;
+    return simplify(e, no_fuel);
+}
+
+// The same, also inlining calls of known functions
+static PTR(Expr) inline_pass(PTR(Expr) e, int &fuel) {
+    return simplify(e, fuel);
+}
+
+static PTR(Expr) cse_pass(PTR(Expr) e, int &fuel) {
+    return cse(e);
+}
+
+static PassManager::pass_t find_pass(const std::string &name) {
+    if (name == "fold")
+        return fold_pass;
+    if (name == "inline")
+        return inline_pass;
+    if (name == "cse")
+        return cse_pass;
+    throw std::runtime_error("unknown pass: " + name);
+}
+
+PassManager::PassManager() {
+    max_rounds = 4;
+    rounds = 0;
+    node_budget = 0;
+    fuel = 1000;
+    use("fold,inline,cse");
+}
+
+void PassManager::use(std::string names) {
+    passes.clear();
+    stats.clear();
+    std::stringstream in(names);
+    std::string name;
+    while (std::getline(in, name, ',')) {
+        if (name.empty())
+            continue;
+        passes.push_back(std::make_pair(name, find_pass(name)));
+        stats.push_back(PassStats(name));
+    }
+}
+
+/* A round that comes back to the program it started from
+ ends the loop, even if passes changed it on the way, as
+ when `fold` inlines a `_fun` that `cse` then binds again. */
+PTR(Expr) PassManager::run(PTR(Expr) e) {
+    size_t budget = node_budget;
+    if (budget == 0)
+        budget = 2 * e->node_count + 1000;
+    rounds = 0;
+    while (rounds < max_rounds) {
+        PTR(Expr) start = e;
+        rounds++;
+        for (size_t i = 0; i < passes.size(); i++) {
+            PassStats &s = stats[i];
+            std::chrono::steady_clock::time_point before = std::chrono::steady_clock::now();
+            PTR(Expr) result = passes[i].second(e, fuel);
+            std::chrono::steady_clock::time_point after = std::chrono::steady_clock::now();
+            s.runs++;
+            s.seconds += std::chrono::duration<double>(after - before).count();
+            s.nodes_in += e->node_count;
+            if (result->node_count > budget && result->node_count > e->node_count) {
+                s.rejected++;
+                s.nodes_out += e->node_count;
+                continue;
+            }
+            s.nodes_out += result->node_count;
+            if (!result->equals(e))
+                s.changed++;
+            e = result;
+        }
+        if (e->equals(start))
+            break;
+    }
+    return e;
+}
+
+std::string PassManager::report() {
+    std::stringstream out;
+    char line[128];
+    snprintf(line, sizeof(line), "%-8s %5s %8s %9s %12s %12s %10s\n",
+             "pass", "runs", "changed", "rejected", "nodes in", "nodes out", "ms");
+    out << line;
+    for (size_t i = 0; i < stats.size(); i++) {
+        const PassStats &s = stats[i];
+        snprintf(line, sizeof(line), "%-8s %5d %8d %9d %12zu %12zu %10.2f\n",
+                 s.name.c_str(), s.runs, s.changed, s.rejected,
+                 s.nodes_in, s.nodes_out, s.seconds * 1000);
+        out << line;
+    }
+    out << rounds << (rounds == 1 ? " round\n" : " rounds\n");
+    return out.str();
+}
+
+PTR(Expr) optimize(PTR(Expr) e, int fuel) {
+    PassManager manager;
+    manager.fuel = fuel;
+    return manager.run(e);
+}
+
+/* for tests */
+#include "parse.hpp"
+#include "arena.hpp"
+#include "catch.hpp"
+
+static PTR(Expr) parsed(std::string program) {
+    std::stringstream input(program);
+    return parse(input);
+}
+
+TEST_CASE( "pass manager" ) {
+    ParseSession session;
+    PTR(Expr) program = parsed("(x + 1) * (x + 1) + (2 + 3)");
+    PassManager manager;
+    CHECK( manager.run(program)->to_string() == "((_let csea = (x + 1) _in (csea * csea)) + 5)" );
+    // The second round changes nothing
+    CHECK( manager.rounds == 2 );
+    REQUIRE( manager.stats.size() == 3 );
+    CHECK( manager.stats[0].name == "fold" );
+    CHECK( manager.stats[0].runs == 2 );
+    CHECK( manager.stats[0].changed == 1 );
+    CHECK( manager.stats[1].changed == 0 );
+    CHECK( manager.stats[2].changed == 1 );
+    // 11 nodes, then 9 after the first round
+    CHECK( manager.stats[0].nodes_in == 11 + 9 );
+    std::string report = manager.report();
+    CHECK( report.find("fold") != std::string::npos );
+    CHECK( report.substr(report.size() - 9) == "2 rounds\n" );
+    
+    PassManager only_cse;
+    only_cse.use("cse");
+    CHECK( only_cse.run(program)->to_string() == "((_let csea = (x + 1) _in (csea * csea)) + (2 + 3))" );
+    CHECK_THROWS_WITH( only_cse.use("fold,unroll"), "unknown pass: unroll" );
+    
+    // A pass that grows the program past the budget is undone
+    PTR(Expr) self = parsed("_let f = _fun (f) _fun (n) f(f)(n) _in f(f)(1)");
+    PassManager tight;
+    tight.node_budget = self->node_count + 1;
+    CHECK( tight.run(self)->equals(self) );
+    CHECK( tight.stats[0].rejected == 1 );
+    CHECK( tight.stats[0].changed == 0 );
+    
+    PassManager one_round;
+    one_round.max_rounds = 1;
+    one_round.run(program);
+    CHECK( one_round.rounds == 1 );
+    
+    // Calls that never end are only inlined until the fuel runs out
+    CHECK( optimize(parsed("_let loop = _fun (f) _fun (n) f(f)(n + 1) _in loop(loop)(0)"), 50) != nullptr );
+}
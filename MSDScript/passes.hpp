@@ -0,0 +1,68 @@
+//
+//  passes.hpp
+//  ArithemticParser2
+//
+//  The optimizer's pipeline of rewrite passes.
+//
+
+#ifndef passes_hpp
+#define passes_hpp
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include "pointer.hpp"
+
+class Expr;
+
+// What one pass has done so far
+class PassStats {
+public:
+    std::string name;
+    int runs;
+    int changed;
+    int rejected;
+    size_t nodes_in;
+    size_t nodes_out;
+    double seconds;
+
+    PassStats(std::string name);
+};
+
+/* Runs a list of passes over a program, over and over,
+ until a round leaves it unchanged or `max_rounds` rounds
+ have run. A pass whose result has more than `node_budget`
+ nodes is undone for that round. */
+class PassManager {
+public:
+    typedef PTR(Expr) (*pass_t)(PTR(Expr) e, int &fuel);
+
+    std::vector<std::pair<std::string, pass_t> > passes;
+    std::vector<PassStats> stats;
+    int max_rounds;
+    int rounds;
+    // 0 for twice the size of the input, plus 1000
+    size_t node_budget;
+    // Inlining left for the passes that inline
+    int fuel;
+
+    // The default pipeline: fold, inline, cse
+    PassManager();
+
+    // Replaces the pipeline with the passes named in the
+    // comma-separated `names`
+    void use(std::string names);
+
+    PTR(Expr) run(PTR(Expr) e);
+
+    // A table of `stats`, one line per pass
+    std::string report();
+};
+
+/* Optimize a whole program, as `--opt` does, with the
+ default pipeline. Calls of known functions are inlined at
+ most `fuel` times in all, so even a program that calls
+ itself forever is optimized in bounded time. */
+PTR(Expr) optimize(PTR(Expr) e, int fuel = 1000);
+
+#endif /* passes_hpp */
@@ -0,0 +1,182 @@
+//
+//  pool.cpp
+//  ArithemticParser2
+//
+//  A work-stealing thread pool.
+//
+
+#include "pool.hpp"
+
+// Index of the worker running on this thread, or -1
+static thread_local int current_worker = -1;
+static thread_local WorkPool *current_pool = nullptr;
+
+//WorkDeque
+void WorkDeque::push(task_t task) {
+    std::lock_guard<std::mutex> hold(lock);
+    tasks.push_back(std::move(task));
+}
+
+void WorkDeque::push_front(task_t task) {
+    std::lock_guard<std::mutex> hold(lock);
+    tasks.push_front(std::move(task));
+}
+
+bool WorkDeque::pop(task_t &task) {
+    std::lock_guard<std::mutex> hold(lock);
+    if (tasks.empty())
+        return false;
+    task = std::move(tasks.back());
+    tasks.pop_back();
+    return true;
+}
+
+bool WorkDeque::steal(task_t &task) {
+    std::lock_guard<std::mutex> hold(lock);
+    if (tasks.empty())
+        return false;
+    task = std::move(tasks.front());
+    tasks.pop_front();
+    return true;
+}
+
+//WorkPool
+WorkPool::WorkPool(int workers) {
+    if (workers < 1)
+        workers = 1;
+    queued = 0;
+    unfinished = 0;
+    stopping = false;
+    next_deque = 0;
+    for (int i = 0; i < workers; i++)
+        deques.push_back(new WorkDeque());
+    for (int i = 0; i < workers; i++)
+        threads.push_back(std::thread(&WorkPool::work, this, i));
+}
+
+WorkPool::~WorkPool() {
+    {
+        std::lock_guard<std::mutex> hold(sleep_lock);
+        stopping = true;
+    }
+    work_available.notify_all();
+    for (size_t i = 0; i < threads.size(); i++)
+        threads[i].join();
+    for (size_t i = 0; i < deques.size(); i++)
+        delete deques[i];
+}
+
+int WorkPool::size() {
+    return (int)deques.size();
+}
+
+void WorkPool::submit(task_t task) {
+    enqueue(std::move(task), false);
+}
+
+void WorkPool::yield(task_t task) {
+    enqueue(std::move(task), true);
+}
+
+void WorkPool::enqueue(task_t task, bool at_front) {
+    size_t target;
+    if (current_pool == this)
+        target = current_worker;
+    else
+        target = next_deque++ % deques.size();
+    
+    // Count the task before it becomes visible, so a
+    // worker can't finish it before `unfinished` knows
+    unfinished++;
+    {
+        // Taking the lock keeps a worker from missing the
+        // wakeup between checking `queued` and sleeping
+        std::lock_guard<std::mutex> hold(sleep_lock);
+        queued++;
+    }
+    if (at_front && current_pool == this)
+        deques[target]->push_front(std::move(task));
+    else
+        deques[target]->push(std::move(task));
+    work_available.notify_one();
+}
+
+void WorkPool::wait() {
+    std::unique_lock<std::mutex> hold(sleep_lock);
+    all_done.wait(hold, [this]() { return unfinished == 0; });
+}
+
+bool WorkPool::find_task(int me, task_t &task) {
+    if (deques[me]->pop(task))
+        return true;
+    size_t n = deques.size();
+    for (size_t i = 1; i < n; i++) {
+        if (deques[(me + i) % n]->steal(task))
+            return true;
+    }
+    return false;
+}
+
+void WorkPool::work(int me) {
+    current_worker = me;
+    current_pool = this;
+    
+    while (1) {
+        task_t task;
+        if (find_task(me, task)) {
+            queued--;
+            task();
+            if (--unfinished == 0) {
+                std::lock_guard<std::mutex> hold(sleep_lock);
+                all_done.notify_all();
+            }
+            continue;
+        }
+        
+        std::unique_lock<std::mutex> hold(sleep_lock);
+        work_available.wait(hold, [this]() { return stopping || queued > 0; });
+        if (stopping && queued == 0)
+            return;
+    }
+}
+
+/* for tests */
+#include "catch.hpp"
+
+TEST_CASE( "work pool" ) {
+    WorkDeque deque;
+    int order = 0;
+    deque.push([&order]() { order = order * 10 + 1; });
+    deque.push([&order]() { order = order * 10 + 2; });
+    deque.push_front([&order]() { order = order * 10 + 3; });
+    task_t task;
+    // The owner takes the newest; thieves the oldest
+    REQUIRE( deque.pop(task) );
+    task();
+    REQUIRE( deque.steal(task) );
+    task();
+    REQUIRE( deque.pop(task) );
+    task();
+    CHECK( order == 231 );
+    CHECK( !deque.pop(task) );
+    CHECK( !deque.steal(task) );
+    
+    WorkPool pool(4);
+    CHECK( pool.size() == 4 );
+    std::atomic<int> done(0);
+    // Tasks that queue more, which idle workers steal
+    for (int i = 0; i < 100; i++) {
+        pool.submit([&pool, &done]() {
+            for (int j = 0; j < 10; j++)
+                pool.submit([&done]() { done++; });
+            done++;
+        });
+    }
+    pool.wait();
+    CHECK( done == 1100 );
+    
+    // The pool can be waited on again
+    pool.submit([&done]() { done++; });
+    pool.wait();
+    CHECK( done == 1101 );
+}
@@ -0,0 +1,77 @@
+//
+//  pool.hpp
+//  ArithemticParser2
+//
+//  A work-stealing thread pool.
+//
+
+#ifndef pool_hpp
+#define pool_hpp
+
+#include <stddef.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+typedef std::function<void()> task_t;
+
+/* One worker's tasks. The owner pushes and pops at the
+ back, so it works on what it queued most recently;
+ other workers steal from the front. */
+class WorkDeque {
+public:
+    void push(task_t task);
+    // For a task that should wait for everything queued
+    void push_front(task_t task);
+    bool pop(task_t &task);
+    bool steal(task_t &task);
+    
+private:
+    std::mutex lock;
+    std::deque<task_t> tasks;
+};
+
+/* A fixed set of worker threads, each with its own
+ `WorkDeque`. A worker that runs out of tasks steals
+ from the others before going to sleep. */
+class WorkPool {
+public:
+    WorkPool(int workers);
+    ~WorkPool();
+    
+    // Queue a task, which must not throw. From inside a task it goes to the running
+    // worker's own deque; otherwise the deques take turns.
+    void submit(task_t task);
+    
+    // Queue a task to run after everything the running
+    // worker already has queued, as for a task taking
+    // turns with the others; thieves take these first.
+    void yield(task_t task);
+    
+    // Wait until every submitted task has finished.
+    void wait();
+    
+    int size();
+    
+private:
+    std::vector<WorkDeque *> deques;
+    std::vector<std::thread> threads;
+    
+    std::mutex sleep_lock;
+    std::condition_variable work_available;
+    std::condition_variable all_done;
+    std::atomic<size_t> queued;     // tasks sitting in some deque
+    std::atomic<size_t> unfinished; // tasks submitted but not finished
+    bool stopping;
+    std::atomic<size_t> next_deque;
+    
+    void work(int me);
+    void enqueue(task_t task, bool at_front);
+    bool find_task(int me, task_t &task);
+};
+
+#endif /* pool_hpp */
@@ -0,0 +1,94 @@
+//
+//  resolve.cpp
+//  ArithemticParser2
+//
+//  Lexical address resolution.
+//
+
+#include <sstream>
+#include "resolve.hpp"
+#include "expr.hpp"
+#include "parse.hpp"
+#include "arena.hpp"
+#include "catch.hpp"
+
+Scope::Scope(Scope *parent) {
+    this->parent = parent;
+    this->level = parent == nullptr ? 0 : parent->level + 1;
+    this->size = 0;
+    this->in_scope = parent == nullptr ? nullptr : parent->in_scope;
+}
+
+int Scope::bind(std::string name) {
+    in_scope = std::make_shared<const Binding>(name, level, size, in_scope);
+    return size++;
+}
+
+void Scope::unbind() {
+    in_scope = in_scope->next;
+}
+
+bool Scope::lookup(std::string name, int &depth, int &slot) {
+    for (const Binding *b = in_scope.get(); b != nullptr; b = b->next.get()) {
+        if (b->name == name) {
+            depth = level - b->level;
+            slot = b->slot;
+            return true;
+        }
+    }
+    return false;
+}
+
+PTR(Expr) resolve(PTR(Expr) e) {
+    return e->resolve(nullptr);
+}
+
+/* for tests */
+static PTR(Expr) resolve_str(std::string program) {
+    std::stringstream input(program);
+    return resolve(parse(input));
+}
+
+TEST_CASE( "resolve" ) {
+    ParseSession session;
+    
+    // The outermost `_let` opens a frame that the inner one shares
+    PTR(LetExpr) outer = CAST(LetExpr)(resolve_str("_let x = 1 _in _let y = 2 _in x + y"));
+    REQUIRE( outer != nullptr );
+    CHECK( outer->slot == 0 );
+    CHECK( outer->frame_size == 2 );
+    PTR(LetExpr) inner = CAST(LetExpr)(outer->expr);
+    REQUIRE( inner != nullptr );
+    CHECK( inner->slot == 1 );
+    CHECK( inner->frame_size == 0 );
+    
+    // A function's frame has the argument in slot 0; outer
+    // variables are a frame further out
+    PTR(LetExpr) let = CAST(LetExpr)(resolve_str("_let x = 1 _in _fun (y) _let z = y _in x"));
+    REQUIRE( let != nullptr );
+    PTR(FunExpr) fun = CAST(FunExpr)(let->expr);
+    REQUIRE( fun != nullptr );
+    CHECK( fun->frame_size == 2 );
+    CHECK( fun->level == 0 );
+    REQUIRE( fun->in_scope != nullptr );
+    CHECK( fun->in_scope->name == "x" );
+    CHECK( fun->in_scope->next == nullptr );
+    PTR(LetExpr) body = CAST(LetExpr)(fun->body);
+    REQUIRE( body != nullptr );
+    CHECK( body->slot == 1 );
+    PTR(VarExpr) x = CAST(VarExpr)(body->expr);
+    REQUIRE( x != nullptr );
+    CHECK( x->depth == 1 );
+    CHECK( x->slot == 0 );
+    
+    // Shadowing finds the innermost binding
+    PTR(FunExpr) shadow = CAST(FunExpr)(resolve_str("_fun (x) _let x = x + 1 _in x"));
+    REQUIRE( shadow != nullptr );
+    PTR(VarExpr) shadowed = CAST(VarExpr)(CAST(LetExpr)(shadow->body)->expr);
+    REQUIRE( shadowed != nullptr );
+    CHECK( shadowed->depth == 0 );
+    CHECK( shadowed->slot == 1 );
+    
+    CHECK_THROWS_WITH( resolve_str("_let x = 1 _in y"), "free variable: y" );
+    CHECK_THROWS_WITH( resolve_str("_let x = x _in x"), "free variable: x" );
+}
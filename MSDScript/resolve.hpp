@@ -0,0 +1,43 @@
+//
+//  resolve.hpp
+//  ArithemticParser2
+//
+//  Lexical address resolution.
+//
+
+#ifndef resolve_hpp
+#define resolve_hpp
+
+#include <string>
+#include "pointer.hpp"
+#include "value.hpp"
+
+class Expr;
+
+/* The compile-time picture of one runtime frame (see
+ `FrameEnv`): how many slots it has so far, and the names
+ currently in scope, in it and in the frames outside it. */
+class Scope {
+public:
+    Scope *parent;
+    // Frames outside this one
+    int level;
+    int size;
+    Bindings in_scope;
+    
+    Scope(Scope *parent);
+    
+    // Give `name` a fresh slot until the matching `unbind`.
+    // Slots are never reused, since closures keep the frame.
+    int bind(std::string name);
+    void unbind();
+    
+    bool lookup(std::string name, int &depth, int &slot);
+};
+
+// Rewrite every variable of a parsed expression into a
+// (depth, slot) address, which `interp` and `step_interp`
+// require. Throws `runtime_error` for free variables.
+PTR(Expr) resolve(PTR(Expr) e);
+
+#endif /* resolve_hpp */
@@ -0,0 +1,145 @@
+//
+//  scheduler.cpp
+//  ArithemticParser2
+//
+//  Many step-mode evaluations sharing a few threads.
+//
+
+#include <sstream>
+#include <stdexcept>
+#include "scheduler.hpp"
+#include "arena.hpp"
+#include "expr.hpp"
+#include "parse.hpp"
+#include "resolve.hpp"
+#include "step.hpp"
+
+//GreenThread
+GreenThread::GreenThread(const std::string &program) {
+    this->program = program;
+    arena = nullptr;
+    machine = nullptr;
+}
+
+GreenThread::~GreenThread() {
+    delete machine;
+    delete arena;
+}
+
+void GreenThread::start() {
+    arena = new Arena();
+    machine = new StepMachine();
+    Arena *saved = Arena::current;
+    Arena::current = arena;
+    try {
+        std::stringstream input(program);
+        machine->start(resolve(parse(input)));
+    } catch (...) {
+        Arena::current = saved;
+        throw;
+    }
+    Arena::current = saved;
+    program.clear();
+}
+
+// The machine's values refer to the tree, so it goes first
+void GreenThread::finish(std::string result) {
+    this->result = result;
+    program.clear();
+    delete machine;
+    machine = nullptr;
+    delete arena;
+    arena = nullptr;
+}
+
+//StepScheduler
+StepScheduler::StepScheduler(int workers, size_t quantum)
+    : pool(workers) {
+    this->quantum = quantum > 0 ? quantum : 1;
+    step_limit = 0;
+    turns = 0;
+}
+
+// Waits for the programs first, since the workers may
+// still be running them
+StepScheduler::~StepScheduler() {
+    pool.wait();
+    for (size_t i = 0; i < threads.size(); i++)
+        delete threads[i];
+}
+
+size_t StepScheduler::spawn(const std::string &program) {
+    GreenThread *t = new GreenThread(program);
+    size_t id = threads.size();
+    threads.push_back(t);
+    pool.submit([this, t]() { take_turn(t); });
+    return id;
+}
+
+void StepScheduler::wait() {
+    pool.wait();
+}
+
+std::string StepScheduler::result(size_t id) {
+    return threads[id]->result;
+}
+
+void StepScheduler::take_turn(GreenThread *t) {
+    turns++;
+    try {
+        if (t->machine == nullptr)
+            t->start();
+        if (t->machine->run(quantum)) {
+            t->finish(t->machine->val.to_string());
+        } else if (step_limit != 0 && t->machine->steps >= step_limit) {
+            t->finish("error: step limit exceeded");
+        } else {
+            pool.yield([this, t]() { take_turn(t); });
+        }
+    } catch (std::exception &e) {
+        t->finish(std::string("error: ") + e.what());
+    }
+}
+
+/* for tests */
+#include "catch.hpp"
+
+static std::string countdown(int n, int result) {
+    return "_let loop = _fun (f) _fun (n) _if n == 0 _then " + std::to_string(result)
+        + " _else f(f)(n + -1) _in loop(loop)(" + std::to_string(n) + ")";
+}
+
+TEST_CASE( "step scheduler" ) {
+    StepScheduler scheduler(3, 100);
+    std::vector<size_t> ids;
+    for (int i = 0; i < 50; i++)
+        ids.push_back(scheduler.spawn(countdown((i % 5) * 200, i)));
+    size_t bad = scheduler.spawn("1 + _true");
+    size_t unparsed = scheduler.spawn("1 +");
+    size_t quick = scheduler.spawn("2 * 3");
+    scheduler.wait();
+    for (size_t i = 0; i < ids.size(); i++)
+        CHECK( scheduler.result(ids[i]) == std::to_string(i) );
+    CHECK( scheduler.result(bad) == "error: This is not a number" );
+    CHECK( scheduler.result(unparsed).compare(0, 7, "error: ") == 0 );
+    CHECK( scheduler.result(quick) == "6" );
+    // The longer programs took more than one turn
+    CHECK( scheduler.turns > ids.size() + 3 );
+    
+    // Programs spawned later wait for no one
+    size_t later = scheduler.spawn(countdown(10, 7));
+    scheduler.wait();
+    CHECK( scheduler.result(later) == "7" );
+}
+
+TEST_CASE( "step scheduler limit" ) {
+    StepScheduler scheduler(2, 50);
+    scheduler.step_limit = 1000;
+    size_t forever = scheduler.spawn("_let f = _fun (f) f(f) _in f(f)");
+    size_t short_one = scheduler.spawn(countdown(10, 1));
+    scheduler.wait();
+    CHECK( scheduler.result(forever) == "error: step limit exceeded" );
+    CHECK( scheduler.result(short_one) == "1" );
+    // Stopped at the first turn past the limit
+    CHECK( scheduler.turns <= 1000 / 50 + 2 );
+}
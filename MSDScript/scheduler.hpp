@@ -0,0 +1,78 @@
+//
+//  scheduler.hpp
+//  ArithemticParser2
+//
+//  Many step-mode evaluations sharing a few threads.
+//
+
+#ifndef scheduler_hpp
+#define scheduler_hpp
+
+#include <stddef.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include "pool.hpp"
+
+class Arena;
+class StepMachine;
+
+/* One evaluation between turns. Until its first turn it
+ is only the program's text; it then holds the program's
+ tree and the machine stepping through it, which are both
+ dropped as soon as it finishes, leaving only `result`. */
+class GreenThread {
+public:
+    std::string program;
+    Arena *arena;
+    StepMachine *machine;
+    // The value, or "error: " and the message
+    std::string result;
+
+    GreenThread(const std::string &program);
+    ~GreenThread();
+    // Parse the program and get the machine ready
+    void start();
+    void finish(std::string result);
+};
+
+/* Runs programs in step mode as green threads on a
+ `WorkPool`. Each turn is at most `quantum` steps; a
+ program that is not done goes to the back of its worker's
+ queue, behind the programs queued since, and idle workers
+ steal from there. Short programs thus finish in their
+ first turns however many long ones are running. */
+class StepScheduler {
+public:
+    StepScheduler(int workers, size_t quantum = 10000);
+    ~StepScheduler();
+
+    // A program still running after this many steps fails;
+    // 0 for no limit
+    size_t step_limit;
+
+    // Turns taken by all programs so far
+    std::atomic<size_t> turns;
+
+    /* Queue `program`, returning its index for `result`.
+     It is parsed on its first turn, and parse errors
+     become its result. Only one thread may spawn at a
+     time. */
+    size_t spawn(const std::string &program);
+
+    // Wait until every spawned program has finished
+    void wait();
+
+    // The result of a finished program
+    std::string result(size_t id);
+
+private:
+    std::vector<GreenThread *> threads;
+    size_t quantum;
+    // Last, so its workers stop before the rest goes
+    WorkPool pool;
+
+    void take_turn(GreenThread *t);
+};
+
+#endif /* scheduler_hpp */
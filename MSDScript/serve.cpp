@@ -0,0 +1,239 @@
+//
+//  serve.cpp
+//  ArithemticParser2
+//
+//  Evaluating a stream of programs in one process.
+//
+
+#include "serve.hpp"
+#include "pool.hpp"
+#include "scheduler.hpp"
+#include <stdexcept>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static std::string evaluate(engine_t engine, const std::string &program) {
+    std::stringstream input(program);
+    try {
+        return engine(input);
+    } catch (std::exception &e) {
+        return std::string("error: ") + e.what();
+    }
+}
+
+static bool write_all(int fd, const std::string &data) {
+    size_t done = 0;
+    while (done < data.size()) {
+        ssize_t n = write(fd, data.data() + done, data.size() - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        done += n;
+    }
+    return true;
+}
+
+static bool only_whitespace(const std::string &s) {
+    for (size_t i = 0; i < s.size(); i++) {
+        if (!isspace((unsigned char)s[i]))
+            return false;
+    }
+    return true;
+}
+
+void serve_stream(int in_fd, int out_fd, engine_t engine) {
+    std::string pending;
+    char buffer[65536];
+    
+    while (1) {
+        ssize_t n = read(in_fd, buffer, sizeof(buffer));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        pending.append(buffer, n);
+        
+        // Answer every complete program that has arrived, and
+        // send the answers together before waiting for more
+        std::string results;
+        size_t start = 0;
+        size_t end;
+        while ((end = pending.find('\0', start)) != std::string::npos) {
+            results += evaluate(engine, pending.substr(start, end - start));
+            results += '\0';
+            start = end + 1;
+        }
+        pending.erase(0, start);
+        if (!write_all(out_fd, results))
+            return;
+    }
+    
+    if (!only_whitespace(pending))
+        write_all(out_fd, evaluate(engine, pending) + '\0');
+}
+
+// Every program from `in_fd`, up to end of file
+static std::vector<std::string> read_programs(int in_fd) {
+    std::string input;
+    char buffer[65536];
+    while (1) {
+        ssize_t n = read(in_fd, buffer, sizeof(buffer));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        input.append(buffer, n);
+    }
+    
+    std::vector<std::string> programs;
+    size_t start = 0;
+    size_t end;
+    while ((end = input.find('\0', start)) != std::string::npos) {
+        programs.push_back(input.substr(start, end - start));
+        start = end + 1;
+    }
+    if (!only_whitespace(input.substr(start)))
+        programs.push_back(input.substr(start));
+    return programs;
+}
+
+static void write_results(int out_fd, const std::vector<std::string> &results) {
+    std::string output;
+    for (size_t i = 0; i < results.size(); i++) {
+        output += results[i];
+        output += '\0';
+    }
+    write_all(out_fd, output);
+}
+
+void serve_batch(int in_fd, int out_fd, engine_t engine, int jobs) {
+    std::vector<std::string> programs = read_programs(in_fd);
+    std::vector<std::string> results(programs.size());
+    {
+        WorkPool pool(jobs);
+        for (size_t i = 0; i < programs.size(); i++) {
+            pool.submit([i, engine, &programs, &results]() {
+                results[i] = evaluate(engine, programs[i]);
+            });
+        }
+        pool.wait();
+    }
+    write_results(out_fd, results);
+}
+
+void serve_green(int in_fd, int out_fd, int workers, size_t quantum, size_t step_limit) {
+    std::vector<std::string> programs = read_programs(in_fd);
+    std::vector<std::string> results(programs.size());
+    {
+        StepScheduler scheduler(workers, quantum);
+        scheduler.step_limit = step_limit;
+        for (size_t i = 0; i < programs.size(); i++)
+            scheduler.spawn(programs[i]);
+        scheduler.wait();
+        for (size_t i = 0; i < programs.size(); i++)
+            results[i] = scheduler.result(i);
+    }
+    write_results(out_fd, results);
+}
+
+void serve_socket(std::string path, engine_t engine) {
+    // A client hanging up shouldn't end the server
+    signal(SIGPIPE, SIG_IGN);
+    
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path))
+        throw std::runtime_error("socket path too long: " + path);
+    strcpy(addr.sun_path, path.c_str());
+    
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0)
+        throw std::runtime_error(std::string("socket: ") + strerror(errno));
+    unlink(path.c_str());
+    if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0
+        || listen(listener, SOMAXCONN) < 0)
+        throw std::runtime_error(path + ": " + strerror(errno));
+    
+    while (1) {
+        int fd = accept(listener, nullptr, nullptr);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            throw std::runtime_error(std::string("accept: ") + strerror(errno));
+        }
+        std::thread([fd, engine]() {
+            serve_stream(fd, fd, engine);
+            close(fd);
+        }).detach();
+    }
+}
+
+/* for tests */
+#include <functional>
+#include "API.hpp"
+#include "catch.hpp"
+
+// What `serve` writes given `input`, through a pair of pipes
+static std::string served(std::function<void(int, int)> serve, std::string input) {
+    int in[2], out[2];
+    REQUIRE( pipe(in) == 0 );
+    REQUIRE( pipe(out) == 0 );
+    // Small enough for the pipes to hold without a reader
+    REQUIRE( write_all(in[1], input) );
+    close(in[1]);
+    serve(in[0], out[1]);
+    close(in[0]);
+    close(out[1]);
+    std::string output;
+    char buffer[4096];
+    ssize_t n;
+    while ((n = read(out[0], buffer, sizeof(buffer))) > 0)
+        output.append(buffer, n);
+    close(out[0]);
+    return output;
+}
+
+// Text with NULs in it, which a plain `std::string` would stop at
+#define FRAMED(text) std::string(text, sizeof(text) - 1)
+
+static const std::string programs = FRAMED("1 + 2\0_true + 1\0(_fun (x) x * x)(7)\0  4 \n");
+static const std::string results = FRAMED("3\0error: Booleans could not add\0" "49\0" "4\0");
+
+TEST_CASE( "serve" ) {
+    CHECK( served([](int in, int out) { serve_stream(in, out, interp); }, programs) == results );
+    CHECK( served([](int in, int out) { serve_stream(in, out, vm_interp); }, programs) == results );
+    CHECK( served([](int in, int out) { serve_stream(in, out, step_interp); }, FRAMED("1 (\0 \n"))
+          == FRAMED("error: expected a digit or open parenthesis at \xff\0") );
+    CHECK( served([](int in, int out) { serve_stream(in, out, optimizer); }, FRAMED("x + 1 + 2\0"))
+          == FRAMED("(x + 3)\0") );
+}
+
+TEST_CASE( "serve batch" ) {
+    // Results in the order of the programs, however the
+    // workers finish them
+    std::string many, expected;
+    for (int i = 0; i < 200; i++) {
+        many += "_let loop = _fun (f) _fun (n) _if n == 0 _then " + std::to_string(i)
+            + " _else f(f)(n + -1) _in loop(loop)(" + std::to_string((i % 7) * 500) + ")";
+        many += '\0';
+        expected += std::to_string(i);
+        expected += '\0';
+    }
+    CHECK( served([](int in, int out) { serve_batch(in, out, interp, 4); }, many) == expected );
+    CHECK( served([](int in, int out) { serve_batch(in, out, step_interp, 3); }, programs) == results );
+    CHECK( served([](int in, int out) { serve_green(in, out, 3, 100, 0); }, many) == expected );
+    CHECK( served([](int in, int out) { serve_green(in, out, 2, 100, 0); }, programs) == results );
+    CHECK( served([](int in, int out) { serve_green(in, out, 2, 100, 1000); },
+                  FRAMED("_let f = _fun (f) f(f) _in f(f)\0" "5\0"))
+          == FRAMED("error: step limit exceeded\0" "5\0") );
+}
@@ -0,0 +1,43 @@
+//
+//  serve.hpp
+//  ArithemticParser2
+//
+//  Evaluating a stream of programs in one process.
+//
+
+#ifndef serve_hpp
+#define serve_hpp
+
+#include <stddef.h>
+#include <string>
+#include <iostream>
+
+/* One of the entry points in API.hpp. */
+typedef std::string (*engine_t)(std::istream &input);
+
+/* Programs and results are framed the same way: each one
+ is followed by a NUL byte. Results come back in the order
+ the programs arrived, and a program that fails produces
+ "error: " followed by the message instead of a result.
+ A client may send any number of programs before reading. */
+
+// Serve programs from `in_fd` to `out_fd` until `in_fd`
+// reaches end of file. Text after the last NUL, if any
+// besides whitespace, counts as one more program.
+void serve_stream(int in_fd, int out_fd, engine_t engine);
+
+// Read every program from `in_fd`, evaluate them on `jobs`
+// worker threads, and write the results to `out_fd`.
+void serve_batch(int in_fd, int out_fd, engine_t engine, int jobs);
+
+// Like `serve_batch` in step mode, but with the programs
+// taking turns of `quantum` steps on `workers` threads
+// (see `StepScheduler`); one still running after
+// `step_limit` steps fails, unless that is 0.
+void serve_green(int in_fd, int out_fd, int workers, size_t quantum, size_t step_limit);
+
+// Listen on a Unix domain socket at `path` and serve each
+// connection on its own thread. Does not return.
+void serve_socket(std::string path, engine_t engine);
+
+#endif /* serve_hpp */
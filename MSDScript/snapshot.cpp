@@ -0,0 +1,1032 @@
+//
+//  snapshot.cpp
+//  ArithemticParser2
+//
+//  Saving and restoring a paused step machine.
+//
+
+#include <stdint.h>
+#include <algorithm>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "snapshot.hpp"
+#include "step.hpp"
+#include "cont.hpp"
+#include "env.hpp"
+#include "expr.hpp"
+#include "value.hpp"
+
+/* A snapshot is, in order:
+   - `magic`
+   - the bindings that `_fun`s and closures saw in scope
+     (see `Binding`), each a name, a level, a slot and the
+     one after it as an index into the bindings before it
+   - the expressions, children before parents, each a tag
+     and its fields, with children as indexes into the
+     expressions before it
+   - a tag for every heap object (and the slot count of a
+     frame), so all of them can be made before any is filled
+   - the fields of each object, in the same order
+   - the registers
+ Numbers are varints, signed ones zigzag-coded, and strings
+ a length and bytes. A reference to an object is 0 for
+ none, `empty_ref` or `done_ref` for the two shared ones,
+ and otherwise `first_ref` plus its index; a reference to
+ an expression or a binding is 0 for none, or 1 plus its
+ index. */
+
+static const char magic[] = "MSDSNAP2";
+static const size_t magic_size = 8;
+
+static const uint64_t empty_ref = 1;
+static const uint64_t done_ref = 2;
+static const uint64_t first_ref = 3;
+
+// Ceilings on sizes read back, so bad input can't ask
+// for unbounded memory
+static const uint64_t max_string = 1 << 20;
+static const uint64_t max_frame = 1 << 20;
+static const uint64_t max_depth = 1 << 16;
+
+typedef enum {
+    NUM_EXPR = 1,
+    ADD_EXPR,
+    MULT_EXPR,
+    VAR_EXPR,
+    BOOL_EXPR,
+    LET_EXPR,
+    IF_EXPR,
+    COMP_EXPR,
+    FUN_EXPR,
+    CALL_EXPR
+} expr_tag_t;
+
+typedef enum {
+    FRAME_ENV = 1,
+    FUN_VAL,
+    RIGHT_THEN_ADD_CONT,
+    ADD_CONT,
+    RIGHT_THEN_MULT_CONT,
+    MULT_CONT,
+    RIGHT_THEN_COMP_CONT,
+    COMP_CONT,
+    LET_CONT,
+    IF_CONT,
+    ARG_THEN_CALL_CONT,
+    CALL_CONT
+} object_tag_t;
+
+typedef enum {
+    NULL_VAL,
+    NUM_VAL,
+    BOOL_VAL,
+    FUN_VAL_REF
+} val_tag_t;
+
+static void bad_snapshot() {
+    throw std::runtime_error("not a snapshot, or a damaged one");
+}
+
+static void put_uint(std::ostream &out, uint64_t n) {
+    while (n >= 0x80) {
+        out.put((char)(n | 0x80));
+        n >>= 7;
+    }
+    out.put((char)n);
+}
+
+static void put_int(std::ostream &out, int64_t n) {
+    put_uint(out, ((uint64_t)n << 1) ^ (uint64_t)(n >> 63));
+}
+
+static void put_string(std::ostream &out, const std::string &s) {
+    put_uint(out, s.size());
+    out.write(s.data(), s.size());
+}
+
+static uint64_t get_uint(std::istream &in) {
+    uint64_t n = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int c = in.get();
+        if (c == EOF)
+            bad_snapshot();
+        n |= (uint64_t)(c & 0x7f) << shift;
+        if ((c & 0x80) == 0)
+            return n;
+    }
+    bad_snapshot();
+    return 0;
+}
+
+static int get_int(std::istream &in) {
+    uint64_t z = get_uint(in);
+    int64_t n = (int64_t)(z >> 1) ^ -(int64_t)(z & 1);
+    if (n < INT32_MIN || n > INT32_MAX)
+        bad_snapshot();
+    return (int)n;
+}
+
+static std::string get_string(std::istream &in) {
+    uint64_t size = get_uint(in);
+    if (size > max_string)
+        bad_snapshot();
+    std::string s(size, '\0');
+    in.read(&s[0], size);
+    if ((uint64_t)in.gcount() != size)
+        bad_snapshot();
+    return s;
+}
+
+/* What evaluating an expression asks of the environment it
+ runs in: `(*need)[d]` is the fewest slots the frame `d`
+ out must have, so each depth below `need->size()` must be
+ a `FrameEnv`. Shared, since a parent mostly asks just what
+ one of its children does. */
+typedef std::shared_ptr<const std::vector<int> > Need;
+
+static Need var_need(int depth, int slot) {
+    if (depth < 0 || (uint64_t)depth >= max_depth || slot < 0 || (uint64_t)slot >= max_frame)
+        bad_snapshot();
+    std::vector<int> need(depth + 1, 0);
+    need[depth] = slot + 1;
+    return std::make_shared<const std::vector<int> >(need);
+}
+
+static Need need_both(Need a, Need b) {
+    if (a->size() < b->size())
+        std::swap(a, b);
+    for (size_t d = 0; d < b->size(); d++) {
+        if ((*b)[d] > (*a)[d]) {
+            std::vector<int> both(*a);
+            for (; d < b->size(); d++)
+                both[d] = std::max(both[d], (*b)[d]);
+            return std::make_shared<const std::vector<int> >(both);
+        }
+    }
+    return a;
+}
+
+// `need`, and also `slot` set in the innermost frame
+static Need need_slot(Need need, int slot) {
+    return need_both(need, var_need(0, slot));
+}
+
+// What comparing a closure made at frame `level` asks of
+// its environment (see `FunVal::equals`)
+static Need bindings_need(const Bindings &in_scope, int level) {
+    if (level < 0)
+        bad_snapshot();
+    Need need = std::make_shared<const std::vector<int> >();
+    for (const Binding *b = in_scope.get(); b != nullptr; b = b->next.get())
+        need = need_both(need, var_need(level - b->level, b->slot));
+    return need;
+}
+
+// What `need` leaves for the frames outside one of
+// `frame_size` slots pushed in front of them
+static Need need_outside(Need need, int frame_size) {
+    if (frame_size < 1 || (uint64_t)frame_size > max_frame)
+        bad_snapshot();
+    if (need->empty())
+        return need;
+    if ((*need)[0] > frame_size)
+        bad_snapshot();
+    return std::make_shared<const std::vector<int> >(need->begin() + 1, need->end());
+}
+
+// The children of `e`, in the order they are written
+static void expr_children(PTR(Expr) e, std::vector<PTR(Expr)> &children) {
+    children.clear();
+    if (PTR(AddExpr) add = CAST(AddExpr)(e)) {
+        children.push_back(add->lhs);
+        children.push_back(add->rhs);
+    } else if (PTR(MultExpr) mult = CAST(MultExpr)(e)) {
+        children.push_back(mult->lhs);
+        children.push_back(mult->rhs);
+    } else if (PTR(CompExpr) comp = CAST(CompExpr)(e)) {
+        children.push_back(comp->lhs);
+        children.push_back(comp->rhs);
+    } else if (PTR(LetExpr) let = CAST(LetExpr)(e)) {
+        children.push_back(let->rhs);
+        children.push_back(let->expr);
+    } else if (PTR(IfExpr) if_expr = CAST(IfExpr)(e)) {
+        children.push_back(if_expr->if_part);
+        children.push_back(if_expr->then_part);
+        children.push_back(if_expr->else_part);
+    } else if (PTR(FunExpr) fun = CAST(FunExpr)(e)) {
+        children.push_back(fun->body);
+    } else if (PTR(CallFunExpr) call = CAST(CallFunExpr)(e)) {
+        children.push_back(call->to_be_called);
+        children.push_back(call->actual_arg);
+    }
+}
+
+/* Numbers objects as it first meets them and writes each
+ one's fields, which may meet more, until every object
+ reached from the registers is written; expressions are
+ numbered a whole tree at a time, children first. */
+class SnapshotWriter {
+public:
+    std::unordered_map<PTR(Collectable), uint64_t> object_ids;
+    std::vector<PTR(Collectable)> objects;
+    std::unordered_map<PTR(Expr), uint64_t> expr_ids;
+    std::vector<PTR(Expr)> exprs;
+    std::unordered_map<const Binding *, uint64_t> binding_ids;
+    std::vector<const Binding *> bindings;
+
+    void put_ref(std::ostream &out, PTR(Collectable) obj);
+    void put_expr(std::ostream &out, PTR(Expr) e);
+    void put_bindings(std::ostream &out, const Bindings &in_scope);
+    void put_val(std::ostream &out, Val val);
+    void put_fields(std::ostream &out, PTR(Collectable) obj);
+    void put_header(std::ostream &out, PTR(Collectable) obj);
+    void put_expr_fields(std::ostream &out, PTR(Expr) e);
+
+private:
+    void number(PTR(Expr) e);
+    uint64_t number_bindings(const Binding *first);
+};
+
+void SnapshotWriter::put_ref(std::ostream &out, PTR(Collectable) obj) {
+    if (obj == nullptr) {
+        put_uint(out, 0);
+    } else if (obj == Env::emptyenv) {
+        put_uint(out, empty_ref);
+    } else if (obj == Cont::done) {
+        put_uint(out, done_ref);
+    } else {
+        std::unordered_map<PTR(Collectable), uint64_t>::iterator found = object_ids.find(obj);
+        if (found == object_ids.end()) {
+            found = object_ids.insert(std::make_pair(obj, first_ref + objects.size())).first;
+            objects.push_back(obj);
+        }
+        put_uint(out, found->second);
+    }
+}
+
+void SnapshotWriter::number(PTR(Expr) root) {
+    std::vector<PTR(Expr)> pending;
+    std::vector<PTR(Expr)> children;
+    pending.push_back(root);
+    while (!pending.empty()) {
+        PTR(Expr) e = pending.back();
+        if (expr_ids.count(e) != 0) {
+            pending.pop_back();
+            continue;
+        }
+        expr_children(e, children);
+        bool ready = true;
+        for (size_t i = 0; i < children.size(); i++) {
+            if (expr_ids.count(children[i]) == 0) {
+                pending.push_back(children[i]);
+                ready = false;
+            }
+        }
+        if (ready) {
+            pending.pop_back();
+            expr_ids[e] = 1 + exprs.size();
+            exprs.push_back(e);
+            if (PTR(FunExpr) fun = CAST(FunExpr)(e))
+                number_bindings(fun->in_scope.get());
+        }
+    }
+}
+
+// Numbers `b` and those after it, the last first
+uint64_t SnapshotWriter::number_bindings(const Binding *first) {
+    std::vector<const Binding *> pending;
+    for (const Binding *b = first; b != nullptr && binding_ids.count(b) == 0; b = b->next.get())
+        pending.push_back(b);
+    while (!pending.empty()) {
+        binding_ids[pending.back()] = 1 + bindings.size();
+        bindings.push_back(pending.back());
+        pending.pop_back();
+    }
+    return first == nullptr ? 0 : binding_ids[first];
+}
+
+void SnapshotWriter::put_expr(std::ostream &out, PTR(Expr) e) {
+    if (e == nullptr) {
+        put_uint(out, 0);
+        return;
+    }
+    if (expr_ids.count(e) == 0)
+        number(e);
+    put_uint(out, expr_ids[e]);
+}
+
+void SnapshotWriter::put_bindings(std::ostream &out, const Bindings &in_scope) {
+    put_uint(out, number_bindings(in_scope.get()));
+}
+
+void SnapshotWriter::put_val(std::ostream &out, Val val) {
+    if (val.is_num()) {
+        out.put(NUM_VAL);
+        put_int(out, val.num_rep());
+    } else if (val.is_bool()) {
+        out.put(BOOL_VAL);
+        out.put(val.bool_rep());
+    } else if (val.is_fun()) {
+        out.put(FUN_VAL_REF);
+        put_ref(out, val.fun());
+    } else {
+        out.put(NULL_VAL);
+    }
+}
+
+void SnapshotWriter::put_header(std::ostream &out, PTR(Collectable) obj) {
+    if (PTR(FrameEnv) frame = CAST(FrameEnv)(obj)) {
+        out.put(FRAME_ENV);
+        put_uint(out, frame->slots.size());
+    } else if (CAST(FunVal)(obj) != nullptr) {
+        out.put(FUN_VAL);
+    } else if (CAST(RightThenAddCont)(obj) != nullptr) {
+        out.put(RIGHT_THEN_ADD_CONT);
+    } else if (CAST(AddCont)(obj) != nullptr) {
+        out.put(ADD_CONT);
+    } else if (CAST(RightThenMultCont)(obj) != nullptr) {
+        out.put(RIGHT_THEN_MULT_CONT);
+    } else if (CAST(MultCont)(obj) != nullptr) {
+        out.put(MULT_CONT);
+    } else if (CAST(RightThenCompCont)(obj) != nullptr) {
+        out.put(RIGHT_THEN_COMP_CONT);
+    } else if (CAST(CompCont)(obj) != nullptr) {
+        out.put(COMP_CONT);
+    } else if (CAST(LetCont)(obj) != nullptr) {
+        out.put(LET_CONT);
+    } else if (CAST(IfCont)(obj) != nullptr) {
+        out.put(IF_CONT);
+    } else if (CAST(ArgThenCallCont)(obj) != nullptr) {
+        out.put(ARG_THEN_CALL_CONT);
+    } else if (CAST(CallCont)(obj) != nullptr) {
+        out.put(CALL_CONT);
+    } else {
+        throw std::runtime_error("can't save this machine");
+    }
+}
+
+void SnapshotWriter::put_fields(std::ostream &out, PTR(Collectable) obj) {
+    if (PTR(FrameEnv) frame = CAST(FrameEnv)(obj)) {
+        for (size_t i = 0; i < frame->slots.size(); i++)
+            put_val(out, frame->slots[i]);
+        put_ref(out, frame->rest);
+    } else if (PTR(FunVal) fun = CAST(FunVal)(obj)) {
+        put_string(out, fun->formal_arg);
+        put_expr(out, fun->body);
+        put_ref(out, fun->env);
+        put_int(out, fun->frame_size);
+        put_bindings(out, fun->in_scope);
+        put_int(out, fun->level);
+    } else if (PTR(RightThenAddCont) k = CAST(RightThenAddCont)(obj)) {
+        put_expr(out, k->rhs);
+        put_ref(out, k->env);
+        put_ref(out, k->rest);
+    } else if (PTR(AddCont) k = CAST(AddCont)(obj)) {
+        put_val(out, k->lhs_val);
+        put_ref(out, k->rest);
+    } else if (PTR(RightThenMultCont) k = CAST(RightThenMultCont)(obj)) {
+        put_expr(out, k->rhs);
+        put_ref(out, k->env);
+        put_ref(out, k->rest);
+    } else if (PTR(MultCont) k = CAST(MultCont)(obj)) {
+        put_val(out, k->lhs_val);
+        put_ref(out, k->rest);
+    } else if (PTR(RightThenCompCont) k = CAST(RightThenCompCont)(obj)) {
+        put_expr(out, k->rhs);
+        put_ref(out, k->env);
+        put_ref(out, k->rest);
+    } else if (PTR(CompCont) k = CAST(CompCont)(obj)) {
+        put_val(out, k->lhs_val);
+        put_ref(out, k->rest);
+    } else if (PTR(LetCont) k = CAST(LetCont)(obj)) {
+        put_int(out, k->slot);
+        put_expr(out, k->body);
+        put_ref(out, k->env);
+        put_ref(out, k->rest);
+    } else if (PTR(IfCont) k = CAST(IfCont)(obj)) {
+        put_expr(out, k->then_part);
+        put_expr(out, k->else_part);
+        put_ref(out, k->env);
+        put_ref(out, k->rest);
+    } else if (PTR(ArgThenCallCont) k = CAST(ArgThenCallCont)(obj)) {
+        put_expr(out, k->actual_arg);
+        put_ref(out, k->env);
+        put_ref(out, k->rest);
+    } else if (PTR(CallCont) k = CAST(CallCont)(obj)) {
+        put_val(out, k->to_be_called);
+        put_ref(out, k->rest);
+    }
+}
+
+// Children are already numbered, since `number` puts them first
+void SnapshotWriter::put_expr_fields(std::ostream &out, PTR(Expr) e) {
+    if (PTR(NumExpr) num = CAST(NumExpr)(e)) {
+        out.put(NUM_EXPR);
+        put_int(out, num->rep);
+    } else if (PTR(AddExpr) add = CAST(AddExpr)(e)) {
+        out.put(ADD_EXPR);
+        put_uint(out, expr_ids[add->lhs]);
+        put_uint(out, expr_ids[add->rhs]);
+    } else if (PTR(MultExpr) mult = CAST(MultExpr)(e)) {
+        out.put(MULT_EXPR);
+        put_uint(out, expr_ids[mult->lhs]);
+        put_uint(out, expr_ids[mult->rhs]);
+    } else if (PTR(VarExpr) var = CAST(VarExpr)(e)) {
+        out.put(VAR_EXPR);
+        put_string(out, var->name);
+        put_int(out, var->depth);
+        put_int(out, var->slot);
+    } else if (PTR(BoolExpr) boolean = CAST(BoolExpr)(e)) {
+        out.put(BOOL_EXPR);
+        out.put(boolean->rep);
+    } else if (PTR(LetExpr) let = CAST(LetExpr)(e)) {
+        out.put(LET_EXPR);
+        put_string(out, let->var_name);
+        put_uint(out, expr_ids[let->rhs]);
+        put_uint(out, expr_ids[let->expr]);
+        put_int(out, let->slot);
+        put_int(out, let->frame_size);
+    } else if (PTR(IfExpr) if_expr = CAST(IfExpr)(e)) {
+        out.put(IF_EXPR);
+        put_uint(out, expr_ids[if_expr->if_part]);
+        put_uint(out, expr_ids[if_expr->then_part]);
+        put_uint(out, expr_ids[if_expr->else_part]);
+    } else if (PTR(CompExpr) comp = CAST(CompExpr)(e)) {
+        out.put(COMP_EXPR);
+        put_uint(out, expr_ids[comp->lhs]);
+        put_uint(out, expr_ids[comp->rhs]);
+    } else if (PTR(FunExpr) fun = CAST(FunExpr)(e)) {
+        out.put(FUN_EXPR);
+        put_string(out, fun->formal_arg);
+        put_uint(out, expr_ids[fun->body]);
+        put_int(out, fun->frame_size);
+        put_bindings(out, fun->in_scope);
+        put_int(out, fun->level);
+    } else if (PTR(CallFunExpr) call = CAST(CallFunExpr)(e)) {
+        out.put(CALL_EXPR);
+        put_uint(out, expr_ids[call->to_be_called]);
+        put_uint(out, expr_ids[call->actual_arg]);
+    } else {
+        throw std::runtime_error("can't save this machine");
+    }
+}
+
+void save_snapshot(StepMachine &machine, std::ostream &out) {
+    SnapshotWriter writer;
+
+    // Writing the fields is what finds the objects and
+    // expressions, so they go to the side until the
+    // tables in front of them are known
+    std::stringstream registers;
+    registers.put(machine.mode == StepMachine::interp_mode ? 0 : 1);
+    writer.put_expr(registers, machine.mode == StepMachine::interp_mode ? machine.expr : nullptr);
+    writer.put_ref(registers, machine.env);
+    writer.put_val(registers, machine.val);
+    writer.put_ref(registers, machine.cont);
+    put_uint(registers, machine.steps);
+
+    std::stringstream fields;
+    for (size_t i = 0; i < writer.objects.size(); i++)
+        writer.put_fields(fields, writer.objects[i]);
+
+    out.write(magic, magic_size);
+    put_uint(out, writer.bindings.size());
+    for (size_t i = 0; i < writer.bindings.size(); i++) {
+        const Binding *b = writer.bindings[i];
+        put_string(out, b->name);
+        put_int(out, b->level);
+        put_int(out, b->slot);
+        writer.put_bindings(out, b->next);
+    }
+    put_uint(out, writer.exprs.size());
+    for (size_t i = 0; i < writer.exprs.size(); i++)
+        writer.put_expr_fields(out, writer.exprs[i]);
+    put_uint(out, writer.objects.size());
+    for (size_t i = 0; i < writer.objects.size(); i++)
+        writer.put_header(out, writer.objects[i]);
+    std::string field_bytes = fields.str();
+    std::string register_bytes = registers.str();
+    out.write(field_bytes.data(), field_bytes.size());
+    out.write(register_bytes.data(), register_bytes.size());
+    if (!out)
+        throw std::runtime_error("could not write snapshot");
+}
+
+/* Makes every object blank from the headers, then fills
+ them in, so references may point either way. Each
+ reference is checked to be in range and of the kind its
+ field needs; once all are in, `check` makes sure that
+ running on can't reach past the end of a frame or of the
+ frame chain, and that the continuations form one chain,
+ as the pooled ones must (see `Heap::mark`). */
+class SnapshotReader {
+public:
+    std::istream &in;
+    std::vector<Bindings> bindings;
+    std::vector<PTR(Expr)> exprs;
+    std::vector<PTR(Collectable)> objects;
+    std::unordered_map<PTR(Expr), Need> needs;
+    // Each environment an expression will run in, with what it asks of it
+    std::vector<std::pair<PTR(Env), Need> > uses;
+    std::unordered_map<PTR(Cont), PTR(Cont)> rests;
+
+    SnapshotReader(std::istream &in);
+    void get_bindings();
+    void get_exprs();
+    void get_objects();
+    PTR(Expr) get_expr();
+    PTR(Collectable) get_ref();
+    PTR(Env) get_env();
+    PTR(Cont) get_cont();
+    Val get_val();
+    void use(PTR(Env) env, Need need);
+    void check(PTR(Cont) cont);
+
+private:
+    PTR(Expr) get_child();
+    Bindings get_binding();
+    void get_fields(PTR(Collectable) obj);
+    PTR(Cont) get_rest(PTR(Cont) k);
+};
+
+SnapshotReader::SnapshotReader(std::istream &in) : in(in) { }
+
+// The one after a binding comes before it, so they can't loop
+Bindings SnapshotReader::get_binding() {
+    uint64_t id = get_uint(in);
+    if (id > bindings.size())
+        bad_snapshot();
+    return id == 0 ? nullptr : bindings[id - 1];
+}
+
+void SnapshotReader::get_bindings() {
+    uint64_t count = get_uint(in);
+    for (uint64_t i = 0; i < count; i++) {
+        std::string name = get_string(in);
+        int level = get_int(in);
+        int slot = get_int(in);
+        Bindings next = get_binding();
+        if (level < 0 || slot < 0)
+            bad_snapshot();
+        bindings.push_back(std::make_shared<const Binding>(name, level, slot, next));
+    }
+}
+
+// A child comes before its parent, so it is never 0
+PTR(Expr) SnapshotReader::get_child() {
+    uint64_t id = get_uint(in);
+    if (id == 0 || id > exprs.size())
+        bad_snapshot();
+    return exprs[id - 1];
+}
+
+void SnapshotReader::get_exprs() {
+    uint64_t count = get_uint(in);
+    Need none = std::make_shared<const std::vector<int> >();
+    for (uint64_t i = 0; i < count; i++) {
+        PTR(Expr) e;
+        Need need;
+        switch (in.get()) {
+            case NUM_EXPR: {
+                int rep = get_int(in);
+                e = MAKE(NumExpr)(rep);
+                need = none;
+                break;
+            }
+            case ADD_EXPR: {
+                PTR(Expr) lhs = get_child();
+                PTR(Expr) rhs = get_child();
+                e = MAKE(AddExpr)(lhs, rhs);
+                need = need_both(needs[lhs], needs[rhs]);
+                break;
+            }
+            case MULT_EXPR: {
+                PTR(Expr) lhs = get_child();
+                PTR(Expr) rhs = get_child();
+                e = MAKE(MultExpr)(lhs, rhs);
+                need = need_both(needs[lhs], needs[rhs]);
+                break;
+            }
+            case VAR_EXPR: {
+                std::string name = get_string(in);
+                int depth = get_int(in);
+                int slot = get_int(in);
+                e = MAKE(VarExpr)(name, depth, slot);
+                need = var_need(depth, slot);
+                break;
+            }
+            case BOOL_EXPR: {
+                int rep = in.get();
+                if (rep != 0 && rep != 1)
+                    bad_snapshot();
+                e = MAKE(BoolExpr)(rep == 1);
+                need = none;
+                break;
+            }
+            case LET_EXPR: {
+                std::string var_name = get_string(in);
+                PTR(Expr) rhs = get_child();
+                PTR(Expr) body = get_child();
+                int slot = get_int(in);
+                int frame_size = get_int(in);
+                e = MAKE(LetExpr)(var_name, rhs, body, slot, frame_size);
+                // Both sides run in the frame the `_let` opens, if it opens one
+                need = need_slot(need_both(needs[rhs], needs[body]), slot);
+                if (frame_size < 0)
+                    bad_snapshot();
+                if (frame_size > 0)
+                    need = need_outside(need, frame_size);
+                break;
+            }
+            case IF_EXPR: {
+                PTR(Expr) if_part = get_child();
+                PTR(Expr) then_part = get_child();
+                PTR(Expr) else_part = get_child();
+                e = MAKE(IfExpr)(if_part, then_part, else_part);
+                need = need_both(needs[if_part], need_both(needs[then_part], needs[else_part]));
+                break;
+            }
+            case COMP_EXPR: {
+                PTR(Expr) lhs = get_child();
+                PTR(Expr) rhs = get_child();
+                e = MAKE(CompExpr)(lhs, rhs);
+                need = need_both(needs[lhs], needs[rhs]);
+                break;
+            }
+            case FUN_EXPR: {
+                std::string formal_arg = get_string(in);
+                PTR(Expr) body = get_child();
+                int frame_size = get_int(in);
+                Bindings in_scope = get_binding();
+                int level = get_int(in);
+                e = MAKE(FunExpr)(formal_arg, body, frame_size, in_scope, level);
+                // Asked of the closure's environment, for when it
+                // is called or compared
+                need = need_both(need_outside(needs[body], frame_size), bindings_need(in_scope, level));
+                break;
+            }
+            case CALL_EXPR: {
+                PTR(Expr) to_be_called = get_child();
+                PTR(Expr) actual_arg = get_child();
+                e = MAKE(CallFunExpr)(to_be_called, actual_arg);
+                need = need_both(needs[to_be_called], needs[actual_arg]);
+                break;
+            }
+            default:
+                bad_snapshot();
+        }
+        exprs.push_back(e);
+        needs[e] = need;
+    }
+}
+
+PTR(Expr) SnapshotReader::get_expr() {
+    uint64_t id = get_uint(in);
+    if (id > exprs.size())
+        bad_snapshot();
+    return id == 0 ? nullptr : exprs[id - 1];
+}
+
+PTR(Collectable) SnapshotReader::get_ref() {
+    uint64_t id = get_uint(in);
+    if (id == 0)
+        return nullptr;
+    if (id == empty_ref)
+        return Env::emptyenv;
+    if (id == done_ref)
+        return Cont::done;
+    if (id - first_ref >= objects.size())
+        bad_snapshot();
+    return objects[id - first_ref];
+}
+
+PTR(Env) SnapshotReader::get_env() {
+    PTR(Env) env = CAST(Env)(get_ref());
+    if (env == nullptr)
+        bad_snapshot();
+    return env;
+}
+
+PTR(Cont) SnapshotReader::get_cont() {
+    PTR(Cont) cont = CAST(Cont)(get_ref());
+    if (cont == nullptr)
+        bad_snapshot();
+    return cont;
+}
+
+// The `rest` of `k`, noted down for `check`
+PTR(Cont) SnapshotReader::get_rest(PTR(Cont) k) {
+    PTR(Cont) rest = get_cont();
+    rests[k] = rest;
+    return rest;
+}
+
+// Something asking `need` will run in `env`
+void SnapshotReader::use(PTR(Env) env, Need need) {
+    uses.push_back(std::make_pair(env, need));
+}
+
+Val SnapshotReader::get_val() {
+    switch (in.get()) {
+        case NULL_VAL:
+            return Val();
+        case NUM_VAL:
+            return Val::num(get_int(in));
+        case BOOL_VAL: {
+            int rep = in.get();
+            if (rep != 0 && rep != 1)
+                bad_snapshot();
+            return Val::boolean(rep == 1);
+        }
+        case FUN_VAL_REF: {
+            PTR(FunVal) fun = CAST(FunVal)(get_ref());
+            if (fun == nullptr)
+                bad_snapshot();
+            return Val(fun);
+        }
+        default:
+            bad_snapshot();
+            return Val();
+    }
+}
+
+void SnapshotReader::get_objects() {
+    uint64_t count = get_uint(in);
+    for (uint64_t i = 0; i < count; i++) {
+        PTR(Collectable) obj;
+        switch (in.get()) {
+            case FRAME_ENV: {
+                uint64_t size = get_uint(in);
+                if (size > max_frame)
+                    bad_snapshot();
+                obj = NEW(FrameEnv)((int)size, nullptr);
+                break;
+            }
+            case FUN_VAL:
+                obj = NEW(FunVal)("", nullptr, nullptr, 0);
+                break;
+            case RIGHT_THEN_ADD_CONT:
+                obj = NEW(RightThenAddCont)(nullptr, nullptr, nullptr);
+                break;
+            case ADD_CONT:
+                obj = NEW(AddCont)(Val(), nullptr);
+                break;
+            case RIGHT_THEN_MULT_CONT:
+                obj = NEW(RightThenMultCont)(nullptr, nullptr, nullptr);
+                break;
+            case MULT_CONT:
+                obj = NEW(MultCont)(Val(), nullptr);
+                break;
+            case RIGHT_THEN_COMP_CONT:
+                obj = NEW(RightThenCompCont)(nullptr, nullptr, nullptr);
+                break;
+            case COMP_CONT:
+                obj = NEW(CompCont)(Val(), nullptr);
+                break;
+            case LET_CONT:
+                obj = NEW(LetCont)(0, nullptr, nullptr, nullptr);
+                break;
+            case IF_CONT:
+                obj = NEW(IfCont)(nullptr, nullptr, nullptr, nullptr);
+                break;
+            case ARG_THEN_CALL_CONT:
+                obj = NEW(ArgThenCallCont)(nullptr, nullptr, nullptr);
+                break;
+            case CALL_CONT:
+                obj = NEW(CallCont)(Val(), nullptr);
+                break;
+            default:
+                bad_snapshot();
+        }
+        objects.push_back(obj);
+    }
+    for (size_t i = 0; i < objects.size(); i++)
+        get_fields(objects[i]);
+}
+
+// Expressions that are evaluated can't be missing
+static PTR(Expr) needed(PTR(Expr) e) {
+    if (e == nullptr)
+        bad_snapshot();
+    return e;
+}
+
+void SnapshotReader::get_fields(PTR(Collectable) obj) {
+    if (PTR(FrameEnv) frame = CAST(FrameEnv)(obj)) {
+        for (size_t i = 0; i < frame->slots.size(); i++)
+            frame->slots[i] = get_val();
+        frame->rest = get_env();
+    } else if (PTR(FunVal) fun = CAST(FunVal)(obj)) {
+        fun->formal_arg = get_string(in);
+        fun->body = needed(get_expr());
+        fun->env = get_env();
+        fun->frame_size = get_int(in);
+        fun->in_scope = get_binding();
+        fun->level = get_int(in);
+        use(fun->env, need_both(need_outside(needs[fun->body], fun->frame_size),
+                                bindings_need(fun->in_scope, fun->level)));
+    } else if (PTR(RightThenAddCont) k = CAST(RightThenAddCont)(obj)) {
+        k->rhs = needed(get_expr());
+        k->env = get_env();
+        use(k->env, needs[k->rhs]);
+        k->rest = get_rest(k);
+    } else if (PTR(AddCont) k = CAST(AddCont)(obj)) {
+        k->lhs_val = get_val();
+        k->rest = get_rest(k);
+    } else if (PTR(RightThenMultCont) k = CAST(RightThenMultCont)(obj)) {
+        k->rhs = needed(get_expr());
+        k->env = get_env();
+        use(k->env, needs[k->rhs]);
+        k->rest = get_rest(k);
+    } else if (PTR(MultCont) k = CAST(MultCont)(obj)) {
+        k->lhs_val = get_val();
+        k->rest = get_rest(k);
+    } else if (PTR(RightThenCompCont) k = CAST(RightThenCompCont)(obj)) {
+        k->rhs = needed(get_expr());
+        k->env = get_env();
+        use(k->env, needs[k->rhs]);
+        k->rest = get_rest(k);
+    } else if (PTR(CompCont) k = CAST(CompCont)(obj)) {
+        k->lhs_val = get_val();
+        k->rest = get_rest(k);
+    } else if (PTR(LetCont) k = CAST(LetCont)(obj)) {
+        k->slot = get_int(in);
+        k->body = needed(get_expr());
+        k->env = get_env();
+        use(k->env, need_slot(needs[k->body], k->slot));
+        k->rest = get_rest(k);
+    } else if (PTR(IfCont) k = CAST(IfCont)(obj)) {
+        k->then_part = needed(get_expr());
+        k->else_part = needed(get_expr());
+        k->env = get_env();
+        use(k->env, need_both(needs[k->then_part], needs[k->else_part]));
+        k->rest = get_rest(k);
+    } else if (PTR(ArgThenCallCont) k = CAST(ArgThenCallCont)(obj)) {
+        k->actual_arg = needed(get_expr());
+        k->env = get_env();
+        use(k->env, needs[k->actual_arg]);
+        k->rest = get_rest(k);
+    } else if (PTR(CallCont) k = CAST(CallCont)(obj)) {
+        k->to_be_called = get_val();
+        k->rest = get_rest(k);
+    }
+}
+
+void SnapshotReader::check(PTR(Cont) cont) {
+    // A frame only ever points out to older ones
+    std::unordered_map<PTR(FrameEnv), bool> done;
+    for (size_t i = 0; i < objects.size(); i++) {
+        std::vector<PTR(FrameEnv)> path;
+        PTR(FrameEnv) frame = CAST(FrameEnv)(objects[i]);
+        while (frame != nullptr && done.count(frame) == 0) {
+            done[frame] = false;
+            path.push_back(frame);
+            frame = CAST(FrameEnv)(frame->rest);
+        }
+        if (frame != nullptr && !done[frame])
+            bad_snapshot();
+        for (size_t j = 0; j < path.size(); j++)
+            done[path[j]] = true;
+    }
+
+    for (size_t i = 0; i < uses.size(); i++) {
+        PTR(Env) env = uses[i].first;
+        const std::vector<int> &need = *uses[i].second;
+        for (size_t d = 0; d < need.size(); d++) {
+            PTR(FrameEnv) frame = CAST(FrameEnv)(env);
+            if (frame == nullptr || frame->slots.size() < (size_t)need[d])
+                bad_snapshot();
+            env = frame->rest;
+        }
+    }
+
+    // Every continuation is on the one chain from `cont`, once
+    std::unordered_set<PTR(Cont)> seen;
+    while (cont != Cont::done) {
+        if (!seen.insert(cont).second)
+            bad_snapshot();
+        cont = rests[cont];
+    }
+    if (seen.size() != rests.size())
+        bad_snapshot();
+}
+
+void load_snapshot(StepMachine &machine, std::istream &in) {
+    char header[magic_size];
+    in.read(header, magic_size);
+    if ((size_t)in.gcount() != magic_size || std::string(header, magic_size) != std::string(magic, magic_size))
+        bad_snapshot();
+
+    // Collections only happen between steps, so nothing
+    // made here is freed before the registers hold it
+    CurrentHeap current(&machine.heap);
+    SnapshotReader reader(in);
+    reader.get_bindings();
+    reader.get_exprs();
+    reader.get_objects();
+
+    int mode = in.get();
+    if (mode != 0 && mode != 1)
+        bad_snapshot();
+    PTR(Expr) expr = reader.get_expr();
+    if (mode == 0 && expr == nullptr)
+        bad_snapshot();
+    PTR(Env) env = reader.get_env();
+    Val val = reader.get_val();
+    PTR(Cont) cont = reader.get_cont();
+    uint64_t steps = get_uint(in);
+    if (mode == 0)
+        reader.use(env, reader.needs[expr]);
+    reader.check(cont);
+
+    machine.mode = mode == 0 ? StepMachine::interp_mode : StepMachine::continue_mode;
+    machine.expr = expr;
+    machine.env = env;
+    machine.val = val;
+    machine.cont = cont;
+    machine.steps = steps;
+}
+
+/* for tests */
+#include "parse.hpp"
+#include "resolve.hpp"
+#include "arena.hpp"
+#include "catch.hpp"
+
+static const char fib[] =
+    "_let fib = _fun (f) _fun (n) _if n == 0 _then 0 _else _if n == 1 _then 1 "
+    "           _else f(f)(n + -1) + f(f)(n + -2) "
+    "_in fib(fib)(12)";
+
+// A snapshot of `program` paused after `steps` steps
+static std::string paused(PTR(Expr) program, size_t steps) {
+    StepMachine machine;
+    machine.start(program);
+    machine.run(steps);
+    std::stringstream out;
+    save_snapshot(machine, out);
+    return out.str();
+}
+
+TEST_CASE( "snapshots" ) {
+    ParseSession session;
+    std::stringstream input(fib);
+    PTR(Expr) program = resolve(parse(input));
+    StepMachine whole;
+    CHECK( whole.interp_by_steps(program).to_string() == "144" );
+    
+    // Loaded anywhere along the way, a machine carries on to
+    // the same result in the same number of steps
+    for (size_t at = 0; at <= whole.steps; at += whole.steps / 7) {
+        std::stringstream snapshot(paused(program, at));
+        StepMachine machine;
+        load_snapshot(machine, snapshot);
+        CHECK( machine.steps == at );
+        while (!machine.run(1000))
+            ;
+        CHECK( machine.val.to_string() == "144" );
+        CHECK( machine.steps == whole.steps );
+    }
+    
+    // And saves the same again
+    std::string saved = paused(program, whole.steps / 2);
+    std::stringstream snapshot(saved);
+    StepMachine machine;
+    load_snapshot(machine, snapshot);
+    std::stringstream again;
+    save_snapshot(machine, again);
+    CHECK( again.str() == saved );
+}
+
+TEST_CASE( "bad snapshots" ) {
+    ParseSession session;
+    std::stringstream input(fib);
+    PTR(Expr) program = resolve(parse(input));
+    std::string saved = paused(program, 500);
+    
+    StepMachine machine;
+    std::stringstream empty(""), text("1 + 2");
+    CHECK_THROWS_AS( load_snapshot(machine, empty), std::runtime_error );
+    CHECK_THROWS_AS( load_snapshot(machine, text), std::runtime_error );
+    // Cut short anywhere
+    for (size_t size = 0; size < saved.size(); size++) {
+        std::stringstream cut(saved.substr(0, size));
+        CHECK_THROWS_AS( load_snapshot(machine, cut), std::runtime_error );
+    }
+    
+    // With any byte changed, either refused or safe to run on
+    for (size_t i = magic_size; i < saved.size(); i++) {
+        std::string damaged = saved;
+        damaged[i] ^= 0x5a;
+        std::stringstream in(damaged);
+        try {
+            load_snapshot(machine, in);
+            machine.run(2000);
+        } catch (std::runtime_error &) {
+        }
+    }
+}
@@ -0,0 +1,33 @@
+//
+//  snapshot.hpp
+//  ArithemticParser2
+//
+//  Saving and restoring a paused step machine.
+//
+
+#ifndef snapshot_hpp
+#define snapshot_hpp
+
+#include <iostream>
+
+class StepMachine;
+
+/* Write the registers of a paused machine (see
+ `StepMachine::run`) and everything they reach: the
+ expressions still to evaluate, environments, function
+ values and the continuation chain. Each object is written
+ once, however many others refer to it, so sharing and
+ cycles come back as they were. */
+void save_snapshot(StepMachine &machine, std::ostream &out);
+
+/* Replace the registers of `machine` with those saved in
+ `in`, so that `run` carries on where the saved machine
+ stopped. Values go in the machine's heap; expressions are
+ rebuilt with `MAKE`, so in the current arena if there is
+ one, and must outlive the machine. Throws `runtime_error`
+ for input that is not a snapshot, or whose variables,
+ frames and continuations don't fit together the way a
+ running machine's do. */
+void load_snapshot(StepMachine &machine, std::istream &in);
+
+#endif /* snapshot_hpp */
@@ -12,28 +12,157 @@
 #include "env.hpp"
 #include "value.hpp"
 
-Step::mode_t Step::mode;
-
-PTR(Cont) Step::cont;
-PTR(Expr) Step::expr;/* only for Step::interp_mode */
-PTR(Env) Step::env;
-PTR(Val) Step::val; /* only for Step::continue_mode */
-
-PTR(Val) Step::interp_by_steps(PTR(Expr) e) {
-    Step::mode = Step::interp_mode;
-    Step::expr = e;
-    Step::env = Env::emptyenv;
-    Step::val = nullptr;
-    Step::cont = Cont::done;
+// Steps between looks at the clock in `run_for`
+static const size_t steps_per_clock_check = 256;
+
+StepMachine::StepMachine() {
+    // Finished, with nothing to run, until `start`
+    mode = continue_mode;
+    expr = nullptr;
+    env = Env::emptyenv;
+    cont = Cont::done;
+    steps = 0;
+}
+
+void StepMachine::collect_garbage() {
+    heap.mark(env);
+    val.trace(heap);
+    heap.mark(cont);
+    heap.collect();
+}
+
+Val StepMachine::interp_by_steps(PTR(Expr) e) {
+    start(e);
+    while (!run((size_t)-1))
+        ;
+    return val;
+}
+
+void StepMachine::start(PTR(Expr) e) {
+    mode = interp_mode;
+    expr = e;
+    env = Env::emptyenv;
+    val = Val();
+    cont = Cont::done;
+    steps = 0;
+}
+
+bool StepMachine::finished() {
+    return mode == continue_mode && cont == Cont::done;
+}
+
+bool StepMachine::run(size_t max_steps) {
+    return run_steps(max_steps, false, std::chrono::steady_clock::time_point());
+}
+
+bool StepMachine::run_for(std::chrono::microseconds max_time) {
+    return run_steps((size_t)-1, true, std::chrono::steady_clock::now() + max_time);
+}
+
+bool StepMachine::run_steps(size_t max_steps, bool timed, std::chrono::steady_clock::time_point deadline) {
+    CurrentHeap current(&heap);
     
-    while (1) {
-        if (Step::mode == Step::interp_mode)
-            Step::expr -> step_interp();
+    for (size_t taken = 0; taken < max_steps; taken++) {
+        if (heap.wants_collection())
+            collect_garbage();
+        if (mode == interp_mode)
+            expr -> step_interp(*this);
         else {
-            if (Step::cont == Cont::done)
-                return Step::val;
-            else
-                Step::cont->step_continue();
+            if (cont == Cont::done)
+                return true;
+            PTR(Cont) delivered = cont;
+            delivered->step_continue(*this);
+            heap.recycle(delivered);
         }
+        steps++;
+        if (timed && taken % steps_per_clock_check == steps_per_clock_check - 1
+            && std::chrono::steady_clock::now() >= deadline)
+            break;
+    }
+    return finished();
+}
+
+/* for tests */
+#include <sstream>
+#include <thread>
+#include <vector>
+#include "parse.hpp"
+#include "resolve.hpp"
+#include "arena.hpp"
+#include "API.hpp"
+#include "catch.hpp"
+
+static const char fib[] =
+    "_let fib = _fun (f) _fun (n) _if n == 0 _then 0 _else _if n == 1 _then 1 "
+    "           _else f(f)(n + -1) + f(f)(n + -2) "
+    "_in fib(fib)(15)";
+
+TEST_CASE( "step machines" ) {
+    ParseSession session;
+    std::stringstream input(fib);
+    PTR(Expr) program = resolve(parse(input));
+    
+    // A machine can be used again, and two can take turns
+    StepMachine first, second;
+    CHECK( first.interp_by_steps(program).to_string() == "610" );
+    CHECK( first.interp_by_steps(program).to_string() == "610" );
+    first.start(program);
+    second.start(program);
+    while (!first.finished() || !second.finished()) {
+        first.run(100);
+        second.run(7);
     }
+    CHECK( first.val.to_string() == "610" );
+    CHECK( second.val.to_string() == "610" );
+    
+    // Or run on threads of their own
+    std::vector<std::string> results(4);
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < results.size(); i++) {
+        threads.push_back(std::thread([&results, i]() {
+            std::stringstream input(fib);
+            results[i] = step_interp(input);
+        }));
+    }
+    for (size_t i = 0; i < threads.size(); i++)
+        threads[i].join();
+    for (size_t i = 0; i < results.size(); i++)
+        CHECK( results[i] == "610" );
+}
+
+TEST_CASE( "bounded runs" ) {
+    ParseSession session;
+    std::stringstream input(fib);
+    PTR(Expr) program = resolve(parse(input));
+    
+    StepMachine whole;
+    CHECK( whole.interp_by_steps(program).to_string() == "610" );
+    size_t total = whole.steps;
+    
+    // Stopped after exactly as many steps as asked for, and
+    // resumed where it left off
+    StepMachine machine;
+    CHECK( machine.finished() );
+    machine.start(program);
+    CHECK( !machine.finished() );
+    CHECK( !machine.run(10) );
+    CHECK( machine.steps == 10 );
+    CHECK( !machine.run(0) );
+    CHECK( machine.steps == 10 );
+    CHECK( !machine.run(total - 11) );
+    CHECK( machine.run(1) );
+    CHECK( machine.steps == total );
+    CHECK( machine.finished() );
+    CHECK( machine.val.to_string() == "610" );
+    // Nothing left to do
+    CHECK( machine.run(10) );
+    CHECK( machine.steps == total );
+    
+    // Timed runs get there too, and `start` begins again
+    machine.start(program);
+    CHECK( machine.steps == 0 );
+    while (!machine.run_for(std::chrono::microseconds(50)))
+        ;
+    CHECK( machine.val.to_string() == "610" );
+    CHECK( machine.steps == total );
 }
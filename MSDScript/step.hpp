@@ -10,15 +10,20 @@
 #define step_hpp
 
 #include <stdio.h>
+#include <chrono>
 #include <iostream>
 #include "pointer.hpp"
+#include "gc.hpp"
+#include "value.hpp"
 
 class Expr;
 class Env;
-class Val;
 class Cont;
 
-class Step {
+/* The registers of one step-mode evaluation. Each
+ evaluation gets its own machine, so separate machines
+ can run on separate threads at the same time. */
+class StepMachine {
 public:
     typedef enum {
         interp_mode,
@@ -28,29 +33,59 @@ public:
     /* Mode insicates whether the next step is to
      start interpreting an expression or start
      delivering a value to a continuation. */
-    static mode_t mode;
+    mode_t mode;
     
     /* The expression to interpret, meaningful
      only when `mode` is `interp_mode`: */
-    static PTR(Expr) expr;
+    PTR(Expr) expr;
     
-    static PTR(Env) env;
+    PTR(Env) env;
     
     /* The value to be delivered to the continuation,
      meaningful only when `mode` is `continue_mode`: */
-    static PTR(Val) val;
+    Val val;
     
     /* The continuation to receive a value, meaningful
      only when `mode` is `continue_mode`: */
-    static PTR(Cont) cont;
+    PTR(Cont) cont;
+    
+    /* Where values, environments and continuations are
+     allocated while stepping. It is collected between
+     steps, when the registers above are the only roots;
+     set `heap.limit` to bound it and read `heap.stats`. */
+    Heap heap;
+    
+    // Steps taken since the last `start`
+    size_t steps;
+    
+    StepMachine();
     
     /* Function to interpret an expression by stepping.
-     The function should only be called once to start
-     an expression's interpretation. It must not be
-     called by `step_interp` or `step_continue` (i.e.,
-     it must not be called recursively, since the whole
-     point is to avoid rcursive calls at the C++ level). */
-    static PTR(Val) interp_by_steps(PTR(Expr) e);
+     It must not be called by `step_interp` or
+     `step_continue` on the same machine, since the whole
+     point is to avoid rcursive calls at the C++ level;
+     a fresh machine may be used from anywhere.
+     The result stays valid until the next call or until
+     the machine is destroyed. */
+    Val interp_by_steps(PTR(Expr) e);
+    
+    /* To evaluate a bit at a time, `start` loads the
+     registers and each `run` takes up to `max_steps` more
+     steps, or stops once `max_time` has passed, returning
+     true when the evaluation is finished and `val` holds
+     the result. Between calls the registers are the whole
+     state, so a scheduler can set a machine aside and
+     resume it later, on any thread; `e` must stay alive
+     until then. If a step throws, the machine must be
+     started again. */
+    void start(PTR(Expr) e);
+    bool run(size_t max_steps);
+    bool run_for(std::chrono::microseconds max_time);
+    bool finished();
+    
+private:
+    void collect_garbage();
+    bool run_steps(size_t max_steps, bool timed, std::chrono::steady_clock::time_point deadline);
 };
 
 #endif /* step_hpp */
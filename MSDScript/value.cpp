@@ -1,152 +1,155 @@
 #include <stdexcept>
+#include <sstream>
 #include "value.hpp"
 #include "expr.hpp"
 #include "env.hpp"
 #include "step.hpp"
+#include "API.hpp"
+#include "catch.hpp"
 
-//NumVal
-NumVal::NumVal(int rep) {
-    this->rep = rep;
+//Val
+bool Val::equals(Val other_val) {
+    if (is_fun() && other_val.is_fun())
+        return fun()->equals(other_val.fun());
+    return bits == other_val.bits;
 }
 
-bool NumVal::equals(PTR(Val) other_val) {
-    PTR(NumVal) other_num_val = CAST(NumVal)(other_val);
-    if (other_num_val == nullptr){
-        return false;
+Val Val::add_to(Val other_val) {
+    if (is_num()){
+        if (!other_val.is_num())
+            throw std::runtime_error("This is not a number");
+        return Val::num(wrap_add(num_rep(), other_val.num_rep()));
+    }else if (is_bool()){
+        throw std::runtime_error("Booleans could not add");
     }else{
-        return rep == other_num_val->rep;
+        throw std::runtime_error("Functions could not add.");
     }
 }
 
-PTR(Val) NumVal::add_to(PTR(Val) other_val) {
-    PTR(NumVal) other_num_val = CAST(NumVal)(other_val);
-    if (other_num_val == nullptr){
-        throw std::runtime_error("This is not a number");
+Val Val::mult_with(Val other_val) {
+    if (is_num()){
+        if (!other_val.is_num())
+            throw std::runtime_error("This is not a number");
+        return Val::num(wrap_mult(num_rep(), other_val.num_rep()));
+    }else if (is_bool()){
+        throw std::runtime_error("Booleans could not multiply");
     }else{
-        return NEW(NumVal)(rep + other_num_val->rep);
+        throw std::runtime_error("Functions could not multiply.");
     }
 }
 
-PTR(Val) NumVal::mult_with(PTR(Val) other_val) {
-    PTR(NumVal) other_num_val = CAST(NumVal)(other_val);
-    if (other_num_val == nullptr){
-        throw std::runtime_error("This is not a number");
+PTR(Expr) Val::to_expr() {
+    if (is_num()){
+        return MAKE(NumExpr)(num_rep());
+    }else if (is_bool()){
+        return MAKE(BoolExpr)(bool_rep());
     }else{
-        return NEW(NumVal)(rep * other_num_val->rep);
+        return fun()->to_expr();
     }
 }
 
-PTR(Expr) NumVal::to_expr() {
-    return NEW(NumExpr)(rep);
-}
-
-std::string NumVal::to_string() {
-    return std::to_string(rep);
-}
-
-PTR(Val) NumVal::call(PTR(Val) actual_arg) {
-    throw std::runtime_error("Function call error occured");
-}
-
-void NumVal::call_step(PTR(Val) actual_arg_val, PTR(Cont) rest) {
-    throw std::runtime_error("Function call error occured");
-}
-
-//BoolVal
-BoolVal::BoolVal(bool rep) {
-    this->rep = rep;
-}
-
-bool BoolVal::equals(PTR(Val) other_val) {
-    PTR(BoolVal) other_bool_val = CAST(BoolVal)(other_val);
-    if (other_bool_val == nullptr){
-        return false;
+std::string Val::to_string() {
+    if (is_num()){
+        return std::to_string(num_rep());
+    }else if (is_bool()){
+        return bool_rep() ? "_true" : "_false";
     }else{
-        return rep == other_bool_val->rep;
+        return "[FUNCTION]";
     }
 }
 
-PTR(Val) BoolVal::add_to(PTR(Val) other_val) {
-    throw std::runtime_error("Booleans could not add");
-}
-
-PTR(Val) BoolVal::mult_with(PTR(Val) other_val) {
-    throw std::runtime_error("Booleans could not multiply");
-}
-
-PTR(Expr) BoolVal::to_expr() {
-    return NEW(BoolExpr)(rep);
+Val Val::call(Val actual_arg) {
+    if (!is_fun())
+        throw std::runtime_error("Function call error occured");
+    return fun()->call(actual_arg);
 }
 
-void BoolVal::call_step(PTR(Val) actual_arg_val, PTR(Cont) rest) {
-    throw std::runtime_error("Function call error occured");
+void Val::call_step(StepMachine &step, Val actual_arg_val, PTR(Cont) rest) {
+    if (!is_fun())
+        throw std::runtime_error("Function call error occured");
+    fun()->call_step(step, actual_arg_val, rest);
 }
 
-std::string BoolVal::to_string() {
-    if (rep){
-        return "_true";
-    }else{
-        return "_false";
-    }
+void Val::trace(Heap &heap) {
+    if (is_fun())
+        heap.mark(fun());
 }
 
-PTR(Val) BoolVal::call(PTR(Val) actual_arg) {
-    throw std::runtime_error("Function call error occured");
+//Binding
+Binding::Binding(std::string name, int level, int slot, std::shared_ptr<const Binding> next) {
+    this->name = name;
+    this->level = level;
+    this->slot = slot;
+    this->next = next;
 }
 
-FunVal::FunVal(std::string formal_arg, PTR(Expr) body, PTR(Env) env) {
+//FunVal
+FunVal::FunVal(std::string formal_arg, PTR(Expr) body, PTR(Env) env, int frame_size,
+               Bindings in_scope, int level) {
     this->formal_arg = formal_arg;
     this->body = body;
     this->env = env;
+    this->frame_size = frame_size;
+    this->in_scope = in_scope;
+    this->level = level;
 }
 
-bool FunVal::equals(PTR(Val) val) {
-    PTR(FunVal) f = CAST(FunVal)(val);
-    
-    if (f == NULL){
+/* Closures are equal when they have the same code and saw
+ the same bindings, with equal values, where they were
+ made. Later slots of the same frames don't count, which
+ also keeps this from looping: a frame can hold a closure
+ that refers back to it, but only in a slot set after the
+ closure was made. */
+bool FunVal::equals(PTR(FunVal) f) {
+    if (f == THIS)
+        return true;
+    if (formal_arg != f->formal_arg || !body->equals(f->body))
         return false;
-    }else{
-        return formal_arg == f->formal_arg && body->equals(f->body) && env->equals(f->env);
+    const Binding *a = in_scope.get();
+    const Binding *b = f->in_scope.get();
+    for (; a != nullptr && b != nullptr; a = a->next.get(), b = b->next.get()) {
+        if (a->name != b->name)
+            return false;
+        Val a_val = env->lookup(level - a->level, a->slot);
+        Val b_val = f->env->lookup(f->level - b->level, b->slot);
+        if (!a_val.equals(b_val))
+            return false;
     }
-}
-
-PTR(Val) FunVal::add_to(PTR(Val) other_val) {
-    throw std::runtime_error("Functions could not add.");
-}
-
-PTR(Val) FunVal::mult_with(PTR(Val) other_val) {
-    throw std::runtime_error("Functions could not multiply.");
+    return a == nullptr && b == nullptr;
 }
 
 PTR(Expr) FunVal::to_expr() {
-    return NEW(FunExpr)(formal_arg, body);
+    return MAKE(FunExpr)(formal_arg, body);
 }
 
-std::string FunVal::to_string() {
-    return "[FUNCTION]";
+Val FunVal::call(Val actual_arg) {
+    PTR(Env) frame = NEW(FrameEnv)(frame_size, env);
+    frame->set(0, actual_arg);
+    return body->interp(frame);
 }
 
-PTR(Val) FunVal::call(PTR(Val) actual_arg) {
-    return body->interp(NEW(ExtendedEnv)(formal_arg, actual_arg, env));
+void FunVal::call_step(StepMachine &step, Val actual_arg_val, PTR(Cont) rest) {
+    step.mode = StepMachine::interp_mode;
+    step.expr = body;
+    step.env = NEW(FrameEnv)(frame_size, env);
+    step.env->set(0, actual_arg_val);
+    step.cont = rest;
 }
 
-void FunVal::call_step(PTR(Val) actual_arg_val, PTR(Cont) rest) {
-    Step::mode = Step::interp_mode;
-    Step::expr = body;
-    Step::env = NEW(ExtendedEnv)(formal_arg, actual_arg_val, env);
-    Step::cont = rest;
+void FunVal::trace(Heap &heap) {
+    heap.mark(env);
 }
 
 // TEST_CASE( "values equals" ) {
-//     CHECK( (new NumVal(5))->equals(new NumVal(5)) );
-//     CHECK( ! (new NumVal(7))->equals(new NumVal(5)) );
+//     CHECK( (Val::num(5)).equals(Val::num(5)) );
+//     CHECK( ! (Val::num(7)).equals(Val::num(5)) );
     
-//     CHECK( (new BoolVal(true))->equals(new BoolVal(true)) );
-//     CHECK( ! (new BoolVal(true))->equals(new BoolVal(false)) );
-//     CHECK( ! (new BoolVal(false))->equals(new BoolVal(true)) );
+//     CHECK( (Val::boolean(true)).equals(Val::boolean(true)) );
+//     CHECK( ! (Val::boolean(true)).equals(Val::boolean(false)) );
+//     CHECK( ! (Val::boolean(false)).equals(Val::boolean(true)) );
     
-//     CHECK( ! (new NumVal(7))->equals(new BoolVal(false)) );
-//     CHECK( ! (new BoolVal(false))->equals(new NumVal(8)) );
+//     CHECK( ! (Val::num(7)).equals(Val::boolean(false)) );
+//     CHECK( ! (Val::boolean(false)).equals(Val::num(8)) );
     
 //     CHECK( (NEW(FunVal)("x", NEW(AddExpr)(NEW(VarExpr)("x"), NEW(VarExpr)("x")), Env::emptyenv))
 //           ->equals(NEW(FunVal)("x", NEW(AddExpr)(NEW(VarExpr)("x"), NEW(VarExpr)("x")), Env::emptyenv)) );
@@ -156,41 +159,98 @@ void FunVal::call_step(PTR(Val) actual_arg_val, PTR(Cont) rest) {
 
 // TEST_CASE( "add_to" ) {
     
-//     CHECK ( (new NumVal(3))->add_to(new NumVal(9))->equals(new NumVal(12)) );
+//     CHECK ( (Val::num(3)).add_to(Val::num(9)).equals(Val::num(12)) );
     
-//     //CHECK_THROWS_WITH ( (new NumVal(6))->add_to(new BoolVal(true)), "not a number" );
-//     CHECK_THROWS_WITH ( (new BoolVal(false))->add_to(new BoolVal(false)),
+//     //CHECK_THROWS_WITH ( (Val::num(6)).add_to(Val::boolean(true)), "not a number" );
+//     CHECK_THROWS_WITH ( (Val::boolean(false)).add_to(Val::boolean(false)),
 //                        "Booleans could not add" );
 // //    CHECK_THROWS_WITH( (NEW(FunVal)("x", NEW(MultExpr)(NEW(VarExpr)("x"), NEW(VarExpr)("x")), Env::emptyenv))
-// //                      ->add_to(NEW(NumVal)(4)),
+// //                      ->add_to(Val::num(4)),
 // //                      "Functions could not add");
 // }
 
 // TEST_CASE( "mult_with" ) {
     
-//     CHECK ( (new NumVal(3))->mult_with(new NumVal(9))->equals(new NumVal(27)) );
+//     CHECK ( (Val::num(3)).mult_with(Val::num(9)).equals(Val::num(27)) );
     
-// //    CHECK_THROWS_WITH ( (new NumVal(5))->mult_with(new BoolVal(false)), "not a number" );
-//     CHECK_THROWS_WITH ( (new BoolVal(false))->mult_with(new BoolVal(false)),
+// //    CHECK_THROWS_WITH ( (Val::num(5)).mult_with(Val::boolean(false)), "not a number" );
+//     CHECK_THROWS_WITH ( (Val::boolean(false)).mult_with(Val::boolean(false)),
 //                        "Booleans could not multiply" );
 // //    CHECK_THROWS_WITH( (NEW(FunVal)("x", NEW(MultExpr)(NEW(VarExpr)("x"), NEW(VarExpr)("x")), Env::emptyenv))
-// //                      ->mult_with(NEW(NumVal)(4)),
+// //                      ->mult_with(Val::num(4)),
 // //                      "Functions could not multiply" );
 // }
 
 // TEST_CASE( "value to_expr" ) {
-//     CHECK( (new NumVal(6))->to_expr()->equals(new NumExpr(6)) );
-//     CHECK( (new BoolVal(true))->to_expr()->equals(new BoolExpr(true)) );
-//     CHECK( (new BoolVal(false))->to_expr()->equals(new BoolExpr(false)) );
+//     CHECK( (Val::num(6)).to_expr()->equals(new NumExpr(6)) );
+//     CHECK( (Val::boolean(true)).to_expr()->equals(new BoolExpr(true)) );
+//     CHECK( (Val::boolean(false)).to_expr()->equals(new BoolExpr(false)) );
 //     CHECK( (NEW(FunVal)("x", NEW(MultExpr)(NEW(VarExpr)("x"), NEW(VarExpr)("x")), Env::emptyenv))
 //           ->to_expr()->equals(NEW(FunExpr)("x", NEW(MultExpr)(NEW(VarExpr)("x"), NEW(VarExpr)("x")))) );
 // }
 
 // TEST_CASE( "value to_string" ) {
-//     CHECK( (new NumVal(6))->to_string() == "6" );
-//     CHECK( (new BoolVal(true))->to_string() == "_true" );
-//     CHECK( (new BoolVal(false))->to_string() == "_false" );
+//     CHECK( (Val::num(6)).to_string() == "6" );
+//     CHECK( (Val::boolean(true)).to_string() == "_true" );
+//     CHECK( (Val::boolean(false)).to_string() == "_false" );
 //     CHECK( (NEW(FunVal)("x", NEW(MultExpr)(NEW(VarExpr)("x"), NEW(VarExpr)("x")), Env::emptyenv))
 //           ->to_string() == "[FUNCTION]" );
 // }
 
+/* for tests */
+static std::string run(std::string (*engine)(std::istream &), std::string program) {
+    std::stringstream input(program);
+    return engine(input);
+}
+
+TEST_CASE( "closure equality" ) {
+    std::string (*engines[])(std::istream &) = { interp, step_interp };
+    for (size_t i = 0; i < 2; i++) {
+        // Each call makes a frame holding a closure that refers back to it
+        CHECK( run(engines[i], "_let mk = _fun(u) _let f = _fun(x) x _in f _in mk(1) == mk(1)") == "_true" );
+        CHECK( run(engines[i], "_let mk = _fun(u) _let f = _fun(x) x _in f _in mk(1) == mk(2)") == "_false" );
+        // Only the bindings in scope where a closure is made count,
+        // though later ones share its frame
+        CHECK( run(engines[i], "_let g = _fun(x) x _in _let h = _fun(x) x _in g == h") == "_false" );
+        CHECK( run(engines[i], "_let g = _fun(x) x _in _let h = g _in g == h") == "_true" );
+        CHECK( run(engines[i], "(_let a = 1 _in _fun(x) x) == (_let a = 1 _in _fun(x) x)") == "_true" );
+        CHECK( run(engines[i], "(_let a = 1 _in _fun(x) x) == (_let b = 1 _in _fun(x) x)") == "_false" );
+        CHECK( run(engines[i], "(_fun(u) _fun(y) y)(1) == (_fun(u) _fun(y) y)(2)") == "_false" );
+        CHECK( run(engines[i], "(_fun(x) x) == (_fun(y) y)") == "_false" );
+    }
+}
+
+TEST_CASE( "inline values" ) {
+    CHECK( Val().is_null() );
+    CHECK( !Val().is_fun() );
+    
+    Val n = Val::num(-7);
+    CHECK( n.is_num() );
+    CHECK( !n.is_bool() );
+    CHECK( !n.is_fun() );
+    CHECK( n.num_rep() == -7 );
+    CHECK( n.to_string() == "-7" );
+    CHECK( Val::num(2147483647).num_rep() == 2147483647 );
+    CHECK( Val::num(-2147483647 - 1).num_rep() == -2147483647 - 1 );
+    
+    Val t = Val::boolean(true);
+    CHECK( t.is_bool() );
+    CHECK( t.bool_rep() );
+    CHECK( !Val::boolean(false).bool_rep() );
+    CHECK( t.to_string() == "_true" );
+    
+    // Numbers and booleans never equal each other, even with
+    // the same bits
+    CHECK( Val::num(1).equals(Val::num(1)) );
+    CHECK( !Val::num(1).equals(Val::boolean(true)) );
+    CHECK( !Val::num(0).equals(Val::boolean(false)) );
+    CHECK( Val::boolean(false).equals(Val::boolean(false)) );
+    
+    CHECK( Val::num(3).add_to(Val::num(9)).num_rep() == 12 );
+    CHECK( Val::num(3).mult_with(Val::num(9)).num_rep() == 27 );
+    CHECK( Val::num(2147483647).add_to(Val::num(1)).num_rep() == -2147483647 - 1 );
+    CHECK( Val::num(65536).mult_with(Val::num(65536)).num_rep() == 0 );
+    CHECK_THROWS_WITH( Val::num(1).add_to(Val::boolean(true)), "This is not a number" );
+    CHECK_THROWS_WITH( Val::boolean(true).mult_with(Val::num(1)), "Booleans could not multiply" );
+    CHECK_THROWS_WITH( Val::num(1).call(Val::num(2)), "Function call error occured" );
+}
@@ -1,65 +1,120 @@
 #ifndef value_hpp
 #define value_hpp
 
+#include <stdint.h>
+#include <memory>
 #include <string>
 #include "pointer.hpp"
+#include "gc.hpp"
 
 class Expr;
 class Env;
 class Cont;
+class StepMachine;
 
-class Val ENABLE_THIS(Val){
+class FunVal;
+
+/* A runtime value, passed around by value. Numbers and
+ booleans are stored inline in the word itself, so making
+ one never allocates; only functions live on the heap, as
+ a `FunVal`. A default-constructed `Val` is "no value". */
+class Val {
 public:
-    virtual bool equals(PTR(Val) val) = 0;
-    virtual PTR(Val) add_to(PTR(Val) other_val) = 0;
-    virtual PTR(Val) mult_with(PTR(Val) other_val) = 0;
-    virtual PTR(Expr) to_expr() = 0;
-    virtual std::string to_string() = 0;
-    virtual PTR(Val) call(PTR(Val) actual_arg) = 0;
-    virtual void call_step(PTR(Val) actual_arg_val, PTR(Cont) rest) = 0;
-};
+    Val();
+    Val(PTR(FunVal) fun);
+    static Val num(int rep);
+    static Val boolean(bool rep);
     
-class NumVal : public Val {
-public:
-    int rep;
-    NumVal(int rep);
-    bool equals(PTR(Val) val);
-    PTR(Val) add_to(PTR(Val) other_val);
-    PTR(Val) mult_with(PTR(Val) other_val);
+    bool is_num() const;
+    bool is_bool() const;
+    bool is_fun() const;
+    bool is_null() const;
+    int num_rep() const;
+    bool bool_rep() const;
+    PTR(FunVal) fun() const;
+    
+    bool equals(Val val);
+    Val add_to(Val other_val);
+    Val mult_with(Val other_val);
     PTR(Expr) to_expr();
     std::string to_string();
-    PTR(Val) call(PTR(Val) actual_arg);
-    void call_step(PTR(Val) actual_arg_val, PTR(Cont) rest);
+    Val call(Val actual_arg);
+    void call_step(StepMachine &step, Val actual_arg_val, PTR(Cont) rest);
+    
+    // To mark the function this refers to, if any
+    void trace(Heap &heap);
+    
+private:
+    /* Low two bits: 00 for a `FunVal` pointer (or null),
+     01 for a number in the high 32 bits, 10 for a boolean. */
+    uint64_t bits;
 };
     
-class BoolVal : public Val {
+/* A name in scope where a `_fun` is made, followed by the
+ ones in scope before it, innermost first: what the
+ closure's environment would hold, binding by binding, if
+ environments were keyed by name. `level` counts frames
+ from the outermost one, so from a closure made at `level`
+ L a binding is `L - level` frames out. */
+class Binding {
 public:
-    bool rep;
-    BoolVal(bool rep);
-    bool equals(PTR(Val) val);
-    PTR(Val) add_to(PTR(Val) other_val);
-    PTR(Val) mult_with(PTR(Val) other_val);
-    PTR(Expr) to_expr();
-    std::string to_string();
-    PTR(Val) call(PTR(Val) actual_arg);
-    void call_step(PTR(Val) actual_arg_val, PTR(Cont) rest);
-};
+    std::string name;
+    int level;
+    int slot;
+    std::shared_ptr<const Binding> next;
     
-class FunVal : public Val {
+    Binding(std::string name, int level, int slot, std::shared_ptr<const Binding> next);
+};
+
+typedef std::shared_ptr<const Binding> Bindings;
+
+class FunVal : public Collectable {
 public:
     std::string formal_arg;
     PTR(Expr) body;
     PTR(Env) env;
+    int frame_size;
+    // What `equals` compares of `env`; see `FunExpr`
+    Bindings in_scope;
+    int level;
     
-    FunVal(std::string formal_arg, PTR(Expr) body, PTR(Env) env);
-    bool equals(PTR(Val) val);
-    PTR(Val) add_to(PTR(Val) other_val);
-    PTR(Val) mult_with(PTR(Val) other_val);
+    FunVal(std::string formal_arg, PTR(Expr) body, PTR(Env) env, int frame_size,
+           Bindings in_scope = nullptr, int level = 0);
+    bool equals(PTR(FunVal) f);
     PTR(Expr) to_expr();
-    std::string to_string();
-    PTR(Val) call(PTR(Val) actual_arg);
-    void call_step(PTR(Val) actual_arg_val, PTR(Cont) rest);
+    Val call(Val actual_arg);
+    void call_step(StepMachine &step, Val actual_arg_val, PTR(Cont) rest);
+    void trace(Heap &heap);
 };
 
+inline Val::Val() : bits(0) { }
+
+inline Val::Val(PTR(FunVal) fun) : bits((uint64_t)(uintptr_t)fun) { }
+
+inline Val Val::num(int rep) {
+    Val v;
+    v.bits = ((uint64_t)(uint32_t)rep << 32) | 1;
+    return v;
+}
+
+inline Val Val::boolean(bool rep) {
+    Val v;
+    v.bits = ((uint64_t)rep << 2) | 2;
+    return v;
+}
+
+inline bool Val::is_num() const { return (bits & 3) == 1; }
+inline bool Val::is_bool() const { return (bits & 3) == 2; }
+inline bool Val::is_fun() const { return (bits & 3) == 0 && bits != 0; }
+inline bool Val::is_null() const { return bits == 0; }
+inline int Val::num_rep() const { return (int)(uint32_t)(bits >> 32); }
+inline bool Val::bool_rep() const { return (bits >> 2) & 1; }
+inline PTR(FunVal) Val::fun() const { return (PTR(FunVal))(uintptr_t)bits; }
+
+// Number arithmetic wraps around on overflow, done in
+// unsigned since signed overflow is undefined
+inline int wrap_add(int a, int b) { return (int)((uint32_t)a + (uint32_t)b); }
+inline int wrap_mult(int a, int b) { return (int)((uint32_t)a * (uint32_t)b); }
+
 
 #endif /* value_hpp */
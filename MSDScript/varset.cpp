@@ -0,0 +1,155 @@
+//
+//  varset.cpp
+//  ArithemticParser2
+//
+//  Persistent sets of variable names.
+//
+
+#include "varset.hpp"
+#include <functional>
+
+VarNode::VarNode(const std::string &name, size_t priority, VarSet left, VarSet right) {
+    this->name = name;
+    this->priority = priority;
+    this->left = left;
+    this->right = right;
+    this->count = 1 + vars_count(left) + vars_count(right);
+}
+
+// Priorities come from the name, so a set has the same
+// shape however it was built
+static bool above(const VarSet &a, const VarSet &b) {
+    if (a->priority != b->priority)
+        return a->priority > b->priority;
+    return a->name < b->name;
+}
+
+// `t` with new children, or `t` itself if they are the same
+static VarSet rebuild(const VarSet &t, const VarSet &left, const VarSet &right) {
+    if (left == t->left && right == t->right)
+        return t;
+    return std::make_shared<const VarNode>(t->name, t->priority, left, right);
+}
+
+// Splits `t` into the names before and after `name`
+static void split(const VarSet &t, const std::string &name, VarSet &left, VarSet &right) {
+    if (t == nullptr) {
+        left = nullptr;
+        right = nullptr;
+        return;
+    }
+    int order = name.compare(t->name);
+    if (order == 0) {
+        left = t->left;
+        right = t->right;
+    } else if (order < 0) {
+        VarSet inner_right;
+        split(t->left, name, left, inner_right);
+        right = rebuild(t, inner_right, t->right);
+    } else {
+        VarSet inner_left;
+        split(t->right, name, inner_left, right);
+        left = rebuild(t, t->left, inner_left);
+    }
+}
+
+// Joins two sets where every name in `a` comes before `b`
+static VarSet join(const VarSet &a, const VarSet &b) {
+    if (a == nullptr)
+        return b;
+    if (b == nullptr)
+        return a;
+    if (above(a, b))
+        return rebuild(a, a->left, join(a->right, b));
+    return rebuild(b, join(a, b->left), b->right);
+}
+
+VarSet vars_of(const std::string &name) {
+    return std::make_shared<const VarNode>(name, std::hash<std::string>()(name), nullptr, nullptr);
+}
+
+VarSet vars_union(const VarSet &a, const VarSet &b) {
+    if (b == nullptr || a == b)
+        return a;
+    if (a == nullptr)
+        return b;
+    if (above(b, a))
+        return vars_union(b, a);
+    VarSet left, right;
+    split(b, a->name, left, right);
+    return rebuild(a, vars_union(a->left, left), vars_union(a->right, right));
+}
+
+VarSet vars_without(const VarSet &a, const std::string &name) {
+    if (a == nullptr)
+        return a;
+    int order = name.compare(a->name);
+    if (order == 0)
+        return join(a->left, a->right);
+    if (order < 0)
+        return rebuild(a, vars_without(a->left, name), a->right);
+    return rebuild(a, a->left, vars_without(a->right, name));
+}
+
+bool vars_contain(const VarSet &a, const std::string &name) {
+    const VarNode *t = a.get();
+    while (t != nullptr) {
+        int order = name.compare(t->name);
+        if (order == 0)
+            return true;
+        t = (order < 0) ? t->left.get() : t->right.get();
+    }
+    return false;
+}
+
+void vars_list(const VarSet &a, std::vector<std::string> &names) {
+    if (a == nullptr)
+        return;
+    vars_list(a->left, names);
+    names.push_back(a->name);
+    vars_list(a->right, names);
+}
+
+/* for tests */
+#include <sstream>
+#include "parse.hpp"
+#include "expr.hpp"
+#include "arena.hpp"
+#include "catch.hpp"
+
+static std::string listed(const VarSet &a) {
+    std::vector<std::string> names;
+    vars_list(a, names);
+    std::string out;
+    for (size_t i = 0; i < names.size(); i++)
+        out += (i == 0 ? "" : " ") + names[i];
+    return out;
+}
+
+TEST_CASE( "variable sets" ) {
+    VarSet ab = vars_union(vars_of("b"), vars_of("a"));
+    CHECK( listed(ab) == "a b" );
+    CHECK( vars_count(ab) == 2 );
+    CHECK( vars_contain(ab, "a") );
+    CHECK( !vars_contain(ab, "c") );
+    // Covered sets are shared, not copied
+    CHECK( vars_union(ab, vars_of("a")) == ab );
+    CHECK( vars_union(nullptr, ab) == ab );
+    CHECK( listed(vars_without(ab, "a")) == "b" );
+    CHECK( vars_without(vars_of("a"), "a") == nullptr );
+    CHECK( vars_without(ab, "c") == ab );
+    
+    VarSet many = nullptr;
+    for (int i = 0; i < 1000; i++)
+        many = vars_union(many, vars_of(std::string(1, 'a' + i % 26) + std::string(i / 26, 'z')));
+    CHECK( vars_count(many) == 1000 );
+    CHECK( vars_count(vars_union(many, ab)) == 1000 );
+    
+    // Each node knows its free variables
+    ParseSession session;
+    std::stringstream input("_let x = y _in _fun (z) x + z + w(q)");
+    PTR(Expr) e = parse(input);
+    CHECK( listed(e->free_vars) == "q w y" );
+    CHECK( listed(CAST(LetExpr)(e)->expr->free_vars) == "q w x" );
+    CHECK( !MAKE(NumExpr)(1)->containsVar() );
+}
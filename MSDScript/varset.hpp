@@ -0,0 +1,53 @@
+//
+//  varset.hpp
+//  ArithemticParser2
+//
+//  Persistent sets of variable names.
+//
+
+#ifndef varset_hpp
+#define varset_hpp
+
+#include <stddef.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+class VarNode;
+
+/* An immutable set of names, as a treap ordered by name.
+ The empty set is nullptr. Adding or removing a name
+ copies only one path of the tree, so a set and the sets
+ made from it share nearly all of their nodes: every
+ node of an expression can keep its own set without the
+ total growing with the square of the program. */
+typedef std::shared_ptr<const VarNode> VarSet;
+
+class VarNode {
+public:
+    std::string name;
+    size_t priority;
+    size_t count;
+    VarSet left;
+    VarSet right;
+
+    VarNode(const std::string &name, size_t priority, VarSet left, VarSet right);
+};
+
+VarSet vars_of(const std::string &name);
+
+// Shares `a` or `b` when one already covers the other
+VarSet vars_union(const VarSet &a, const VarSet &b);
+
+VarSet vars_without(const VarSet &a, const std::string &name);
+
+bool vars_contain(const VarSet &a, const std::string &name);
+
+inline size_t vars_count(const VarSet &a) {
+    return a == nullptr ? 0 : a->count;
+}
+
+// Appends the names in `a` to `names`, in order
+void vars_list(const VarSet &a, std::vector<std::string> &names);
+
+#endif /* varset_hpp */
@@ -0,0 +1,395 @@
+//
+//  vm.cpp
+//  ArithemticParser2
+//
+//  Bytecode compiler and stack machine for MSDScript.
+//
+
+#include <stdexcept>
+#include <memory>
+#include <sstream>
+#include "vm.hpp"
+#include "expr.hpp"
+#include "parse.hpp"
+#include "resolve.hpp"
+#include "arena.hpp"
+#include "API.hpp"
+#include "catch.hpp"
+
+Proto::Proto(std::string formal_arg, PTR(Expr) body) {
+    this->formal_arg = formal_arg;
+    this->body = body;
+    this->num_locals = 0;
+}
+
+Closure::Closure(PTR(Proto) proto) {
+    this->proto = proto;
+}
+
+void Closure::trace(Heap &heap) {
+    for (size_t i = 0; i < captured.size(); i++)
+        heap.mark(captured[i].fun);
+}
+
+//Program
+Program::Program() { }
+
+// The heap, and the closures in it, go after this
+Program::~Program() {
+    for (size_t i = 0; i < protos.size(); i++)
+        delete protos[i];
+}
+
+//VMVal
+static VMVal make_val(VMVal::kind_t kind, int rep) {
+    VMVal v;
+    v.kind = kind;
+    v.rep = rep;
+    v.fun = nullptr;
+    return v;
+}
+
+// Like `Val::equals`, except that functions compare only the
+// values they captured rather than their whole defining
+// environment.
+bool VMVal::equals(const VMVal &other) const {
+    if (kind != other.kind)
+        return false;
+    if (kind != fun_kind)
+        return rep == other.rep;
+    if (fun == other.fun)
+        return true;
+    if (fun->proto->formal_arg != other.fun->proto->formal_arg
+        || !fun->proto->body->equals(other.fun->proto->body)
+        || fun->captured.size() != other.fun->captured.size())
+        return false;
+    for (size_t i = 0; i < fun->captured.size(); i++) {
+        if (!fun->captured[i].equals(other.fun->captured[i]))
+            return false;
+    }
+    return true;
+}
+
+std::string VMVal::to_string() const {
+    switch (kind) {
+        case num_kind:
+            return std::to_string(rep);
+        case bool_kind:
+            return rep ? "_true" : "_false";
+        default:
+            return "[FUNCTION]";
+    }
+}
+
+//Compiler
+Compiler::Compiler(PTR(Program) program, PTR(Proto) proto, Compiler *enclosing) {
+    this->program = program;
+    this->proto = proto;
+    this->enclosing = enclosing;
+}
+
+void Compiler::emit(op_t op, int arg) {
+    Instr in;
+    in.op = op;
+    in.arg = arg;
+    proto->code.push_back(in);
+}
+
+int Compiler::here() {
+    return (int)proto->code.size();
+}
+
+// Point the jump at `at` to the next instruction.
+void Compiler::patch(int at) {
+    proto->code[at].arg = here();
+}
+
+int Compiler::bind(std::string name) {
+    int slot = (int)scope.size();
+    scope.push_back(std::make_pair(name, slot));
+    if (proto->num_locals < slot + 1)
+        proto->num_locals = slot + 1;
+    return slot;
+}
+
+void Compiler::unbind() {
+    scope.pop_back();
+}
+
+bool Compiler::find_local(std::string name, int &slot) {
+    for (size_t i = scope.size(); i > 0; i--) {
+        if (scope[i - 1].first == name) {
+            slot = scope[i - 1].second;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool Compiler::find_captured(std::string name, int &index) {
+    for (size_t i = 0; i < captured_names.size(); i++) {
+        if (captured_names[i] == name) {
+            index = (int)i;
+            return true;
+        }
+    }
+    if (enclosing == nullptr)
+        return false;
+
+    Capture capture;
+    int from;
+    if (enclosing->find_local(name, from))
+        capture.from_local = true;
+    else if (enclosing->find_captured(name, from))
+        capture.from_local = false;
+    else
+        return false;
+    capture.index = from;
+
+    index = (int)captured_names.size();
+    captured_names.push_back(name);
+    proto->captures.push_back(capture);
+    return true;
+}
+
+void Compiler::load(std::string name) {
+    int index;
+    if (find_local(name, index)) {
+        emit(OP_LOCAL, index);
+    } else if (find_captured(name, index)) {
+        emit(OP_CAPTURED, index);
+    } else {
+        // Like `interp`, only complain if the reference is reached.
+        emit(OP_FREE, (int)program->names.size());
+        program->names.push_back(name);
+    }
+}
+
+int Compiler::compile_function(std::string formal_arg, PTR(Expr) body) {
+    PTR(Proto) fun_proto = NEW(Proto)(formal_arg, body);
+    int index = (int)program->protos.size();
+    program->protos.push_back(fun_proto);
+
+    Compiler inner(program, fun_proto, this);
+    inner.bind(formal_arg);
+    body->compile(inner, true);
+    inner.emit(OP_RETURN);
+    return index;
+}
+
+//VM
+PTR(Program) VM::compile(PTR(Expr) e) {
+    PTR(Program) program = NEW(Program)();
+    PTR(Proto) top = NEW(Proto)("", e);
+    program->protos.push_back(top);
+
+    Compiler c(program, top, nullptr);
+    e->compile(c, true);
+    c.emit(OP_RETURN);
+    return program;
+}
+
+struct Frame {
+    PTR(Proto) proto;
+    PTR(Closure) closure;
+    size_t base;
+    size_t pc;
+};
+
+// Raise the same errors as `NumVal::add_to` and friends.
+static void arith_error(const VMVal &lhs, bool add) {
+    if (lhs.kind == VMVal::num_kind)
+        throw std::runtime_error("This is not a number");
+    if (lhs.kind == VMVal::bool_kind)
+        throw std::runtime_error(add ? "Booleans could not add" : "Booleans could not multiply");
+    throw std::runtime_error(add ? "Functions could not add." : "Functions could not multiply.");
+}
+
+// The only references to closures are on the stack, in
+// the saved frames and in the running closure
+static void collect_closures(Heap &heap, const std::vector<VMVal> &stack,
+                             const std::vector<Frame> &frames, PTR(Closure) closure) {
+    for (size_t i = 0; i < stack.size(); i++)
+        heap.mark(stack[i].fun);
+    for (size_t i = 0; i < frames.size(); i++)
+        heap.mark(frames[i].closure);
+    heap.mark(closure);
+    heap.collect();
+}
+
+VMVal VM::run(PTR(Program) program) {
+    CurrentHeap current(&program->heap);
+    std::vector<VMVal> stack;
+    std::vector<Frame> frames;
+
+    PTR(Proto) proto = program->protos[0];
+    PTR(Closure) closure = nullptr;
+    const Instr *code = &proto->code[0];
+    size_t pc = 0;
+    size_t base = 0;
+    stack.reserve(256);
+    stack.resize(proto->num_locals);
+
+    while (1) {
+        const Instr &in = code[pc++];
+        switch (in.op) {
+            case OP_NUM:
+                stack.push_back(make_val(VMVal::num_kind, in.arg));
+                break;
+            case OP_BOOL:
+                stack.push_back(make_val(VMVal::bool_kind, in.arg));
+                break;
+            case OP_LOCAL:
+                stack.push_back(stack[base + in.arg]);
+                break;
+            case OP_CAPTURED:
+                stack.push_back(closure->captured[in.arg]);
+                break;
+            case OP_FREE:
+                throw std::runtime_error("free variable: " + program->names[in.arg]);
+            case OP_STORE:
+                stack[base + in.arg] = stack.back();
+                stack.pop_back();
+                break;
+            case OP_ADD:
+            case OP_MULT: {
+                VMVal &lhs = stack[stack.size() - 2];
+                const VMVal &rhs = stack.back();
+                if (lhs.kind != VMVal::num_kind || rhs.kind != VMVal::num_kind)
+                    arith_error(lhs, in.op == OP_ADD);
+                if (in.op == OP_ADD)
+                    lhs.rep = wrap_add(lhs.rep, rhs.rep);
+                else
+                    lhs.rep = wrap_mult(lhs.rep, rhs.rep);
+                stack.pop_back();
+                break;
+            }
+            case OP_EQ: {
+                VMVal &lhs = stack[stack.size() - 2];
+                bool same = lhs.equals(stack.back());
+                lhs = make_val(VMVal::bool_kind, same);
+                stack.pop_back();
+                break;
+            }
+            case OP_JUMP:
+                pc = in.arg;
+                break;
+            case OP_JUMP_UNLESS_TRUE: {
+                // `IfExpr::interp` takes the else branch for any non-`_true` value
+                const VMVal &test = stack.back();
+                if (test.kind != VMVal::bool_kind || !test.rep)
+                    pc = in.arg;
+                stack.pop_back();
+                break;
+            }
+            case OP_CLOSURE: {
+                if (program->heap.wants_collection())
+                    collect_closures(program->heap, stack, frames, closure);
+                PTR(Proto) fun_proto = program->protos[in.arg];
+                PTR(Closure) fun = NEW(Closure)(fun_proto);
+                fun->captured.reserve(fun_proto->captures.size());
+                for (size_t i = 0; i < fun_proto->captures.size(); i++) {
+                    const Capture &capture = fun_proto->captures[i];
+                    if (capture.from_local)
+                        fun->captured.push_back(stack[base + capture.index]);
+                    else
+                        fun->captured.push_back(closure->captured[capture.index]);
+                }
+                VMVal v = make_val(VMVal::fun_kind, 0);
+                v.fun = fun;
+                stack.push_back(v);
+                break;
+            }
+            case OP_CALL:
+            case OP_TAIL_CALL: {
+                size_t fun_at = stack.size() - 2;
+                if (stack[fun_at].kind != VMVal::fun_kind)
+                    throw std::runtime_error("Function call error occured");
+                PTR(Closure) fun = stack[fun_at].fun;
+                VMVal arg = stack.back();
+
+                size_t new_base = fun_at;
+                if (in.op == OP_CALL) {
+                    Frame f;
+                    f.proto = proto;
+                    f.closure = closure;
+                    f.base = base;
+                    f.pc = pc;
+                    frames.push_back(f);
+                } else {
+                    new_base = base;
+                }
+                stack.resize(new_base + fun->proto->num_locals);
+                stack[new_base] = arg;
+
+                base = new_base;
+                closure = fun;
+                proto = fun->proto;
+                code = &proto->code[0];
+                pc = 0;
+                break;
+            }
+            case OP_RETURN: {
+                VMVal result = stack.back();
+                if (frames.empty())
+                    return result;
+                stack.resize(base);
+                stack.push_back(result);
+
+                const Frame &f = frames.back();
+                proto = f.proto;
+                closure = f.closure;
+                base = f.base;
+                pc = f.pc;
+                code = &proto->code[0];
+                frames.pop_back();
+                break;
+            }
+        }
+    }
+}
+
+std::string VM::interp(PTR(Expr) e) {
+    std::unique_ptr<Program> program(compile(e));
+    return run(program.get()).to_string();
+}
+
+/* for tests */
+static std::string vm_run(std::string program) {
+    std::stringstream input(program);
+    return vm_interp(input);
+}
+
+static const char countdown[] =
+    "_let loop = _fun (f) _fun (n) _if n == 0 _then 0 _else f(f)(n + -1) "
+    "_in loop(loop)(1000000)";
+
+TEST_CASE( "vm results" ) {
+    CHECK( vm_run("1 + 2 * 3") == "7" );
+    CHECK( vm_run("_let x = 5 _in _let y = x + 1 _in x * y") == "30" );
+    CHECK( vm_run("_if 1 == 2 _then 1 _else 2") == "2" );
+    CHECK( vm_run("_if 1 _then 1 _else 2") == "2" );
+    CHECK( vm_run("_fun (x) x") == "[FUNCTION]" );
+    CHECK( vm_run("_let add = _fun (x) _fun (y) x + y _in add(3)(4)") == "7" );
+    CHECK( vm_run("2147483647 + 1") == "-2147483648" );
+    CHECK( vm_run("(_fun (x) x) == (_fun (x) x)") == "_true" );
+    CHECK( vm_run("(_fun (u) _fun (y) u) (1) == (_fun (u) _fun (y) u) (2)") == "_false" );
+}
+
+TEST_CASE( "vm errors" ) {
+    CHECK_THROWS_WITH( vm_run("_true + 1"), "Booleans could not add" );
+    CHECK_THROWS_WITH( vm_run("(_fun (x) x) * 1"), "Functions could not multiply." );
+    CHECK_THROWS_WITH( vm_run("1 + _true"), "This is not a number" );
+    CHECK_THROWS_WITH( vm_run("1(2)"), "Function call error occured" );
+}
+
+TEST_CASE( "vm tail calls and closure collection" ) {
+    ParseSession session;
+    std::stringstream input(countdown);
+    std::unique_ptr<Program> program(VM::compile(resolve(parse(input))));
+    CHECK( VM::run(program.get()).to_string() == "0" );
+    // A closure per iteration, but only a few alive at once
+    CHECK( program->heap.stats.objects_allocated >= 1000000 );
+    CHECK( program->heap.stats.collections > 0 );
+    CHECK( program->heap.stats.peak_bytes < 4 * 1024 * 1024 );
+}
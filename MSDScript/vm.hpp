@@ -0,0 +1,153 @@
+//
+//  vm.hpp
+//  ArithemticParser2
+//
+//  Bytecode compiler and stack machine for MSDScript.
+//
+
+#ifndef vm_hpp
+#define vm_hpp
+
+#include <string>
+#include <vector>
+#include "pointer.hpp"
+#include "gc.hpp"
+
+class Expr;
+class Closure;
+
+typedef enum {
+    OP_NUM,             // push the number `arg`
+    OP_BOOL,            // push the boolean `arg`
+    OP_LOCAL,           // push local slot `arg` of the current frame
+    OP_CAPTURED,        // push captured value `arg` of the running closure
+    OP_FREE,            // fail with "free variable: " + names[arg]
+    OP_STORE,           // pop a value into local slot `arg`
+    OP_ADD,
+    OP_MULT,
+    OP_EQ,
+    OP_JUMP,            // continue at `arg`
+    OP_JUMP_UNLESS_TRUE,// pop a value, continue at `arg` unless it is `_true`
+    OP_CLOSURE,         // push a closure for function prototype `arg`
+    OP_CALL,            // pop an argument and a function, and call it
+    OP_TAIL_CALL,       // like OP_CALL, but replaces the current frame
+    OP_RETURN
+} op_t;
+
+struct Instr {
+    op_t op;
+    int arg;
+};
+
+/* Where a closure takes a captured value from when it
+ is created: a local slot of the creating frame, or a
+ value captured by the creating closure itself. */
+struct Capture {
+    bool from_local;
+    int index;
+};
+
+/* The compiled form of one `_fun` body (or of the whole
+ program, for prototype 0). Slot 0 of a function frame
+ holds the argument; `_let`s get the following slots. */
+class Proto {
+public:
+    std::string formal_arg;
+    PTR(Expr) body;
+    std::vector<Instr> code;
+    int num_locals;
+    std::vector<Capture> captures;
+
+    Proto(std::string formal_arg, PTR(Expr) body);
+};
+
+/* A compiled program owns its prototypes, and the heap its
+ closures are made in while it runs. Closures that become
+ unreachable are collected during the run; deleting the
+ program frees the rest. */
+class Program {
+public:
+    std::vector<PTR(Proto)> protos;
+    std::vector<std::string> names;
+    Heap heap;
+
+    Program();
+    ~Program();
+
+private:
+    Program(const Program &);
+    Program &operator=(const Program &);
+};
+
+/* A value on the VM stack. Numbers and booleans are
+ stored inline; only closures live on the heap. */
+struct VMVal {
+    typedef enum {
+        num_kind,
+        bool_kind,
+        fun_kind
+    } kind_t;
+
+    kind_t kind;
+    int rep;
+    PTR(Closure) fun;
+
+    bool equals(const VMVal &other) const;
+    std::string to_string() const;
+};
+
+class Closure : public Collectable {
+public:
+    PTR(Proto) proto;
+    std::vector<VMVal> captured;
+
+    Closure(PTR(Proto) proto);
+    void trace(Heap &heap);
+};
+
+/* Per-function compilation state used by `Expr::compile`. */
+class Compiler {
+public:
+    PTR(Program) program;
+    PTR(Proto) proto;
+    Compiler *enclosing;
+
+    Compiler(PTR(Program) program, PTR(Proto) proto, Compiler *enclosing);
+
+    void emit(op_t op, int arg = 0);
+    int here();
+    void patch(int at);
+
+    // Bind `name` to a fresh local slot until `unbind` is called.
+    int bind(std::string name);
+    void unbind();
+
+    // Emit the load of a variable, capturing it from
+    // enclosing functions as needed.
+    void load(std::string name);
+
+    // Compile a `_fun` body to a new prototype, returning its index.
+    int compile_function(std::string formal_arg, PTR(Expr) body);
+
+private:
+    std::vector<std::pair<std::string, int> > scope;
+    std::vector<std::string> captured_names;
+
+    bool find_local(std::string name, int &slot);
+    bool find_captured(std::string name, int &index);
+};
+
+class VM {
+public:
+    /* Compile an expression to bytecode. */
+    static PTR(Program) compile(PTR(Expr) e);
+
+    /* Run a compiled program to completion. Closures in the
+     result live in `program`'s heap and die with it. */
+    static VMVal run(PTR(Program) program);
+
+    // Compiles and runs `e`, freeing the program before returning
+    static std::string interp(PTR(Expr) e);
+};
+
+#endif /* vm_hpp */